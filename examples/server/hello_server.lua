@@ -0,0 +1,112 @@
+-- Create the server table
+local server <const> = init_server()
+
+-- Serve a file on GET /. Files are sent with an ETag and Last-Modified, so
+-- clients revalidating a copy they have get an empty 304, and Range requests
+-- for part of a file (resumed downloads) get just that part with a 206.
+-- Clients accepting gzip or zstd get index.html.gz or index.html.zst when
+-- those exist and are up to date; with compress_cache_size set (see below)
+-- other files are gzipped on first request and kept compressed.
+server.bind("/", "index.html")
+
+-- Echo POST bodies back to the client
+server.handle_post("/echo", function(data, size, socket)
+    server.cwrite("HTTP/1.1 200 OK\r\nContent-Length: " .. size .. "\r\n\r\n" .. data, socket)
+end)
+
+-- Routes may capture path segments (:name) and the rest of the path (*name);
+-- any method works, and "*" registers a handler for all of them. Route
+-- handlers get a request object, whose fields (method, path, query, body,
+-- headers, cookies, params) are only converted when read, and a response
+-- object that builds the status line and headers, including Content-Length.
+server.route("GET", "/hello/:name", function(req, res)
+    res:header("Content-Type", "text/plain")
+    res:send("Hello, ", req.params.name, " from ", req:header("User-Agent") or "nowhere", "!")
+end)
+
+-- {cache = seconds} keeps a route's responses, keyed by method, path and
+-- query (plus body, and any headers listed as {ttl = s, vary = {...}}).
+-- Hits are answered without running Lua, and identical requests arriving
+-- while one is being answered wait for it rather than run the handler too.
+server.route("GET", "/report/:day", function(req, res)
+    res:header("Content-Type", "text/plain")
+    res:send("report for ", req.params.day, "\n")
+end, {cache = {ttl = 10, vary = {"Accept-Language"}}})
+
+-- Bodies of unknown size are streamed with write() and chunked encoding;
+-- write() waits whenever the client falls behind, so this never holds more
+-- than a little of the body in memory. finish() (or returning) ends it.
+server.route("GET", "/count/:n", function(req, res)
+    res:header("Content-Type", "text/plain")
+    for i = 1, tonumber(req.params.n) or 0 do
+        res:write(i, "\n")
+    end
+    res:finish()
+end)
+
+-- Handlers run as coroutines: connect/send/recv yield to the event loop while
+-- they wait, so other clients keep being served in the meantime.
+server.handle_post("/upstream", function(data, size, socket)
+    local upstream = assert(server.connect("127.0.0.1", 9000))
+    server.send(upstream, data)
+    local reply = server.recv(upstream) or ""
+    server.close(upstream)
+    server.cwrite("HTTP/1.1 200 OK\r\nContent-Length: " .. #reply .. "\r\n\r\n" .. reply, socket)
+end)
+
+-- aio.read/write/stat/list run on a small pool of threads: without a
+-- callback a handler waits for the result while other clients are served.
+server.route("GET", "/files", function(req, res)
+    local names, err = aio.list(".")
+    res:send(names and table.concat(names, "\n") or err, "\n")
+end)
+
+-- WebSocket routes: the handshake is answered before the handler runs, and
+-- whole messages (fragments reassembled, text checked to be UTF-8) reach
+-- on_message. send() never blocks; an idle WebSocket costs only memory.
+server.websocket("/chat/:room", function(req, ws)
+    ws:send("joined " .. req.params.room)
+    ws.on_message = function(ws, data, binary)
+        ws:send(data, binary)
+    end
+    ws.on_close = function(ws, code, reason) end
+end)
+
+-- Request, connection and latency counters of every worker, for Prometheus
+-- on GET /metrics and for Lua as server.stats().
+server.metrics("/metrics")
+server.route("GET", "/health", function(req, res)
+    local stats = server.stats()
+    res:send("open connections: ", stats.connections_open, ", p99: ", stats.latency.p99 * 1000, " ms\n")
+end)
+
+-- Timers run on the serving loop: after(ms, fn) calls fn once, every(ms, fn)
+-- until cancel(id) is called with the id either returns.
+local ticks = 0
+server.every(60 * 1000, function()
+    ticks = ticks + 1
+end)
+
+-- Start serving. The default mode multiplexes every connection on one epoll
+-- loop; {mode = "io_uring"} lets the kernel do the socket I/O itself on Linux
+-- 6.0 and later (falling back to epoll elsewhere), and {mode = "blocking"}
+-- handles one connection at a time instead.
+-- Connections are kept alive between requests as long as every response
+-- carries a Content-Length, and closed after idle_timeout quiet seconds.
+-- Clients get header_timeout seconds to send a request head and may stall a
+-- body for body_timeout seconds before they are answered 408 and dropped.
+-- access_log = "access.log" (or "-" for stdout) appends a combined-format
+-- line per request, written by a background thread; should the disk fall
+-- behind, lines are dropped and counted in the metrics rather than waited on.
+-- file_cache_size keeps small static files in memory (LRU, bytes), and
+-- compress_cache_size their gzipped versions, shared by all workers;
+-- response_cache_size bounds each worker's cache of route responses.
+-- workers = N runs this whole script again in N - 1 extra threads, each with
+-- its own interpreter and listener (0 means one per CPU), so keep anything
+-- with side effects after run() or guard it.
+-- listen adds addresses to the port (which may then be left out): Unix
+-- sockets for a local reverse proxy ("unix:/run/app.sock", or
+-- {path = ..., mode = "660"}), "[::]:8080" for IPv6 and IPv4 alike, or
+-- "127.0.0.1:8081"; backlog sets how many connections may queue for accept.
+server.run(8080, {mode = "epoll", keep_alive = true, idle_timeout = 5, file_cache_size = 8 * 1024 * 1024,
+                  compress_cache_size = 8 * 1024 * 1024})
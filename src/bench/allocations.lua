@@ -0,0 +1,14 @@
+-- Server for allocations.sh: one route per way a request can be answered,
+-- served in the mode given on the command line.
+local server <const> = init_server()
+server.bind("/", "bench/allocations.lua")
+server.route("GET", "/hello/:name", function(req, res)
+    res:send("hello ", req.params.name)
+end)
+server.route("GET", "/cached", function(req, res)
+    res:send("cached")
+end, {cache = 3600})
+server.handle_post("/echo", function(data, size, socket)
+    server.cwrite("HTTP/1.1 200 OK\r\nContent-Length: " .. size .. "\r\n\r\n" .. data, socket)
+end)
+server.run(tonumber(arg[2]) or 8089, {mode = arg[1], keep_alive = true})
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Heap allocations per request, counted with malloc_count.so preloaded into
+# the server, for each way a request can be answered.
+#
+#   make lunar loadgen malloc_count.so && sh bench/allocations.sh [seconds]
+#
+# Each load runs once to warm up (pools, caches and buffers reach their
+# steady size) and once measured. The "new conn" load opens a connection per
+# request, so it shows what accepting and closing costs. Lua handlers still
+# allocate their request and response objects inside the interpreter; those
+# show up as reallocs, the Lua allocator's only call. Run from src/.
+duration=${1:-2}
+port=8089
+counts=$(mktemp)
+trap 'rm -f "$counts"' EXIT
+
+snapshot() {
+    kill -USR2 "$1"
+    sleep 0.1
+    cat "$counts"
+}
+
+run() {
+    mode=$1
+    label=$2
+    shift 2
+    ./loadgen -p "$port" -c 16 -d 1 "$@" > /dev/null
+    before=$(snapshot "$pid")
+    out=$(./loadgen -p "$port" -c 16 -d "$duration" "$@")
+    after=$(snapshot "$pid")
+    requests=$(echo "$out" | awk '/requests in/ { print $1 }')
+    echo "$before $after" | awk -v mode="$mode" -v label="$label" -v requests="$requests" '{
+        printf "%-9s %-18s %10d %12.3f %12.3f %12.3f\n", mode, label, requests,
+               ($4 - $1) / requests, ($5 - $2) / requests, ($6 - $3) / requests
+    }'
+}
+
+printf "%-9s %-18s %10s %12s %12s %12s\n" mode load requests mallocs/req reallocs/req frees/req
+for mode in epoll io_uring; do
+    MALLOC_COUNT_FILE=$counts LD_PRELOAD=./malloc_count.so ./lunar bench/allocations.lua "$mode" "$port" > /dev/null &
+    pid=$!
+    sleep 0.5
+    run "$mode" "static keep-alive" -k /
+    run "$mode" "static new conn" /
+    run "$mode" "cached route" -k /cached
+    run "$mode" "Lua route" -k /hello/lunar
+    run "$mode" "Lua POST" -k -m POST -b hello /echo
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+    # io_uring releases its listener asynchronously after exit
+    port=$(( port + 1 ))
+done
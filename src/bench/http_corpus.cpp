@@ -0,0 +1,94 @@
+// Regression corpus for the request parser in custom/server.
+//
+//   make http_corpus && ./http_corpus [bench/http_corpus]
+//
+// Every <case>.<expected>.http in the directory is a raw request; expected is
+// "ok" for one the parser must accept, or the status it must fail with. A
+// <case>.body next to an accepted request is the body it must decode to.
+// Each request is parsed whole, one byte at a time and in 7-byte slices,
+// since a request straddling reads must come out the same.
+#include <dirent.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../custom/server/http_parser.cpp"
+
+using namespace std;
+
+static bool read_file(const string &path, string *out) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    ostringstream contents;
+    contents << in.rdbuf();
+    *out = contents.str();
+    return true;
+}
+
+// Parses request fed slice bytes at a time (all at once for 0). Returns "ok"
+// or the error status, with the body in *body.
+static string parse(const string &request, size_t slice, string *body) {
+    string buffer(request);
+    HttpRequest r;
+    http_request_reset(&r);
+    int result = HTTP_PARSE_AGAIN;
+    size_t fed = 0;
+    while (result == HTTP_PARSE_AGAIN && fed < buffer.size()) {
+        fed = slice ? min(fed + slice, buffer.size()) : buffer.size();
+        result = http_parse_request(&r, &buffer[0], fed, 0);
+    }
+    if (result == HTTP_PARSE_AGAIN) {
+        return "incomplete";
+    }
+    if (result == HTTP_PARSE_ERROR) {
+        return to_string(r.error_status);
+    }
+    body->assign(http_slice(buffer.data(), r.body));
+    return "ok";
+}
+
+int main(int argc, char **argv) {
+    string dir = argc > 1 ? argv[1] : "bench/http_corpus";
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        perror(dir.c_str());
+        return EXIT_FAILURE;
+    }
+    vector<string> cases;
+    while (dirent *entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".http") == 0) {
+            cases.push_back(name);
+        }
+    }
+    closedir(d);
+    sort(cases.begin(), cases.end());
+
+    int failures = 0;
+    for (const string &name : cases) {
+        string stem = name.substr(0, name.size() - 5);
+        size_t dot = stem.rfind('.');
+        string expected = stem.substr(dot + 1);
+        string request, expected_body;
+        read_file(dir + "/" + name, &request);
+        bool has_body = read_file(dir + "/" + stem.substr(0, dot) + ".body", &expected_body);
+
+        for (size_t slice : {(size_t)0, (size_t)1, (size_t)7}) {
+            string body;
+            string got = parse(request, slice, &body);
+            if (got != expected || (has_body && got == "ok" && body != expected_body)) {
+                printf("FAIL %s (slices of %zu): got %s%s\n", name.c_str(), slice, got.c_str(),
+                       got == expected ? " with the wrong body" : "");
+                failures++;
+            }
+        }
+    }
+    printf("%zu cases, %d failures\n", cases.size(), failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+// Throughput of the incremental request parser in custom/server.
+//
+//   make http_parser_bench && ./http_parser_bench [iterations]
+//
+// Each sample is parsed whole and then again fed in small slices, which is
+// what the parser sees when a request straddles several reads.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../custom/server/http_parser.cpp"
+
+using namespace std;
+
+struct Sample {
+    const char *name;
+    string request;
+};
+
+static double run(const Sample &sample, long iterations, size_t slice, size_t *checksum) {
+    string buffer;
+    HttpRequest request;
+    auto begin = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        // Chunked bodies are decoded in place, so every pass needs fresh bytes.
+        buffer.assign(sample.request);
+        http_request_reset(&request);
+        int result = HTTP_PARSE_AGAIN;
+        size_t fed = slice ? 0 : buffer.size();
+        while (result == HTTP_PARSE_AGAIN) {
+            fed = slice ? min(fed + slice, buffer.size()) : fed;
+            result = http_parse_request(&request, &buffer[0], fed, 0);
+        }
+        if (result != HTTP_PARSE_DONE) {
+            fprintf(stderr, "%s: parse failed with %d\n", sample.name, request.error_status);
+            exit(EXIT_FAILURE);
+        }
+        *checksum += request.header_count + request.body.len;
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+
+    string chunked_body;
+    for (int i = 0; i < 16; i++) {
+        chunked_body += "40\r\n" + string(64, 'x') + "\r\n";
+    }
+    chunked_body += "0\r\n\r\n";
+
+    vector<Sample> samples = {
+        {"get-minimal", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"},
+        {"get-browser",
+         "GET /static/app.js?v=42 HTTP/1.1\r\n"
+         "Host: example.com\r\n"
+         "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+         "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+         "Accept-Language: en-US,en;q=0.5\r\n"
+         "Accept-Encoding: gzip, deflate, br\r\n"
+         "Cookie: session=0123456789abcdef; theme=dark\r\n"
+         "Connection: keep-alive\r\n"
+         "Cache-Control: max-age=0\r\n\r\n"},
+        {"post-4k", "POST /submit HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\nContent-Length: 4096\r\n\r\n" +
+                        string(4096, 'a')},
+        {"post-chunked", "POST /upload HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n" + chunked_body},
+    };
+
+    size_t checksum = 0;
+    printf("%-14s %10s %12s %12s %14s\n", "sample", "bytes", "MB/s", "req/s", "MB/s (16B)");
+    for (const Sample &sample : samples) {
+        double whole = run(sample, iterations, 0, &checksum);
+        double sliced = run(sample, iterations / 4, 16, &checksum);
+        double bytes = (double)sample.request.size();
+        printf("%-14s %10zu %12.1f %12.0f %14.1f\n", sample.name, sample.request.size(),
+               bytes * iterations / whole / 1e6, iterations / whole, bytes * (iterations / 4) / sliced / 1e6);
+    }
+    printf("checksum %zu\n", checksum);
+    return 0;
+}
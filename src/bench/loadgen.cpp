@@ -0,0 +1,233 @@
+// Local HTTP load generator for the init_server() loop.
+//
+//   make loadgen
+//   ./loadgen -c 256 -d 10 /            (new connection per request)
+//   ./loadgen -c 256 -d 10 -k /         (keep-alive)
+//   ./loadgen -c 64 -s 8 /              (8 idle sockets that never send)
+//
+// Prints requests/sec and the latency distribution so the serving modes can be
+// compared against each other on the same box.
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Client {
+    int fd;
+    string request;
+    size_t sent;
+    string response;
+    long expected;                  // full response size once headers are in, else -1
+    bool server_closes;
+    chrono::steady_clock::time_point started;
+};
+
+static sockaddr_in target;
+static bool keep_alive = false;
+static int epoll_fd;
+static vector<double> latencies_us;
+static long errors = 0;
+
+static int connect_nonblocking() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr *)&target, sizeof(target)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void client_start(Client *c, bool reconnect) {
+    if (reconnect) {
+        c->fd = connect_nonblocking();
+        if (c->fd < 0) {
+            errors++;
+            return;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+    }
+    c->sent = 0;
+    c->response.clear();
+    c->expected = -1;
+    c->server_closes = false;
+    c->started = chrono::steady_clock::now();
+}
+
+static void client_send(Client *c) {
+    while (c->sent < c->request.size()) {
+        ssize_t n = send(c->fd, c->request.data() + c->sent, c->request.size() - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return;
+        }
+        c->sent += n;
+    }
+}
+
+static void parse_headers(Client *c) {
+    size_t end = c->response.find("\r\n\r\n");
+    if (end == string::npos) {
+        return;
+    }
+    string headers = c->response.substr(0, end);
+    for (char &ch : headers) {
+        ch = tolower(ch);
+    }
+    size_t cl = headers.find("content-length:");
+    c->expected = cl == string::npos ? -2 : (long)(end + 4 + strtol(headers.c_str() + cl + 15, nullptr, 10));
+    c->server_closes = !keep_alive || headers.find("connection: close") != string::npos;
+}
+
+static void client_done(Client *c, bool ok) {
+    if (ok) {
+        auto elapsed = chrono::steady_clock::now() - c->started;
+        latencies_us.push_back(chrono::duration<double, micro>(elapsed).count());
+    } else {
+        errors++;
+    }
+    if (keep_alive && ok && !c->server_closes) {
+        client_start(c, false);
+        client_send(c);
+        return;
+    }
+    close(c->fd);
+    client_start(c, true);
+}
+
+static void client_on_event(Client *c) {
+    if (c->fd < 0) {
+        return;
+    }
+    client_send(c);
+
+    char chunk[16384];
+    while (true) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            c->response.append(chunk, n);
+            if (c->expected == -1) {
+                parse_headers(c);
+            }
+            if (c->expected >= 0 && (long)c->response.size() >= c->expected) {
+                client_done(c, true);
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            // No Content-Length: the response ends when the server closes.
+            client_done(c, c->expected == -2 || (c->expected >= 0 && (long)c->response.size() >= c->expected));
+            return;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_done(c, false);
+        }
+        return;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = 8080;
+    int connections = 64;
+    int idle = 0;
+    double duration = 5;
+    const char *method = "GET";
+    const char *body = "";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:s:m:b:k")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 's': idle = atoi(optarg); break;
+            case 'm': method = optarg; break;
+            case 'b': body = optarg; break;
+            case 'k': keep_alive = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-c conns] [-d secs] [-s idle] [-m method] [-b body] [-k] path\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : "/";
+
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+        fprintf(stderr, "invalid host %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    epoll_fd = epoll_create1(0);
+
+    // Idle sockets model slow clients: they connect and never send a byte.
+    vector<int> idle_fds;
+    for (int i = 0; i < idle; i++) {
+        int fd = connect_nonblocking();
+        if (fd >= 0) {
+            idle_fds.push_back(fd);
+        }
+    }
+
+    char request[1024];
+    snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\nContent-Length: %zu\r\n\r\n%s",
+             method, path, host, keep_alive ? "keep-alive" : "close", strlen(body), body);
+
+    vector<Client> clients(connections);
+    for (Client &c : clients) {
+        c.request = request;
+        client_start(&c, true);
+    }
+
+    auto begin = chrono::steady_clock::now();
+    auto deadline = begin + chrono::duration<double>(duration);
+    epoll_event events[512];
+    while (chrono::steady_clock::now() < deadline) {
+        int count = epoll_wait(epoll_fd, events, 512, 100);
+        for (int i = 0; i < count; i++) {
+            client_on_event((Client *)events[i].data.ptr);
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    sort(latencies_us.begin(), latencies_us.end());
+    auto pct = [](double p) {
+        if (latencies_us.empty()) {
+            return 0.0;
+        }
+        return latencies_us[min(latencies_us.size() - 1, (size_t)(p * latencies_us.size()))];
+    };
+
+    printf("%zu requests in %.2fs, %ld errors\n", latencies_us.size(), elapsed, errors);
+    printf("requests/sec: %.1f\n", latencies_us.size() / elapsed);
+    printf("latency us:   p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n", pct(0.50), pct(0.90), pct(0.99),
+           latencies_us.empty() ? 0.0 : latencies_us.back());
+
+    for (int fd : idle_fds) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Counts heap allocations of whatever process it is preloaded into:
+//
+//   LD_PRELOAD=./malloc_count.so ./lunar script.lua &
+//   kill -USR2 $!    # writes "mallocs reallocs frees" to $MALLOC_COUNT_FILE
+//
+// malloc(), calloc() and realloc() are counted separately from free(), and
+// new/delete are counted too, since libstdc++ implements them with malloc().
+// The counts are totals since startup; diff two snapshots to see what a
+// stretch of work cost. bench/allocations.sh does that per request.
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+}
+
+static unsigned long mallocs_, reallocs_, frees_;
+
+static inline void count(unsigned long *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+extern "C" void *malloc(size_t size) {
+    count(&mallocs_);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count_, size_t size) {
+    count(&mallocs_);
+    return __libc_calloc(count_, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) {
+    count(&reallocs_);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p) {
+    if (p) {
+        count(&frees_);
+    }
+    __libc_free(p);
+}
+
+static void dump(int) {
+    char line[96];
+    int len = snprintf(line, sizeof(line), "%lu %lu %lu\n", __atomic_load_n(&mallocs_, __ATOMIC_RELAXED),
+                       __atomic_load_n(&reallocs_, __ATOMIC_RELAXED), __atomic_load_n(&frees_, __ATOMIC_RELAXED));
+    const char *path = getenv("MALLOC_COUNT_FILE");
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDERR_FILENO;
+    if (fd >= 0) {
+        write(fd, line, len);
+        if (path) {
+            close(fd);
+        }
+    }
+}
+
+__attribute__((constructor)) static void malloc_count_init() {
+    signal(SIGUSR2, dump);
+}
@@ -0,0 +1,101 @@
+// Route lookup: the radix-tree router in custom/server against the exact-match
+// hash map it replaced, which built a std::string key for every request.
+//
+//   make router_bench && ./router_bench [routes] [lookups]
+//
+// Both sides get the same literal routes; the router additionally resolves
+// parameterised ones, which the hash map cannot express.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../custom/server/router.cpp"
+
+using namespace std;
+
+static double seconds_since(chrono::steady_clock::time_point begin) {
+    return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char **argv) {
+    int route_count = argc > 1 ? atoi(argv[1]) : 4000;
+    long lookups = argc > 2 ? atol(argv[2]) : 5000000;
+
+    // REST-style literal paths built from a vocabulary, so neighbouring
+    // routes share prefixes the way a real API's do.
+    const char *sections[] = {"/api/v1/", "/api/v2/", "/admin/", "/internal/", "/partners/", "/mobile/"};
+    const char *resources[] = {"users", "orders", "invoices", "products", "carts", "payments", "refunds",
+                               "shipments", "addresses", "reviews", "coupons", "sessions", "tokens",
+                               "webhooks", "reports", "exports", "imports", "teams", "projects", "tasks"};
+    const char *actions[] = {"list", "search", "count", "export", "stats", "recent", "archived", "pending",
+                             "failed", "settings", "history", "summary", "feed", "bulk", "schema", "health",
+                             "metrics", "audit", "tags", "owners", "links", "drafts", "templates", "batch",
+                             "status", "config", "limits", "quota", "events", "logs", "preview", "latest",
+                             "legacy", "beta"};
+    vector<string> paths;
+    for (int i = 0; paths.size() < (size_t)route_count; i++) {
+        string path = string(sections[i % 6]) + resources[(i / 6) % 20] + "/" + actions[(i / 120) % 34];
+        if (i >= 6 * 20 * 34) {
+            path += "/" + to_string(i / (6 * 20 * 34));
+        }
+        paths.push_back(path);
+    }
+
+    Router router{nullptr};
+    unordered_map<string, int> table;
+    for (int i = 0; i < route_count; i++) {
+        router_insert(&router, ROUTER_GET, paths[i].c_str(), i);
+        table[paths[i]] = i;
+    }
+    router_insert(&router, ROUTER_GET, "/users/:id", route_count);
+    router_insert(&router, ROUTER_GET, "/users/:id/posts/:post", route_count + 1);
+    router_insert(&router, ROUTER_GET, "/files/*path", route_count + 2);
+
+    // Requests arrive as slices of a receive buffer, not as std::strings.
+    string buffer;
+    vector<string_view> requests;
+    vector<size_t> offsets;
+    for (int i = 0; i < 1024; i++) {
+        offsets.push_back(buffer.size());
+        buffer += paths[(i * 7919) % route_count];
+    }
+    offsets.push_back(buffer.size());
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+        requests.push_back(string_view(buffer).substr(offsets[i], offsets[i + 1] - offsets[i]));
+    }
+
+    long checksum = 0;
+    auto begin = chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+        auto it = table.find(string(requests[i & 1023]));
+        checksum += it->second;
+    }
+    double hash_time = seconds_since(begin);
+
+    RouteMatch match;
+    begin = chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+        router_match(&router, ROUTER_GET, requests[i & 1023], &match);
+        checksum += match.route;
+    }
+    double radix_time = seconds_since(begin);
+
+    const string_view dynamic[] = {"/users/42", "/users/42/posts/7", "/files/css/site/main.css"};
+    begin = chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+        router_match(&router, ROUTER_GET, dynamic[i % 3], &match);
+        checksum += match.route + match.param_count;
+    }
+    double param_time = seconds_since(begin);
+
+    printf("%d routes, %ld lookups each\n", route_count, lookups);
+    printf("%-24s %12s %10s\n", "lookup", "lookups/s", "ns/op");
+    printf("%-24s %12.0f %10.1f\n", "hash map (string key)", lookups / hash_time, hash_time * 1e9 / lookups);
+    printf("%-24s %12.0f %10.1f\n", "router (literal)", lookups / radix_time, radix_time * 1e9 / lookups);
+    printf("%-24s %12.0f %10.1f\n", "router (params)", lookups / param_time, param_time * 1e9 / lookups);
+    printf("checksum %ld\n", checksum);
+    return 0;
+}
@@ -0,0 +1,8 @@
+-- Server for server_modes.sh: a small static file and a POST echo, served in
+-- the mode given on the command line.
+local server <const> = init_server()
+server.bind("/", "bench/server_modes.lua")
+server.route("POST", "/echo", function(req, res)
+    res:send(req.body)
+end)
+server.run(tonumber(arg[2]) or 8089, {mode = arg[1], keep_alive = true})
@@ -0,0 +1,49 @@
+#!/bin/sh
+# The serving modes side by side: blocking, epoll and io_uring answering the
+# same requests under the same load.
+#
+#   make lunar loadgen && sh bench/server_modes.sh [seconds] [connections]
+#
+# Besides throughput this prints the server's CPU time per request (user and
+# system, from /proc), which is where fewer system calls per request show.
+# Run from src/.
+duration=${1:-5}
+connections=${2:-64}
+port=8089
+ticks=$(getconf CLK_TCK)
+
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+run() {
+    mode=$1
+    label=$2
+    shift 2
+    ./lunar bench/server_modes.lua "$mode" "$port" > /dev/null &
+    pid=$!
+    sleep 0.5
+    before=$(cpu_ticks "$pid")
+    out=$(./loadgen -p "$port" -c "$connections" -d "$duration" "$@")
+    after=$(cpu_ticks "$pid")
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+    # io_uring releases its listener asynchronously after exit
+    port=$(( port + 1 ))
+    requests=$(echo "$out" | awk '/requests in/ { print $1 }')
+    echo "$out" | awk -v mode="$mode" -v label="$label" -v requests="$requests" \
+        -v cpu="$(( after - before ))" -v ticks="$ticks" '
+        /requests\/sec/ { rps = $2 }
+        /latency/ { p99 = $8 }
+        END {
+            us = requests > 0 ? cpu / ticks * 1e6 / requests : 0
+            printf "%-9s %-16s %12.0f %10s %12.1f\n", mode, label, rps, p99, us
+        }'
+}
+
+printf "%-9s %-16s %12s %10s %12s\n" mode load requests/s "p99 us" "cpu us/req"
+for mode in blocking epoll io_uring; do
+    run "$mode" "GET keep-alive" -k /
+    run "$mode" "GET new conn" /
+    run "$mode" "POST keep-alive" -k -m POST -b hello /echo
+done
@@ -0,0 +1,46 @@
+-- Lines per second: stream.lines against io.lines, over the same file.
+--
+--   make lunar && ./lunar bench/stream_lines.lua [file] [megabytes]
+--
+-- Without a file, one of log-like lines of varying length is written to a
+-- temporary path first (64 MB unless given). Each reader runs twice and
+-- the faster pass counts, so both see the file in the page cache.
+local path, size = arg[1], (tonumber(arg[2]) or 64) * 1024 * 1024
+local temporary = not path
+if temporary then
+    path = os.tmpname()
+    local file = assert(io.open(path, "wb"))
+    local written, i = 0, 0
+    while written < size do
+        local line = string.format('10.0.%d.%d - - [18/Oct/2026:06:00:00 +0000] "GET /api/v1/items/%d HTTP/1.1" 200 %d\n',
+                                   i % 256, i % 251, i, i % 9973)
+        line = i % 7 == 0 and line:rep(3) or line
+        file:write(line)
+        written, i = written + #line, i + 1
+    end
+    file:close()
+end
+
+local function measure(name, lines)
+    local best, count, bytes = math.huge, 0, 0
+    for _ = 1, 2 do
+        count, bytes = 0, 0
+        local start = os.clock()
+        for line in lines() do
+            count = count + 1
+            bytes = bytes + #line
+        end
+        best = math.min(best, os.clock() - start)
+    end
+    print(string.format("%-14s %10d lines %8.3f s %8.2f M lines/s %8.1f MB/s", name, count, best,
+                        count / best / 1e6, bytes / best / 1048576))
+    return count, bytes
+end
+
+local io_count, io_bytes = measure("io.lines", function() return io.lines(path) end)
+local stream_count, stream_bytes = measure("stream.lines", function() return stream.lines(path) end)
+assert(io_count == stream_count and io_bytes == stream_bytes, "readers disagree")
+
+if temporary then
+    os.remove(path)
+end
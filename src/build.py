@@ -18,7 +18,7 @@ CC = "g++"
 DEPENDENCIES = read_file("dependencies.txt").replace('\n',' ')
 CFLAGS = DEPENDENCIES + " -Wall -O2 -fno-stack-protector -fno-common -march=native"
 LUNAR_INCLUDES = "-lcurl -lraylib"
-LIBS = "-lm -ldl -lreadline -lcurl"
+LIBS = "-lm -ldl -lreadline -lcurl -lpthread -lz"
 
 # Source files
 CORE_O = ["lapi.o", "lcode.o", "lctype.o", "ldebug.o", "ldo.o", "ldump.o",
@@ -0,0 +1,398 @@
+// File operations off the interpreter's thread. A small pool of threads,
+// shared by the whole process, performs reads, writes, stats and directory
+// listings; results come back to the interpreter that asked, through a
+// completion queue of its own whose eventfd the server's loop watches.
+//
+//   aio.read(path [, callback])                    -> data
+//   aio.write(path, content [, options] [, callback]) -> bytes written
+//   aio.stat(path [, callback])                    -> {type, size, mode, mtime, atime, ctime}
+//                                                     of path itself, not what a link points to
+//   aio.list(path [, callback])                    -> {names}, sorted
+//
+// Failures are nil, a message and an errno, as for readfile(). With a
+// callback the call returns at once and the callback gets the results
+// later, as a handler task of its own when the server is running. Without
+// one, a route handler yields until the results are in while the loop
+// serves other clients; anywhere else the operation simply runs there and
+// then. Outside the server, aio.poll([ms]) runs the callbacks of whatever
+// has completed (waiting up to ms for something to) and aio.wait() runs
+// them until nothing is left in flight.
+//
+// write() takes the content and options of writefile(); the strings are
+// kept alive, not copied, while a thread writes them.
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define AIO_THREADS 4
+
+enum AioOp {
+    AIO_READ,
+    AIO_WRITE,
+    AIO_STAT,
+    AIO_LIST
+};
+
+struct AioQueue;
+
+struct AioJob {
+    AioOp op;
+    std::string path;
+    std::vector<iovec> iov;          // write: the content, anchored by 'anchor'
+    WriteOptions options;
+    luna_Integer total;
+    luna_State *L;                   // main thread of the interpreter that asked
+    int anchor;                      // registry ref to what iov points into
+    int callback;                    // registry ref, LUNA_NOREF if a handler waits
+    HandlerTask *task;               // ... the handler
+    AioQueue *queue;                 // where the result goes
+    int error;                       // errno, 0 on success
+    std::string data;                // read
+    struct stat info;                // stat
+    std::vector<std::string> names;  // list
+};
+
+// Completions for the interpreter of one thread.
+struct AioQueue {
+    std::mutex lock;
+    std::vector<AioJob *> done;
+    int event_fd;                    // readable while done is not empty
+    size_t pending;                  // submitted and not yet delivered; the owner's only
+};
+
+struct AioPool {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<AioJob *> jobs;
+    bool started;
+};
+
+// Never destroyed: its threads wait on it until the process exits
+static AioPool *aio_pool_ = new AioPool();
+static thread_local AioQueue *aio_queue_ = nullptr;
+
+static void aio_execute(AioJob *job) {
+    job->error = 0;
+    switch (job->op) {
+        case AIO_READ: {
+            int fd = open(job->path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                job->error = errno;
+                return;
+            }
+            struct stat info;
+            size_t size = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) ? info.st_size : 0;
+            job->data.resize(size > 0 ? size : LUAL_BUFFERSIZE);
+            size_t filled = 0;
+            while (true) {
+                if (filled == job->data.size()) {
+                    job->data.resize(filled * 2);  // /proc and the like, or a file that grew
+                }
+                ssize_t n = read(fd, &job->data[filled], job->data.size() - filled);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    job->error = n < 0 ? errno : 0;
+                    break;
+                }
+                filled += n;
+            }
+            job->data.resize(filled);
+            close(fd);
+            return;
+        }
+        case AIO_WRITE:
+            job->error = write_file(job->path.c_str(), job->iov.data(), (int)job->iov.size(), &job->options);
+            return;
+        case AIO_STAT:
+            if (lstat(job->path.c_str(), &job->info) < 0) {
+                job->error = errno;
+            }
+            return;
+        case AIO_LIST: {
+            DIR *dir = opendir(job->path.c_str());
+            if (!dir) {
+                job->error = errno;
+                return;
+            }
+            while (dirent *entry = readdir(dir)) {
+                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                    job->names.emplace_back(entry->d_name);
+                }
+            }
+            closedir(dir);
+            std::sort(job->names.begin(), job->names.end());
+            return;
+        }
+    }
+}
+
+static void aio_thread_main() {
+    while (true) {
+        AioJob *job;
+        {
+            std::unique_lock<std::mutex> guard(aio_pool_->lock);
+            aio_pool_->wake.wait(guard, [] { return !aio_pool_->jobs.empty(); });
+            job = aio_pool_->jobs.front();
+            aio_pool_->jobs.pop_front();
+        }
+        aio_execute(job);
+        AioQueue *queue = job->queue;
+        {
+            std::lock_guard<std::mutex> guard(queue->lock);
+            queue->done.push_back(job);
+        }
+        uint64_t one = 1;
+        while (write(queue->event_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+    }
+}
+
+// The calling thread's completion queue, created on first use.
+static AioQueue *aio_queue() {
+    if (!aio_queue_) {
+        AioQueue *queue = new AioQueue();
+        queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        queue->pending = 0;
+        aio_queue_ = queue;
+    }
+    return aio_queue_;
+}
+
+// The fd the server's loop watches to know when to call aio_drain().
+static int aio_event_fd() {
+    return aio_queue()->event_fd;
+}
+
+static void aio_submit(AioJob *job) {
+    job->queue = aio_queue();
+    job->queue->pending++;
+    std::lock_guard<std::mutex> guard(aio_pool_->lock);
+    if (!aio_pool_->started) {
+        for (int i = 0; i < AIO_THREADS; i++) {
+            std::thread(aio_thread_main).detach();
+        }
+        aio_pool_->started = true;
+    }
+    aio_pool_->jobs.push_back(job);
+    aio_pool_->wake.notify_one();
+}
+
+// Pushes the results of job onto L and frees it.
+static int aio_finish(luna_State *L, AioJob *job) {
+    int nresults = 1;
+    if (job->error != 0) {
+        errno = job->error;
+        nresults = lunaL_fileresult(L, 0, job->path.c_str());
+    } else if (job->op == AIO_READ) {
+        luna_pushlstring(L, job->data.data(), job->data.size());
+    } else if (job->op == AIO_WRITE) {
+        luna_pushinteger(L, job->total);
+    } else if (job->op == AIO_STAT) {
+        const struct stat &info = job->info;
+        const char *type = S_ISREG(info.st_mode) ? "file" : S_ISDIR(info.st_mode) ? "directory"
+                         : S_ISLNK(info.st_mode) ? "link" : "other";
+        luna_createtable(L, 0, 6);
+        luna_pushstring(L, type);
+        luna_setfield(L, -2, "type");
+        luna_pushinteger(L, info.st_size);
+        luna_setfield(L, -2, "size");
+        luna_pushinteger(L, info.st_mode & 07777);
+        luna_setfield(L, -2, "mode");
+        luna_pushnumber(L, info.st_mtim.tv_sec + info.st_mtim.tv_nsec / 1e9);
+        luna_setfield(L, -2, "mtime");
+        luna_pushnumber(L, info.st_atim.tv_sec + info.st_atim.tv_nsec / 1e9);
+        luna_setfield(L, -2, "atime");
+        luna_pushnumber(L, info.st_ctim.tv_sec + info.st_ctim.tv_nsec / 1e9);
+        luna_setfield(L, -2, "ctime");
+    } else {
+        luna_createtable(L, (int)job->names.size(), 0);
+        for (size_t i = 0; i < job->names.size(); i++) {
+            luna_pushlstring(L, job->names[i].data(), job->names[i].size());
+            luna_rawseti(L, -2, (luna_Integer)i + 1);
+        }
+    }
+    lunaL_unref(job->L, LUNA_REGISTRYINDEX, job->anchor);
+    lunaL_unref(job->L, LUNA_REGISTRYINDEX, job->callback);
+    delete job;
+    return nresults;
+}
+
+// Delivers what has completed for this thread's interpreter: resumes the
+// handlers waiting and runs the callbacks. Returns how many.
+static int aio_drain() {
+    AioQueue *queue = aio_queue_;
+    if (!queue) {
+        return 0;
+    }
+    uint64_t count;
+    while (read(queue->event_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+    std::vector<AioJob *> done;
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        done.swap(queue->done);
+    }
+    for (AioJob *job : done) {
+        queue->pending--;
+        if (job->task) {
+            job->task->wait_aio = false;
+            task_resume(job->task);  // the results are pushed by aio_resume_k
+            continue;
+        }
+        HandlerTask *task = task_new(job->L, -1);
+        luna_rawgeti(task->co, LUNA_REGISTRYINDEX, job->callback);
+        int nargs = aio_finish(task->co, job);
+        task_launch(task, nargs);
+    }
+    return (int)done.size();
+}
+
+static int aio_resume_k(luna_State *L, int status, luna_KContext ctx) {
+    (void)status;
+    return aio_finish(L, (AioJob *)ctx);
+}
+
+// Starts job, whose callback (if any) is at index: returns at once with a
+// callback, parks a handler task until it is done, or does it right away.
+static int aio_start(luna_State *L, AioJob *job, int index) {
+    if (!luna_isnoneornil(L, index)) {
+        luna_pushvalue(L, index);
+        job->callback = lunaL_ref(L, LUNA_REGISTRYINDEX);
+        luna_rawgeti(L, LUNA_REGISTRYINDEX, LUNA_RIDX_MAINTHREAD);
+        job->L = luna_tothread(L, -1);
+        luna_pop(L, 1);
+        aio_submit(job);
+        return 0;
+    }
+    if (HandlerTask *task = task_running(L)) {
+        job->task = task;
+        task->wait_aio = true;
+        aio_submit(job);
+        return luna_yieldk(L, 0, (luna_KContext)job, aio_resume_k);
+    }
+    aio_execute(job);
+    return aio_finish(L, job);
+}
+
+// A job for op on the path at index 1, with its callback (if any) at
+// callback. Every argument must have been checked by now: nothing may raise
+// between this and aio_start(), which would leak the job.
+static AioJob *aio_job(luna_State *L, AioOp op, int callback) {
+    const char *path = lunaL_checkstring(L, 1);
+    if (!luna_isnoneornil(L, callback)) {
+        lunaL_checktype(L, callback, LUNA_TFUNCTION);
+    }
+    AioJob *job = new AioJob();
+    job->op = op;
+    job->path = path;
+    job->L = L;
+    job->anchor = LUNA_NOREF;
+    job->callback = LUNA_NOREF;
+    job->task = nullptr;
+    return job;
+}
+
+static int aio_read(luna_State *L) {
+    luna_settop(L, 2);
+    return aio_start(L, aio_job(L, AIO_READ, 2), 2);
+}
+
+static int aio_write(luna_State *L) {
+    int callback = luna_isfunction(L, 3) ? 3 : 4;
+    luna_settop(L, 4);
+    WriteOptions options;
+    check_write_options(L, callback == 3 ? 4 : 3, &options);  // 4 is nil then
+    struct iovec single;
+    int count;
+    luna_Integer total;
+    struct iovec *iov = check_pieces(L, 2, &single, &count, &total);
+
+    AioJob *job = aio_job(L, AIO_WRITE, callback);
+    job->iov.assign(iov, iov + count);
+    job->options = options;
+    job->total = total;
+    if (!luna_isnoneornil(L, callback) || task_running(L)) {
+        // A list is copied, so the caller may change it while it is written
+        if (luna_istable(L, 2)) {
+            luna_createtable(L, count, 0);
+            for (int i = 1; i <= count; i++) {
+                luna_rawgeti(L, 2, i);
+                luna_rawseti(L, -2, i);
+            }
+        } else {
+            luna_pushvalue(L, 2);
+        }
+        job->anchor = lunaL_ref(L, LUNA_REGISTRYINDEX);
+    }
+    return aio_start(L, job, callback);
+}
+
+static int aio_stat(luna_State *L) {
+    luna_settop(L, 2);
+    return aio_start(L, aio_job(L, AIO_STAT, 2), 2);
+}
+
+static int aio_list(luna_State *L) {
+    luna_settop(L, 2);
+    return aio_start(L, aio_job(L, AIO_LIST, 2), 2);
+}
+
+// aio.poll([ms]) -> callbacks run: those of everything completed, after
+// waiting up to ms (default 0) for something to complete if nothing has.
+static int aio_poll(luna_State *L) {
+    int timeout = (int)lunaL_optinteger(L, 1, 0);
+    AioQueue *queue = aio_queue();
+    if (queue->pending > 0) {
+        pollfd pfd{queue->event_fd, POLLIN, 0};
+        while (poll(&pfd, 1, timeout) < 0 && errno == EINTR) {
+        }
+    }
+    luna_pushinteger(L, aio_drain());
+    return 1;
+}
+
+// aio.wait() -> callbacks run, until nothing is in flight any more.
+static int aio_wait(luna_State *L) {
+    AioQueue *queue = aio_queue();
+    luna_Integer count = 0;
+    while (queue->pending > 0) {
+        pollfd pfd{queue->event_fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return lunaL_error(L, "cannot wait for file operations: %s", strerror(errno));
+        }
+        count += aio_drain();
+    }
+    luna_pushinteger(L, count);
+    return 1;
+}
+
+// aio.pending() -> operations of this interpreter in flight.
+static int aio_pending(luna_State *L) {
+    luna_pushinteger(L, (luna_Integer)aio_queue()->pending);
+    return 1;
+}
+
+static const lunaL_Reg aio_funcs[] = {
+    {"read", aio_read},
+    {"write", aio_write},
+    {"stat", aio_stat},
+    {"list", aio_list},
+    {"poll", aio_poll},
+    {"wait", aio_wait},
+    {"pending", aio_pending},
+    {NULL, NULL}
+};
+
+// Sets the global aio table.
+static void aio_open_lib(luna_State *L) {
+    lunaL_newlib(L, aio_funcs);
+    luna_setglobal(L, "aio");
+}
@@ -1,6 +1,8 @@
 #include "io.c"
 #include "regex.c"
+#include "stream.c"
 #include "server.cpp"
+#include "aio.cpp"
 #include "raylib/raylib_wrapper.cpp"
 
 static const lunaL_Reg base_funcs[] = {
@@ -9,6 +11,7 @@ static const lunaL_Reg base_funcs[] = {
   {"writefile", luna_writefile},
   {"input", p_input},
   {"request", luna_curl_request},
+  {"http_client", luna_http_client},
   {"regex",match_regex},
   {"init_server",init_server},
   {"raylib_init", init_raylib},
@@ -42,3 +45,10 @@ static const lunaL_Reg base_funcs[] = {
   {"_VERSION", NULL},
   {NULL, NULL}
 };
+
+// Custom libraries that are tables rather than single functions; called by
+// luaopen_base with the global table on the stack.
+static void open_custom_libs(luna_State *L) {
+  stream_open_lib(L);
+  aio_open_lib(L);
+}
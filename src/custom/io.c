@@ -1,42 +1,468 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Internals, for building strings in place; named by their path from here,
+// since the makefile adds no include directories.
+#include "../ldo.h"
+#include "../lgc.h"
+#include "../lstate.h"
+#include "../lstring.h"
 
 
 //match_regex("sg", pattern);
 
 
+#define MAPPED_FILE "io.mapped"
+
+// A file mapped read-only, as returned by readfile(path, "buffer"). Its bytes
+// are the page cache's own: nothing is copied until sub() asks for a string.
+// Truncating the file while it is mapped makes reading past the new end
+// fault, as with any mapping.
+typedef struct MappedFile {
+    const char *data;
+    size_t size;
+    int mapped;              // data is a mapping to munmap(), not a static ""
+} MappedFile;
+
+static MappedFile *check_mapped(luna_State *L) {
+    MappedFile *file = (MappedFile *)lunaL_checkudata(L, 1, MAPPED_FILE);
+    lunaL_argcheck(L, file->data != NULL, 1, "buffer is closed");
+    return file;
+}
+
+// Turns a negative index into one counted from the start, as string
+// functions do; indexes before the first byte become 0.
+static luna_Integer mapped_index(luna_Integer i, size_t size) {
+    if (i >= 0) {
+        return i;
+    }
+    if ((size_t)0 - (size_t)i > size) {
+        return 0;
+    }
+    return (luna_Integer)size + i + 1;
+}
+
+static int mapped_len(luna_State *L) {
+    luna_pushinteger(L, (luna_Integer)check_mapped(L)->size);
+    return 1;
+}
+
+// buf:sub([i [, j]]) copies bytes i to j, as string.sub does; buf:sub() is
+// the whole file.
+static int mapped_sub(luna_State *L) {
+    MappedFile *file = check_mapped(L);
+    luna_Integer start = mapped_index(lunaL_optinteger(L, 2, 1), file->size);
+    luna_Integer end = mapped_index(lunaL_optinteger(L, 3, -1), file->size);
+    if (start < 1) {
+        start = 1;
+    }
+    if (end > (luna_Integer)file->size) {
+        end = (luna_Integer)file->size;
+    }
+    if (start > end) {
+        luna_pushliteral(L, "");
+    } else {
+        luna_pushlstring(L, file->data + start - 1, (size_t)(end - start) + 1);
+    }
+    return 1;
+}
+
+// buf:byte(i) is the byte at i, or nil past either end.
+static int mapped_byte(luna_State *L) {
+    MappedFile *file = check_mapped(L);
+    luna_Integer i = mapped_index(lunaL_checkinteger(L, 2), file->size);
+    if (i < 1 || i > (luna_Integer)file->size) {
+        return 0;
+    }
+    luna_pushinteger(L, (unsigned char)file->data[i - 1]);
+    return 1;
+}
+
+// buf:find(text [, init]) is the first and last index of text (matched as
+// is, not as a pattern) at or after init, or nil.
+static int mapped_find(luna_State *L) {
+    MappedFile *file = check_mapped(L);
+    size_t len;
+    const char *text = lunaL_checklstring(L, 2, &len);
+    luna_Integer init = mapped_index(lunaL_optinteger(L, 3, 1), file->size);
+    if (init < 1) {
+        init = 1;
+    }
+    if (init > (luna_Integer)file->size + 1) {
+        return 0;
+    }
+    size_t start = (size_t)init - 1;
+    const char *found = (const char *)memmem(file->data + start, file->size - start, text, len);
+    if (!found) {
+        return 0;
+    }
+    luna_pushinteger(L, found - file->data + 1);
+    luna_pushinteger(L, found - file->data + len);
+    return 2;
+}
+
+// buf:close() unmaps the file now rather than when the buffer is collected.
+static int mapped_close(luna_State *L) {
+    MappedFile *file = (MappedFile *)lunaL_checkudata(L, 1, MAPPED_FILE);
+    if (file->mapped) {
+        munmap((void *)file->data, file->size);
+    }
+    file->data = NULL;
+    file->mapped = 0;
+    return 0;
+}
+
+static int mapped_tostring(luna_State *L) {
+    MappedFile *file = (MappedFile *)lunaL_checkudata(L, 1, MAPPED_FILE);
+    if (file->data) {
+        luna_pushfstring(L, "mapped file (%I bytes)", (luna_Integer)file->size);
+    } else {
+        luna_pushliteral(L, "mapped file (closed)");
+    }
+    return 1;
+}
+
+static const lunaL_Reg mapped_methods[] = {
+    {"sub", mapped_sub},
+    {"byte", mapped_byte},
+    {"find", mapped_find},
+    {"close", mapped_close},
+    {NULL, NULL}
+};
+
+// Pushes a buffer aliasing the regular file fd of size bytes.
+static int push_mapped(luna_State *L, int fd, size_t size, const char *filename) {
+    MappedFile *file = (MappedFile *)luna_newuserdatauv(L, sizeof(MappedFile), 0);
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+    if (lunaL_newmetatable(L, MAPPED_FILE)) {
+        luna_newtable(L);
+        lunaL_setfuncs(L, mapped_methods, 0);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, mapped_len);
+        luna_setfield(L, -2, "__len");
+        luna_pushcfunction(L, mapped_close);
+        luna_setfield(L, -2, "__gc");
+        luna_pushcfunction(L, mapped_close);
+        luna_setfield(L, -2, "__close");
+        luna_pushcfunction(L, mapped_tostring);
+        luna_setfield(L, -2, "__tostring");
+    }
+    luna_setmetatable(L, -2);
+
+    if (size == 0) {
+        file->data = "";  // mmap() refuses empty ranges
+        return 1;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return lunaL_fileresult(L, 0, filename);
+    }
+    file->data = (const char *)data;
+    file->size = size;
+    file->mapped = 1;
+    return 1;
+}
+
+// Pushes the size bytes of the regular file fd as a string read straight
+// into the string object, as lundump.c loads long strings: one copy from the
+// page cache, and no buffer as large as the file beside it.
+static int push_sized(luna_State *L, int fd, size_t size, const char *filename) {
+    TString *ts = luaS_createlngstrobj(L, size);
+    setsvalue2s(L, L->top.p, ts);  // anchored while it is filled
+    luaD_inctop(L);
+    char *contents = getlngstr(ts);
+    size_t filled = 0;
+    while (filled < size) {
+        ssize_t n = read(fd, contents + filled, size - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            luna_pop(L, 1);
+            return lunaL_fileresult(L, 0, filename);
+        }
+        if (n == 0) {
+            // Truncated since fstat(): what is left is the file
+            luna_pushlstring(L, contents, filled);
+            luna_remove(L, -2);
+            break;
+        }
+        filled += n;
+    }
+    luaC_checkGC(L);
+    return 1;
+}
+
+// Pushes the rest of fd as a string, for files whose size stat() does not
+// know (pipes, /proc) or that are not worth mapping.
+static int push_read(luna_State *L, int fd, size_t size_hint, const char *filename) {
+    lunaL_Buffer buffer;
+    lunaL_buffinitsize(L, &buffer, size_hint > 0 ? size_hint : LUAL_BUFFERSIZE);
+    while (1) {
+        size_t room = size_hint > 0 ? size_hint : LUAL_BUFFERSIZE;
+        char *p = lunaL_prepbuffsize(&buffer, room);
+        ssize_t n = read(fd, p, room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return lunaL_fileresult(L, 0, filename);
+        }
+        if (n == 0) {
+            break;
+        }
+        lunaL_addsize(&buffer, n);
+        size_hint = 0;  // past the expected end, read whatever follows in blocks
+    }
+    lunaL_pushresult(&buffer);
+    return 1;
+}
+
+// readfile(path [, "buffer"]): the whole file as a string, NULs and all, or
+// as a read-only buffer mapping it (see MappedFile). Returns nil and a
+// message on failure.
 static int luna_readfile(luna_State *L) {
+    static const char *const modes[] = {"string", "buffer", NULL};
     const char *filename = lunaL_checkstring(L, 1);
-    FILE *file = fopen(filename, "r");
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        long size = ftell(file);
-        rewind(file);
-        char *contents = (char *)malloc(size + 1);
-        if (contents) {
-            fread(contents, 1, size, file);
-            contents[size] = '\0';
-            fclose(file);
-            luna_pushstring(L, contents);
-            free(contents);
-            return 1;
-        }
-        fclose(file);
-    }
-    return 0;  // File not found or error occurred
+    int as_buffer = lunaL_checkoption(L, 2, "string", modes) == 1;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return lunaL_fileresult(L, 0, filename);
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        int result = lunaL_fileresult(L, 0, filename);
+        close(fd);
+        return result;
+    }
+    size_t size = S_ISREG(info.st_mode) ? (size_t)info.st_size : 0;
+
+    int result;
+    if (as_buffer) {
+        // Files in /proc claim to be empty and regular but are not
+        char probe;
+        if (!S_ISREG(info.st_mode) || (size == 0 && read(fd, &probe, 1) > 0)) {
+            close(fd);
+            luna_pushnil(L);
+            luna_pushfstring(L, "%s: cannot be mapped", filename);
+            return 2;
+        }
+        result = push_mapped(L, fd, size, filename);
+    } else if (size > LUAI_MAXSHORTLEN) {
+        result = push_sized(L, fd, size, filename);
+    } else {
+        result = push_read(L, fd, size, filename);
+    }
+    close(fd);
+    return result;
 }
+// Writes all of iov[0, count), however short the kernel's writes are.
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Makes a new or renamed entry in the directory holding path durable.
+static int sync_directory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    if (!dir) {
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+enum { SYNC_NONE, SYNC_DATA, SYNC_FULL };
+
+typedef struct WriteOptions {
+    int append;
+    int atomic;
+    int sync;
+    mode_t mode;
+} WriteOptions;
+
+// Collects the content at index, a string or a list of strings, as iovecs:
+// single for a string, or an array in a userdata pushed for a list.
+static struct iovec *check_pieces(luna_State *L, int index, struct iovec *single, int *count, luna_Integer *total) {
+    if (!luna_istable(L, index)) {
+        single->iov_base = (void *)lunaL_checklstring(L, index, &single->iov_len);
+        *count = 1;
+        *total = single->iov_len;
+        return single;
+    }
+    *count = (int)luna_rawlen(L, index);
+    *total = 0;
+    struct iovec *iov = (struct iovec *)luna_newuserdatauv(L, sizeof(struct iovec) * (*count > 0 ? *count : 1), 0);
+    for (int i = 0; i < *count; i++) {
+        // Only strings: a converted number would not be anchored anywhere
+        if (luna_rawgeti(L, index, i + 1) != LUNA_TSTRING) {
+            lunaL_argerror(L, index, luna_pushfstring(L, "piece %d is not a string", i + 1));
+        }
+        iov[i].iov_base = (void *)luna_tolstring(L, -1, &iov[i].iov_len);
+        *total += iov[i].iov_len;
+        luna_pop(L, 1);
+    }
+    return iov;
+}
+
+static void check_write_options(luna_State *L, int index, WriteOptions *options) {
+    static const char *const syncs[] = {"none", "data", "full", NULL};
+    options->append = 0;
+    options->atomic = 0;
+    options->sync = SYNC_NONE;
+    options->mode = 0666;
+    if (luna_isnoneornil(L, index)) {
+        return;
+    }
+    lunaL_checktype(L, index, LUNA_TTABLE);
+    luna_getfield(L, index, "append");
+    options->append = luna_toboolean(L, -1);
+    luna_getfield(L, index, "atomic");
+    options->atomic = luna_toboolean(L, -1);
+    luna_getfield(L, index, "sync");
+    const char *policy = lunaL_optstring(L, -1, "none");
+    int sync = SYNC_NONE;
+    while (syncs[sync] && strcmp(syncs[sync], policy) != 0) {
+        sync++;
+    }
+    lunaL_argcheck(L, syncs[sync] != NULL, index, "sync must be \"none\", \"data\" or \"full\"");
+    options->sync = sync;
+    // Lua has no octal literals, so mode = 0644 would be decimal: an octal
+    // string is taken as chmod takes it
+    luna_Integer mode = options->mode;
+    luna_getfield(L, index, "mode");
+    if (luna_type(L, -1) == LUNA_TSTRING) {
+        const char *digits = luna_tostring(L, -1);
+        char *end;
+        mode = strtol(digits, &end, 8);
+        lunaL_argcheck(L, digits[0] != '\0' && *end == '\0', index, "mode must be an octal string");
+    } else {
+        mode = lunaL_optinteger(L, -1, mode);
+    }
+    lunaL_argcheck(L, mode >= 0 && mode <= 07777, index, "mode out of range");
+    options->mode = (mode_t)mode;
+    luna_pop(L, 4);
+    lunaL_argcheck(L, !(options->append && options->atomic), index, "an append cannot be atomic");
+}
+
+// Writes iov to filename as options say. Touches no Lua state, so aio's
+// threads use it too. Returns 0 or an errno.
+static int write_file(const char *filename, struct iovec *iov, int count, const WriteOptions *options) {
+    static int temporaries = 0;
+    char *temporary = NULL;
+    const char *target = filename;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (options->append ? O_APPEND : O_TRUNC);
+    if (options->atomic) {
+        size_t size = strlen(filename) + 64;
+        temporary = (char *)malloc(size);
+        if (!temporary) {
+            return ENOMEM;
+        }
+        snprintf(temporary, size, "%s.tmp.%d.%d", filename, (int)getpid(),
+                 __atomic_fetch_add(&temporaries, 1, __ATOMIC_RELAXED));
+        target = temporary;
+        flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    }
+    int fd = open(target, flags, options->mode);
+    if (fd < 0) {
+        int error = errno;
+        free(temporary);
+        return error;
+    }
+
+    // The data goes down before the rename, or a crash could leave the
+    // name pointing at an empty or partly written file
+    struct stat replaced;
+    int sync = options->atomic && options->sync == SYNC_NONE ? SYNC_DATA : options->sync;
+    int failed = write_all(fd, iov, count) < 0 ||
+                 (options->atomic && stat(filename, &replaced) == 0 && fchmod(fd, replaced.st_mode & 07777) < 0) ||
+                 (sync == SYNC_DATA && fdatasync(fd) < 0) || (sync == SYNC_FULL && fsync(fd) < 0);
+    int error = errno;
+    if (close(fd) < 0 && !failed) {
+        failed = 1;
+        error = errno;
+    }
+    if (!failed && options->atomic && rename(target, filename) < 0) {
+        failed = 1;
+        error = errno;
+    }
+    if (failed && options->atomic) {
+        unlink(target);
+    }
+    free(temporary);
+    if (failed) {
+        return error;
+    }
+    if (sync == SYNC_FULL && sync_directory(filename) < 0) {
+        return errno;
+    }
+    return 0;
+}
+
+// writefile(path, content [, options]): writes content, a string or a list
+// of strings written in order with one writev(), and returns the number of
+// bytes written, or nil and a message. Options:
+//   append   add to the end of the file instead of replacing it
+//   atomic   write a temporary file next to path, fdatasync() it and rename()
+//            it over path, so readers, and the file after a crash, have the
+//            old or the new content, never part of it
+//   sync     "none" (default), "data" (fdatasync) or "full" (fsync, and the
+//            directory too, so a new or renamed file survives a crash)
+//   mode     permissions of a new file, an octal string such as "644" or a
+//            number (default "666", less the umask); an atomic write keeps
+//            those of the file it replaces
 static int luna_writefile(luna_State *L) {
     const char *filename = lunaL_checkstring(L, 1);
-    const char *content = lunaL_checkstring(L, 2);
-    FILE *file = fopen(filename, "w");
-    if (file) {
-        fputs(content, file);
-        fclose(file);
-        return 1; // Success
+    luna_settop(L, 3);  // the options stay at 3 with what is pushed below
+    WriteOptions options;
+    check_write_options(L, 3, &options);
+    struct iovec single;
+    int count;
+    luna_Integer total;
+    struct iovec *iov = check_pieces(L, 2, &single, &count, &total);
+
+    int error = write_file(filename, iov, count, &options);
+    if (error != 0) {
+        errno = error;
+        return lunaL_fileresult(L, 0, filename);
     }
-    return 0;  // Error occurred
+    luna_pushinteger(L, total);
+    return 1;
 }
 
 static int p_input(luna_State *L) {
@@ -58,41 +484,501 @@ static int p_input(luna_State *L) {
 }
 
 #include <curl/curl.h>
+#include <pthread.h>
+#include <strings.h>
 
-// This callback function will be called by libcurl when data is received.
-static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t totalSize = size * nmemb;
-    luna_pushlstring((luna_State*)userp, (const char*)contents, totalSize);
-    return totalSize;
+// HTTP client with a persistent connection pool: http_client([options])
+// returns a client whose transfers all go through one curl multi handle,
+// so connections, DNS lookups and TLS sessions are kept and reused between
+// calls, and get_many() runs a whole list of requests concurrently.
+//
+//   local client = http_client({timeout = 10})
+//   local res = client:get("http://localhost:8080/")
+//   print(res.status, res.headers["content-type"], res.timing.total, res.reused)
+//   for i, res in ipairs(client:get_many({url1, url2, {url = url3, method = "POST", body = "x"}})) do ... end
+//
+// Client options: timeout and connect_timeout (seconds, default none and
+// 10), max_host_connections (per host at once, default 0 for no limit),
+// follow_redirects (default true) and user_agent. A request is a URL or a
+// table {url, method, body, headers = {name = value}}; header names and
+// values may not contain line breaks. A response is a table
+// {status, body, headers (lower-case names), url (after redirects), reused
+// (whether no new connection was needed), timing = {dns, connect, tls,
+// first_byte, total}} with times in seconds since the start, as curl
+// measures them. get() returns nil and a message on failure; get_many()
+// puts {error = message, url = url} in that request's place.
+//
+// Calls block the interpreter until every transfer they started is done.
+
+#define HTTP_CLIENT "http.client"
+
+typedef struct ByteBuffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+} ByteBuffer;
+
+static int byte_buffer_append(ByteBuffer *buffer, const char *data, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 16384;
+        while (capacity < buffer->len + len) {
+            capacity *= 2;
+        }
+        char *grown = (char *)realloc(buffer->data, capacity);
+        if (!grown) {
+            return 0;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 1;
 }
 
-static int luna_curl_request(luna_State *L) {
-    const char *url = lunaL_checkstring(L, 1);
+typedef struct HttpClient {
+    CURLM *multi;            // owns the connection cache
+    CURL **idle;             // easy handles kept for the next transfers
+    int idle_count;
+    int idle_capacity;
+    long timeout_ms;         // 0 for none
+    long connect_timeout_ms;
+    int follow_redirects;
+    char *user_agent;
+} HttpClient;
 
-    // Initialize libcurl
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        return 0;  // Error occurred
+// One request of a get()/get_many() call, from setup to its response.
+typedef struct HttpTransfer {
+    CURL *easy;
+    const char *url;         // these point into the request, anchored by the caller
+    const char *method;
+    const char *body;
+    size_t body_len;
+    struct curl_slist *request_headers;
+    ByteBuffer response;
+    ByteBuffer headers;      // of the last response, if there were redirects
+    CURLcode result;
+    char error[CURL_ERROR_SIZE];
+} HttpTransfer;
+
+// Results of transfers curl has no CURLcode for.
+#define TRANSFER_NOT_STARTED ((CURLcode)-1)
+#define TRANSFER_UNFINISHED ((CURLcode)-2)
+
+static pthread_once_t curl_initialized_ = PTHREAD_ONCE_INIT;
+
+static void curl_initialize(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static size_t transfer_on_body(void *data, size_t size, size_t count, void *userdata) {
+    HttpTransfer *transfer = (HttpTransfer *)userdata;
+    return byte_buffer_append(&transfer->response, (const char *)data, size * count) ? size * count : 0;
+}
+
+static size_t transfer_on_header(char *data, size_t size, size_t count, void *userdata) {
+    HttpTransfer *transfer = (HttpTransfer *)userdata;
+    size_t len = size * count;
+    if (len >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+        transfer->headers.len = 0;  // a new response begins
+        return len;
     }
+    return byte_buffer_append(&transfer->headers, data, len) ? len : 0;
+}
 
-    // Set the URL
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+static HttpClient *check_client(luna_State *L) {
+    HttpClient *client = (HttpClient *)lunaL_checkudata(L, 1, HTTP_CLIENT);
+    lunaL_argcheck(L, client->multi != NULL, 1, "client is closed");
+    return client;
+}
 
-    // Set the write callback function to capture the response data
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, L);  // Pass the luna state as user data
+// Checks the request at index, a URL or a table, without keeping anything.
+static void check_request(luna_State *L, int index, int arg) {
+    if (luna_type(L, index) == LUNA_TSTRING) {
+        return;
+    }
+    lunaL_argcheck(L, luna_istable(L, index), arg, "requests are URLs or tables");
+    lunaL_argcheck(L, luna_getfield(L, index, "url") == LUNA_TSTRING, arg, "request without a url");
+    int method = luna_getfield(L, index, "method");
+    int body = luna_getfield(L, index, "body");
+    int headers = luna_getfield(L, index, "headers");
+    lunaL_argcheck(L, method == LUNA_TNIL || method == LUNA_TSTRING, arg, "method must be a string");
+    lunaL_argcheck(L, body == LUNA_TNIL || body == LUNA_TSTRING, arg, "body must be a string");
+    lunaL_argcheck(L, headers == LUNA_TNIL || headers == LUNA_TTABLE, arg, "headers must be a table");
+    if (headers == LUNA_TTABLE) {
+        luna_pushnil(L);
+        while (luna_next(L, -2) != 0) {
+            lunaL_argcheck(L, luna_type(L, -2) == LUNA_TSTRING && luna_type(L, -1) == LUNA_TSTRING, arg,
+                           "header names and values must be strings");
+            // Each becomes a line of the request as it is
+            size_t name_len, value_len;
+            const char *name = luna_tolstring(L, -2, &name_len);
+            const char *value = luna_tolstring(L, -1, &value_len);
+            lunaL_argcheck(L, name_len > 0 && strcspn(name, ":\r\n") == name_len, arg, "invalid header name");
+            lunaL_argcheck(L, strcspn(value, "\r\n") == value_len, arg, "header value contains a line break");
+            luna_pop(L, 1);
+        }
+    }
+    luna_pop(L, 4);
+}
 
-    // Perform the request
-    CURLcode res = curl_easy_perform(curl);
+// Fills transfer from the request at index, already checked. Its strings
+// stay where they are, so the request must stay anchored until it is done.
+static void transfer_prepare(luna_State *L, HttpTransfer *transfer, int index) {
+    if (luna_type(L, index) == LUNA_TSTRING) {
+        transfer->url = luna_tostring(L, index);
+        return;
+    }
+    luna_getfield(L, index, "url");
+    transfer->url = luna_tostring(L, -1);
+    luna_getfield(L, index, "method");
+    transfer->method = luna_tostring(L, -1);
+    luna_getfield(L, index, "body");
+    transfer->body = luna_tolstring(L, -1, &transfer->body_len);
+    if (luna_getfield(L, index, "headers") == LUNA_TTABLE) {
+        luna_pushnil(L);
+        while (luna_next(L, -2) != 0) {
+            const char *line = luna_pushfstring(L, "%s: %s", luna_tostring(L, -2), luna_tostring(L, -1));
+            transfer->request_headers = curl_slist_append(transfer->request_headers, line);
+            luna_pop(L, 2);
+        }
+    }
+    luna_pop(L, 4);
+}
 
-    // Check for errors
-    if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        return 0;  // Error occurred
+static CURL *client_easy(HttpClient *client) {
+    if (client->idle_count > 0) {
+        return client->idle[--client->idle_count];
     }
+    return curl_easy_init();
+}
 
-    // Cleanup
-    curl_easy_cleanup(curl);
+static void client_release_easy(HttpClient *client, CURL *easy) {
+    curl_easy_reset(easy);
+    if (client->idle_count == client->idle_capacity) {
+        int capacity = client->idle_capacity ? client->idle_capacity * 2 : 8;
+        CURL **idle = (CURL **)realloc(client->idle, capacity * sizeof(CURL *));
+        if (!idle) {
+            curl_easy_cleanup(easy);
+            return;
+        }
+        client->idle = idle;
+        client->idle_capacity = capacity;
+    }
+    client->idle[client->idle_count++] = easy;
+}
+
+static int transfer_start(HttpClient *client, HttpTransfer *transfer) {
+    CURL *easy = client_easy(client);
+    if (!easy) {
+        return 0;
+    }
+    transfer->easy = easy;
+    curl_easy_setopt(easy, CURLOPT_URL, transfer->url);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, transfer->error);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, transfer_on_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, transfer_on_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer);
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, (long)client->follow_redirects);
+    curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 10L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, client->timeout_ms);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, client->connect_timeout_ms);
+    if (client->user_agent) {
+        curl_easy_setopt(easy, CURLOPT_USERAGENT, client->user_agent);
+    }
+    if (transfer->body) {
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)transfer->body_len);
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, transfer->body);
+    }
+    if (transfer->method) {
+        if (strcasecmp(transfer->method, "HEAD") == 0) {
+            curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+        } else {
+            curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, transfer->method);
+        }
+    }
+    if (transfer->request_headers) {
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->request_headers);
+    }
+    return curl_multi_add_handle(client->multi, easy) == CURLM_OK;
+}
 
-    return 1;  // Success; the response data is on the luna stack
+// Runs count transfers at once until all are done. If curl gives up on the
+// whole set, those it had not finished fail with its reason.
+static void client_run(HttpClient *client, HttpTransfer *transfers, int count) {
+    for (int i = 0; i < count; i++) {
+        transfers[i].result = transfer_start(client, &transfers[i]) ? TRANSFER_UNFINISHED : TRANSFER_NOT_STARTED;
+    }
+    CURLMcode multi_result = CURLM_OK;
+    int running = 1;
+    while (running > 0 && multi_result == CURLM_OK) {
+        multi_result = curl_multi_perform(client->multi, &running);
+        if (multi_result == CURLM_OK && running > 0) {
+            multi_result = curl_multi_poll(client->multi, NULL, 0, 1000, NULL);
+        }
+    }
+    CURLMsg *message;
+    int left;
+    while ((message = curl_multi_info_read(client->multi, &left)) != NULL) {
+        if (message->msg == CURLMSG_DONE) {
+            HttpTransfer *transfer;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            transfer->result = message->data.result;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (transfers[i].result == TRANSFER_UNFINISHED) {
+            snprintf(transfers[i].error, CURL_ERROR_SIZE, "%s",
+                     multi_result != CURLM_OK ? curl_multi_strerror(multi_result) : "transfer did not finish");
+        }
+    }
+}
+
+static void set_number_field(luna_State *L, const char *name, double value) {
+    luna_pushnumber(L, value);
+    luna_setfield(L, -2, name);
+}
+
+// Pushes the headers of a response as a table by lower-case name; repeated
+// ones are joined with ", ".
+static void push_response_headers(luna_State *L, const ByteBuffer *headers) {
+    luna_newtable(L);
+    const char *p = headers->data;
+    const char *end = p ? p + headers->len : p;
+    while (p < end) {
+        const char *line_end = (const char *)memchr(p, '\n', end - p);
+        if (!line_end) {
+            line_end = end;
+        }
+        const char *colon = (const char *)memchr(p, ':', line_end - p);
+        if (colon && colon > p) {
+            const char *value = colon + 1;
+            const char *value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            lunaL_Buffer name;
+            char *lower = lunaL_buffinitsize(L, &name, colon - p);
+            for (const char *c = p; c < colon; c++) {
+                lower[c - p] = (char)tolower((unsigned char)*c);
+            }
+            lunaL_pushresultsize(&name, colon - p);
+            if (luna_getfield(L, -2, luna_tostring(L, -1)) == LUNA_TSTRING) {
+                luna_pushliteral(L, ", ");
+                luna_pushlstring(L, value, value_end - value);
+                luna_concat(L, 3);
+            } else {
+                luna_pop(L, 1);
+                luna_pushlstring(L, value, value_end - value);
+            }
+            luna_rawset(L, -3);
+        }
+        p = line_end + 1;
+    }
+}
+
+// Pushes the outcome of a finished transfer and gives its resources back:
+// the response table, or nil and a message.
+static int transfer_finish(luna_State *L, HttpClient *client, HttpTransfer *transfer) {
+    CURL *easy = transfer->easy;
+    int nresults = 1;
+    if (!easy || transfer->result != CURLE_OK) {
+        luna_pushnil(L);
+        if (!easy || transfer->result == TRANSFER_NOT_STARTED) {
+            luna_pushliteral(L, "cannot start transfer");
+        } else {
+            luna_pushstring(L, transfer->error[0] ? transfer->error : curl_easy_strerror(transfer->result));
+        }
+        nresults = 2;
+    } else {
+        long status = 0, connects = 0;
+        double dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+        char *url = NULL;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+        curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME, &dns);
+        curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME, &tls);
+        curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+        curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total);
+
+        luna_createtable(L, 0, 6);
+        luna_pushinteger(L, status);
+        luna_setfield(L, -2, "status");
+        luna_pushlstring(L, transfer->response.data ? transfer->response.data : "", transfer->response.len);
+        luna_setfield(L, -2, "body");
+        push_response_headers(L, &transfer->headers);
+        luna_setfield(L, -2, "headers");
+        luna_pushstring(L, url ? url : transfer->url);
+        luna_setfield(L, -2, "url");
+        luna_pushboolean(L, connects == 0);
+        luna_setfield(L, -2, "reused");
+        luna_createtable(L, 0, 5);
+        set_number_field(L, "dns", dns);
+        set_number_field(L, "connect", connect);
+        set_number_field(L, "tls", tls);
+        set_number_field(L, "first_byte", first_byte);
+        set_number_field(L, "total", total);
+        luna_setfield(L, -2, "timing");
+    }
+
+    if (easy) {
+        curl_multi_remove_handle(client->multi, easy);
+        client_release_easy(client, easy);
+    }
+    curl_slist_free_all(transfer->request_headers);
+    free(transfer->response.data);
+    free(transfer->headers.data);
+    memset(transfer, 0, sizeof(*transfer));
+    return nresults;
+}
+
+// client:get(request) -> response | nil, message
+static int client_get(luna_State *L) {
+    HttpClient *client = check_client(L);
+    check_request(L, 2, 2);
+    HttpTransfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer_prepare(L, &transfer, 2);
+    client_run(client, &transfer, 1);
+    return transfer_finish(L, client, &transfer);
+}
+
+// client:get_many({requests}) -> {responses}, in the same order
+static int client_get_many(luna_State *L) {
+    HttpClient *client = check_client(L);
+    lunaL_checktype(L, 2, LUNA_TTABLE);
+    int count = (int)luna_rawlen(L, 2);
+    for (int i = 1; i <= count; i++) {
+        luna_rawgeti(L, 2, i);
+        check_request(L, luna_gettop(L), 2);
+        luna_pop(L, 1);
+    }
+
+    HttpTransfer *transfers = (HttpTransfer *)luna_newuserdatauv(L, sizeof(HttpTransfer) * (count > 0 ? count : 1), 0);
+    memset(transfers, 0, sizeof(HttpTransfer) * count);
+    for (int i = 0; i < count; i++) {
+        luna_rawgeti(L, 2, i + 1);  // anchored by the list
+        transfer_prepare(L, &transfers[i], luna_gettop(L));
+        luna_pop(L, 1);
+    }
+    client_run(client, transfers, count);
+
+    luna_createtable(L, count, 0);
+    for (int i = 0; i < count; i++) {
+        const char *url = transfers[i].url;
+        if (transfer_finish(L, client, &transfers[i]) == 2) {
+            luna_createtable(L, 0, 2);
+            luna_insert(L, -2);
+            luna_setfield(L, -2, "error");
+            luna_remove(L, -2);  // the nil
+            luna_pushstring(L, url);
+            luna_setfield(L, -2, "url");
+        }
+        luna_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int client_close(luna_State *L) {
+    HttpClient *client = (HttpClient *)lunaL_checkudata(L, 1, HTTP_CLIENT);
+    for (int i = 0; i < client->idle_count; i++) {
+        curl_easy_cleanup(client->idle[i]);
+    }
+    free(client->idle);
+    client->idle = NULL;
+    client->idle_count = client->idle_capacity = 0;
+    if (client->multi) {
+        curl_multi_cleanup(client->multi);
+        client->multi = NULL;
+    }
+    free(client->user_agent);
+    client->user_agent = NULL;
+    return 0;
+}
+
+static const lunaL_Reg client_methods[] = {
+    {"get", client_get},
+    {"get_many", client_get_many},
+    {"close", client_close},
+    {NULL, NULL}
+};
+
+static HttpClient *client_new(luna_State *L) {
+    pthread_once(&curl_initialized_, curl_initialize);
+    HttpClient *client = (HttpClient *)luna_newuserdatauv(L, sizeof(HttpClient), 0);
+    memset(client, 0, sizeof(*client));
+    if (lunaL_newmetatable(L, HTTP_CLIENT)) {
+        luna_newtable(L);
+        lunaL_setfuncs(L, client_methods, 0);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, client_close);
+        luna_setfield(L, -2, "__gc");
+        luna_pushcfunction(L, client_close);
+        luna_setfield(L, -2, "__close");
+    }
+    luna_setmetatable(L, -2);
+    client->multi = curl_multi_init();
+    if (!client->multi) {
+        lunaL_error(L, "cannot create HTTP client");
+    }
+    client->connect_timeout_ms = 10000;
+    client->follow_redirects = 1;
+    return client;
+}
+
+// http_client([options]) -> client
+static int luna_http_client(luna_State *L) {
+    luna_settop(L, 1);
+    HttpClient *client = client_new(L);
+    if (luna_isnoneornil(L, 1)) {
+        return 1;
+    }
+    lunaL_checktype(L, 1, LUNA_TTABLE);
+    luna_getfield(L, 1, "timeout");
+    client->timeout_ms = (long)(lunaL_optnumber(L, -1, 0) * 1000);
+    luna_getfield(L, 1, "connect_timeout");
+    client->connect_timeout_ms = (long)(lunaL_optnumber(L, -1, client->connect_timeout_ms / 1000.0) * 1000);
+    luna_getfield(L, 1, "max_host_connections");
+    curl_multi_setopt(client->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)lunaL_optinteger(L, -1, 0));
+    luna_getfield(L, 1, "follow_redirects");
+    if (!luna_isnil(L, -1)) {
+        client->follow_redirects = luna_toboolean(L, -1);
+    }
+    luna_getfield(L, 1, "user_agent");
+    const char *user_agent = lunaL_optstring(L, -1, NULL);
+    if (user_agent) {
+        client->user_agent = strdup(user_agent);
+    }
+    luna_pop(L, 5);
+    return 1;
+}
+
+// request(url) -> body: a GET through a client kept in the interpreter's
+// registry, so repeated requests reuse connections too.
+static int luna_curl_request(luna_State *L) {
+    static const char default_client = 0;  // its address is the registry key
+    lunaL_checkstring(L, 1);
+    luna_settop(L, 1);
+    if (luna_rawgetp(L, LUNA_REGISTRYINDEX, &default_client) == LUNA_TNIL) {
+        luna_pop(L, 1);
+        client_new(L);
+        luna_pushvalue(L, -1);
+        luna_rawsetp(L, LUNA_REGISTRYINDEX, &default_client);
+    }
+    luna_insert(L, 1);
+    if (client_get(L) != 1) {
+        return 0;  // Error occurred
+    }
+    luna_getfield(L, -1, "body");
+    return 1;
 }
@@ -1,268 +1,664 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <string>
 #include <functional>
-#include <unordered_map>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
-static char *_read_file(const char *f);
-
-unordered_map<string, string> url_to_file_;
-unordered_map<string, function<void(const char *, size_t, int)>> url_to_post_handler_;
-
-static int handle_client_request(int client_socket);
-static char *_read_file(const char *f) {
-    FILE *file = fopen(f, "r");
-    if (file) {
-        fseek(file, 0, SEEK_END);
-        long size = ftell(file);
-        rewind(file);
-        char *contents = (char *)malloc(size + 1);
-        if (contents) {
-            fread(contents, 1, size, file);
-            contents[size] = '\0';
-            fclose(file);
-            return contents;
-        }
-        fclose(file);
-    }
-    return nullptr;  // File not found or error occurred
-}
+#include "server/http_parser.cpp"
+#include "server/router.cpp"
+#include "server/static_files.cpp"
+#include "server/timers.cpp"
+#include "server/metrics.cpp"
+#include "server/access_log.cpp"
+#include "server/pool.cpp"
+
+// What a route answers with: a bound file or a Lua handler.
+struct Route {
+    StaticFile *file;
+    function<void(const HttpRequest *, const char *, int, const RouteMatch *)> handler;
+};
+
+// Every worker runs its own copy of the script, so routes are per thread.
+thread_local Router router_;
+thread_local vector<Route> routes_;
+
+struct ServerOptions;
+static int handle_client_request(int client_socket, const ServerOptions &options);
+static void handle_request(int client_socket, const HttpRequest *request, const char *base);
+// From aio.cpp, which comes after the server
+static int aio_event_fd();
+static int aio_drain();
+
+#include "server/event_loop.cpp"
+#include "server/io_uring.cpp"
+#include "server/request.cpp"
+#include "server/tasks.cpp"
+#include "server/response.cpp"
+#include "server/websocket.cpp"
+#include "server/response_cache.cpp"
+#include "server/workers.cpp"
 
 static int cwrite(luna_State *L) {
-    const char *response = lunaL_checkstring(L, 1);
+    size_t length;
+    const char *response = lunaL_checklstring(L, 1, &length);
     int client_socket = lunaL_checknumber(L, 2);
 
-    write(client_socket, response, strlen(response));
+    conn_write(client_socket, response, length);
 
-    return 0;
+    return task_throttle(L, client_socket);
 }
 
-static int handle_post(luna_State *L) {
-    const char *url = lunaL_checkstring(L, 1);
-    lunaL_checktype(L, 2, LUNA_TFUNCTION);
+static void add_route(luna_State *L, int method, const char *pattern, Route route) {
+    routes_.push_back(move(route));
+    const char *error = router_insert(&router_, method, pattern, routes_.size() - 1);
+    if (error) {
+        routes_.pop_back();
+        lunaL_error(L, "%s: %s", error, pattern);
+    }
+}
 
+static void add_handler(luna_State *L, int method, const char *pattern, int function_index, HandlerStyle style,
+                        shared_ptr<ResponseCachePolicy> cache = nullptr) {
     // Store the Lua function in a closure
-    luna_pushvalue(L, 2);
+    luna_pushvalue(L, function_index);
     int luna_function_ref = lunaL_ref(L, LUNA_REGISTRYINDEX);
 
-    // Create a lambda function that will call the Lua function when handling the request
-    auto post_handler = [L, luna_function_ref](const char *data, size_t size, int client_socket) {
-        // Retrieve the Lua function from the registry
-        luna_rawgeti(L, LUNA_REGISTRYINDEX, luna_function_ref);
-
-        // Push the necessary parameters onto the Lua stack
-        luna_pushstring(L, data);
-        luna_pushnumber(L, size);
-        luna_pushnumber(L, client_socket);
-
-        // Call the Lua function
-        if (luna_pcall(L, 3, 0, 0) != 0) {
-            // Handle Lua error if needed
-            const char *error_message = luna_tostring(L, -1);
-            fprintf(stderr, "Lua error: %s\n", error_message);
-            luna_pop(L, 1); // Pop the error message from the stack
+    // Handlers run in coroutines of the main thread, whatever registered them
+    luna_rawgeti(L, LUNA_REGISTRYINDEX, LUNA_RIDX_MAINTHREAD);
+    luna_State *main_thread = luna_tothread(L, -1);
+    luna_pop(L, 1);
+
+    // Each request runs the Lua function in its own coroutine, which yields
+    // back to the event loop whenever it would block on a socket
+    auto handler = [main_thread, luna_function_ref, style, cache](const HttpRequest *request, const char *base,
+                                                                  int client_socket, const RouteMatch *match) {
+        if (cache && response_cache_lookup(cache.get(), request, base, client_socket)) {
+            return;  // answered from C, or waiting for an identical request
+        }
+        if (style == HANDLER_WEBSOCKET && !websocket_accept(main_thread, request, base, client_socket)) {
+            return;  // refused; the error response is queued
         }
+        task_start(main_thread, luna_function_ref, style, client_socket, request, base, match);
     };
+    add_route(L, method, pattern, Route{nullptr, handler});
+}
 
-    // Store the URL and corresponding post handler
-    url_to_post_handler_[url] = post_handler;
+// route(method, pattern, handler [, options]): method is any HTTP method or
+// "*" for all of them; pattern may contain :param segments and a trailing
+// *wildcard. The handler is called as handler(req, res), with req.params
+// holding the captured segments. options.cache = seconds (or {ttl = seconds,
+// vary = {header names}}) keeps its responses; see response_cache.cpp.
+static int route(luna_State *L) {
+    const char *method = lunaL_checkstring(L, 1);
+    const char *pattern = lunaL_checkstring(L, 2);
+    lunaL_checktype(L, 3, LUNA_TFUNCTION);
+
+    int m = router_method_parse(method);
+    if (m < 0) {
+        return lunaL_error(L, "unknown HTTP method '%s'", method);
+    }
+    add_handler(L, m, pattern, 3, HANDLER_REQUEST, response_cache_policy(L, 4));
+    return 0;
+}
+
+// handle_post(url, handler [, options]), with the options of route()
+static int handle_post(luna_State *L) {
+    const char *url = lunaL_checkstring(L, 1);
+    lunaL_checktype(L, 2, LUNA_TFUNCTION);
+    add_handler(L, ROUTER_POST, url, 2, HANDLER_BODY, response_cache_policy(L, 3));
+    return 0;
+}
+
+// websocket(pattern, handler): upgrades GET requests for pattern to
+// WebSocket connections and calls handler(req, ws) for each, which sets
+// ws.on_message(ws, data, binary) and ws.on_close(ws, code, reason).
+static int websocket(luna_State *L) {
+    const char *pattern = lunaL_checkstring(L, 1);
+    lunaL_checktype(L, 2, LUNA_TFUNCTION);
+    add_handler(L, ROUTER_GET, pattern, 2, HANDLER_WEBSOCKET);
     return 0;
 }
 
 static int bind(luna_State *L) {
     const char *url = lunaL_checkstring(L, 1);
     const char *file_to_show = lunaL_checkstring(L, 2);
-    url_to_file_[url] = file_to_show;
+    add_route(L, ROUTER_GET, url, Route{static_file_get(file_to_show), nullptr});
     return 0;
 }
 
-static int run(luna_State *L) {
-    int port = lunaL_checknumber(L, 1);
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Error creating socket");
-        exit(EXIT_FAILURE);
+// metrics(url): serves the counters of every worker on GET url in the
+// Prometheus text format.
+static int metrics(luna_State *L) {
+    const char *url = lunaL_checkstring(L, 1);
+    auto handler = [](const HttpRequest *request, const char *base, int client_socket, const RouteMatch *) {
+        static thread_local string body;
+        MetricsTotals totals;
+        metrics_collect(&totals);
+        body.clear();
+        metrics_format(&totals, &body);
+
+        char header[128];
+        int header_size = snprintf(header, sizeof(header),
+                                   "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                                   body.size());
+        conn_write(client_socket, header, header_size);
+        if (!http_method_is(request, base, "HEAD")) {
+            conn_write(client_socket, body.data(), body.size());
+        }
+    };
+    add_route(L, ROUTER_GET, url, Route{nullptr, handler});
+    return 0;
+}
+
+static void set_integer_field(luna_State *L, const char *name, uint64_t value) {
+    luna_pushinteger(L, (luna_Integer)value);
+    luna_setfield(L, -2, name);
+}
+
+// stats() -> table of the counters summed over every worker:
+//   connections_accepted, connections_open, connections_peak,
+//   connection_objects, requests, timeouts,
+//   bytes_received, bytes_sent, log_dropped, cache_hits, cache_misses,
+//   cache_coalesced, responses = {["2xx"] = n, ...} and
+//   latency = {count, mean, p50, p90, p99, p999} in seconds
+static int stats(luna_State *L) {
+    MetricsTotals totals;
+    metrics_collect(&totals);
+
+    luna_createtable(L, 0, 14);
+    set_integer_field(L, "connections_accepted", totals.connections_opened);
+    set_integer_field(L, "connections_open", totals.connections_opened - totals.connections_closed);
+    set_integer_field(L, "connections_peak", totals.connections_peak);
+    set_integer_field(L, "connection_objects", totals.connection_objects);
+    set_integer_field(L, "requests", totals.requests);
+    set_integer_field(L, "timeouts", totals.timeouts);
+    set_integer_field(L, "bytes_received", totals.bytes_received);
+    set_integer_field(L, "bytes_sent", totals.bytes_sent);
+    set_integer_field(L, "log_dropped", totals.log_dropped);
+    set_integer_field(L, "cache_hits", totals.cache_hits);
+    set_integer_field(L, "cache_misses", totals.cache_misses);
+    set_integer_field(L, "cache_coalesced", totals.cache_coalesced);
+
+    luna_createtable(L, 0, 5);
+    for (int c = 1; c < 6; c++) {
+        char name[4] = {(char)('0' + c), 'x', 'x', '\0'};
+        set_integer_field(L, name, totals.responses[c]);
     }
+    luna_setfield(L, -2, "responses");
 
-    int reuse = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0) {
-        perror("Error setting socket option");
-        exit(EXIT_FAILURE);
+    uint64_t count = 0;
+    for (uint64_t n : totals.latency) {
+        count += n;
     }
+    luna_createtable(L, 0, 6);
+    set_integer_field(L, "count", count);
+    luna_pushnumber(L, count ? totals.latency_sum / 1e6 / count : 0);
+    luna_setfield(L, -2, "mean");
+    const pair<const char *, double> quantiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+    for (const auto &q : quantiles) {
+        luna_pushnumber(L, metrics_quantile(&totals, q.second) / 1e6);
+        luna_setfield(L, -2, q.first);
+    }
+    luna_setfield(L, -2, "latency");
+    return 1;
+}
 
-    sockaddr_in server_address{};
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(port);
+// Reads a timeout option given in (possibly fractional) seconds, as ms.
+static int opt_timeout(luna_State *L, int options_index, const char *name, int default_ms) {
+    luna_getfield(L, options_index, name);
+    luna_Number seconds = lunaL_optnumber(L, -1, default_ms / 1000.0);
+    luna_pop(L, 1);
+    lunaL_argcheck(L, seconds >= 0 && seconds < INT_MAX / 1000, options_index, "invalid timeout");
+    return (int)(seconds * 1000);
+}
 
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Error binding socket");
-        exit(EXIT_FAILURE);
+// Fills in config for a Unix socket at path; a leading '@' names a socket
+// in the abstract namespace, which has no file.
+static void listener_unix(luna_State *L, const char *path, ListenerConfig *config) {
+    sockaddr_un *address = (sockaddr_un *)&config->address;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(address->sun_path)) {
+        lunaL_error(L, "invalid Unix socket path '%s'", path);
     }
-
-    if (listen(server_socket, 5) < 0) {
-        perror("Error listening on socket");
-        exit(EXIT_FAILURE);
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, len + 1);
+    config->address_len = offsetof(sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        address->sun_path[0] = '\0';
+        config->address_len--;  // abstract names are not NUL-terminated
     }
+    config->name = string("unix:") + path;
+}
 
-    printf("Server listening on port %d...\n", port);
+// Fills in config for TCP on host and port. An empty host or "*" is every
+// IPv4 address and "::" every address, IPv4 clients included.
+static void listener_inet(luna_State *L, const char *host, luna_Integer port, ListenerConfig *config) {
+    if (port < 0 || port > 65535) {
+        lunaL_error(L, "invalid port %d", (int)port);
+    }
+    addrinfo hints{};
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    const char *node = host;
+    if (host[0] == '\0' || strcmp(host, "*") == 0) {
+        host = "*";
+        node = nullptr;
+        hints.ai_family = AF_INET;
+    }
+    char service[8];
+    snprintf(service, sizeof(service), "%d", (int)port);
+    addrinfo *result;
+    int error = getaddrinfo(node, service, &hints, &result);
+    if (error != 0) {
+        lunaL_error(L, "cannot listen on '%s': %s", host, gai_strerror(error));
+    }
+    memcpy(&config->address, result->ai_addr, result->ai_addrlen);
+    config->address_len = result->ai_addrlen;
+    bool v6 = result->ai_family == AF_INET6;
+    freeaddrinfo(result);
+    config->name = v6 ? "[" + string(host) + "]:" + service : string(host) + ":" + service;
+}
 
-    while (true) {
-        int client_socket = accept(server_socket, nullptr, nullptr);
-        if (client_socket < 0) {
-            perror("Error accepting connection");
-            continue;
+// Reads the listener at index: "unix:/path", "host:port", "[v6 address]:port"
+// or a table {host = , port = } / {path = } with optional backlog, v6only
+// and (Unix sockets) mode, the socket file's permissions.
+static ListenerConfig listener_config(luna_State *L, int index, int backlog) {
+    ListenerConfig config{};
+    config.backlog = backlog;
+    config.unix_mode = -1;
+    if (luna_type(L, index) == LUNA_TSTRING) {
+        const char *spec = luna_tostring(L, index);
+        if (strncmp(spec, "unix:", 5) == 0) {
+            listener_unix(L, spec + 5, &config);
+            return config;
         }
-
-        handle_client_request(client_socket);
-        close(client_socket);
+        const char *colon = strrchr(spec, ':');
+        if (!colon) {
+            lunaL_error(L, "listener '%s' needs a port", spec);
+        }
+        string host(spec, colon - spec);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        char *end;
+        long port = strtol(colon + 1, &end, 10);
+        if (colon[1] == '\0' || *end != '\0') {
+            lunaL_error(L, "invalid port in listener '%s'", spec);
+        }
+        listener_inet(L, host.c_str(), port, &config);
+        return config;
     }
 
-    return 0;
+    lunaL_checktype(L, index, LUNA_TTABLE);
+    if (luna_getfield(L, index, "path") != LUNA_TNIL) {
+        listener_unix(L, lunaL_checkstring(L, -1), &config);
+    } else {
+        luna_getfield(L, index, "host");
+        luna_getfield(L, index, "port");
+        listener_inet(L, lunaL_optstring(L, -2, ""), lunaL_checkinteger(L, -1), &config);
+        luna_pop(L, 2);
+    }
+    luna_pop(L, 1);
+
+    luna_getfield(L, index, "backlog");
+    config.backlog = lunaL_optinteger(L, -1, config.backlog);
+    luna_getfield(L, index, "v6only");
+    config.v6only = luna_toboolean(L, -1);
+    luna_getfield(L, index, "mode");
+    if (luna_type(L, -1) == LUNA_TSTRING) {
+        config.unix_mode = strtol(luna_tostring(L, -1), nullptr, 8);  // as chmod takes it
+    } else {
+        config.unix_mode = lunaL_optinteger(L, -1, config.unix_mode);
+    }
+    luna_pop(L, 3);
+    return config;
 }
 
-static int handle_client_request(int client_socket) {
-    const char *response_template = "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s";
-    const char *not_found_response = "HTTP/1.1 404 Not Found\r\n\r\nFile not found.";
-
-    char buffer[1024];
-    ssize_t bytesRead = read(client_socket, buffer, sizeof(buffer) - 1);
-    if (bytesRead > 0) {
-        buffer[bytesRead] = '\0';
-
-
-        const char *url_start = strstr(buffer, "GET ");
-        if (url_start) {
-            const char *url_end = strchr(url_start + 4, ' ');
-            if (url_end) {
-                string requested_url(url_start + 4, url_end);
-                auto it = url_to_file_.find(requested_url);
-
-                if (it != url_to_file_.end()) {
-                    char *file_contents = _read_file(it->second.c_str());
-                    if (file_contents) {
-                        char response[1024];
-                        snprintf(response, sizeof(response), response_template, strlen(file_contents), file_contents);
-                        write(client_socket, response, strlen(response));
-                        free(file_contents);
-                    } else {
-                        write(client_socket, not_found_response, strlen(not_found_response));
-                    }
-                } else {
-                    write(client_socket, not_found_response, strlen(not_found_response));
-                }
-            }
-        } else {
+// Reads the optional options table passed to run()/crun() and starts the
+// requested serving loop. The port may be left out if listen is given.
+//   listen       more addresses to accept connections on: one or a list of
+//                "unix:/path" (or "unix:@name", an abstract socket), "host:port",
+//                "[::]:port" (IPv4 clients too) or tables {host, port} / {path},
+//                optionally with backlog, v6only and mode (Unix socket permissions)
+//   backlog      connections the kernel queues for accept() (default SOMAXCONN)
+//   mode         "epoll" (default), "io_uring" (falls back to epoll where the
+//                kernel lacks it) or "blocking"
+//   keep_alive   reuse connections between requests (default true)
+//   idle_timeout seconds an idle kept-alive connection stays open, or a client
+//                may go without reading its response (default 5)
+//   header_timeout seconds a client has to send a whole request head (default 10)
+//   body_timeout seconds a request body may stall between reads (default 30)
+//   max_body_size largest accepted request body in bytes (default 0, no limit)
+//   access_log   file to append a line per request to, "-" for stdout (default none)
+//   access_log_buffer   bytes of log lines each worker may have waiting to be
+//                       written before it drops more (default 1 MiB)
+//   file_cache_size     bytes of small static files kept in memory (default 0, off)
+//   file_cache_max_file largest file eligible for the cache (default 64 KiB)
+//   compress_cache_size bytes of gzip-compressed static files kept for clients
+//                       accepting gzip (default 0, only precompressed .gz/.zst)
+//   compress_max_file   largest file compressed on the fly (default 1 MiB)
+//   response_cache_size bytes of responses each worker keeps for routes
+//                       with the cache option (default 16 MiB)
+//   workers      threads, each with its own interpreter re-running this
+//                script and its own SO_REUSEPORT listener (default 1, 0 = one per CPU)
+static int serve(luna_State *L, bool exit_on_error) {
+    // run([port,] [options])
+    int options_index = luna_istable(L, 1) ? 1 : 2;
+    int port = options_index == 2 ? lunaL_checknumber(L, 1) : -1;
+    ServerOptions options{"epoll", true, 5000, 10000, 30000, 0, 1, {}};
+    int backlog = SOMAXCONN;
+    if (!luna_isnoneornil(L, options_index)) {
+        lunaL_checktype(L, options_index, LUNA_TTABLE);
+        luna_getfield(L, options_index, "mode");
+        options.mode = lunaL_optstring(L, -1, options.mode);
+        luna_pop(L, 1);
 
-            const char *url_start = strstr(buffer, "POST ");
-            if (url_start) {
-                const char *url_end = strchr(url_start + 5, ' ');
-                if (url_end) {
-                    string requested_url(url_start + 5, url_end);
-                    auto it = url_to_post_handler_.find(requested_url);
-                    // Replace the problematic section in handle_client_request function
-                    if (it != url_to_post_handler_.end()) {
-                        // Extract POST data from the request
-                        const char *data_start = strstr(buffer, "\r\n\r\n");
-                        if (data_start) {
-                            data_start += 4;  // Move past "\r\n\r\n"
-                            size_t data_size = bytesRead - (data_start - buffer);
-
-                            // Call the registered POST handler
-                            it->second(data_start, data_size, client_socket);
-                        }
-                    } else {
-                        // Handle case where no POST handler is registered for the URL
-                        const char *not_found_response = "HTTP/1.1 404 Not Found\r\n\r\nNo POST handler registered.";
-                        write(client_socket, not_found_response, strlen(not_found_response));
-                    }
-
-                }
-            }
+        luna_getfield(L, options_index, "keep_alive");
+        if (!luna_isnil(L, -1)) {
+            options.keep_alive = luna_toboolean(L, -1);
+        }
+        luna_pop(L, 1);
+
+        options.idle_timeout = opt_timeout(L, options_index, "idle_timeout", options.idle_timeout);
+        options.header_timeout = opt_timeout(L, options_index, "header_timeout", options.header_timeout);
+        options.body_timeout = opt_timeout(L, options_index, "body_timeout", options.body_timeout);
+
+        luna_getfield(L, options_index, "max_body_size");
+        options.max_body_size = lunaL_optinteger(L, -1, 0);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "file_cache_size");
+        static_files_.max_bytes = lunaL_optinteger(L, -1, static_files_.max_bytes);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "file_cache_max_file");
+        static_files_.max_file_size = lunaL_optinteger(L, -1, static_files_.max_file_size);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "access_log");
+        const char *access_log = lunaL_optstring(L, -1, nullptr);
+        luna_getfield(L, options_index, "access_log_buffer");
+        size_t access_log_buffer = lunaL_optinteger(L, -1, 1024 * 1024);
+        if (access_log && !access_log_open(access_log, access_log_buffer)) {
+            return lunaL_error(L, "cannot open access log '%s': %s", access_log, strerror(errno));
+        }
+        luna_pop(L, 2);
+
+        // Process-wide, so the last run() to set them wins
+        luna_getfield(L, options_index, "compress_cache_size");
+        size_t compress_cache_size = lunaL_optinteger(L, -1, compressed_cache_.max_bytes);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "compress_max_file");
+        size_t compress_max_file = lunaL_optinteger(L, -1, compressed_cache_.max_file_size);
+        luna_pop(L, 1);
+        {
+            lock_guard<mutex> guard(compressed_cache_.lock);
+            compressed_cache_.max_bytes = compress_cache_size;
+            compressed_cache_.max_file_size = compress_max_file;
         }
-        close(client_socket);
+
+        luna_getfield(L, options_index, "response_cache_size");
+        response_cache_.max_bytes = lunaL_optinteger(L, -1, response_cache_.max_bytes);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "workers");
+        options.workers = lunaL_optinteger(L, -1, options.workers);
+        luna_pop(L, 1);
+
+        luna_getfield(L, options_index, "backlog");
+        backlog = lunaL_optinteger(L, -1, backlog);
+        luna_pop(L, 1);
+        lunaL_argcheck(L, backlog > 0, options_index, "invalid backlog");
     }
 
-    return 0;
-}
+    if (port >= 0) {
+        ListenerConfig config{};
+        listener_inet(L, "*", port, &config);
+        config.name = "port " + to_string(port);
+        config.backlog = backlog;
+        config.unix_mode = -1;
+        options.listeners.push_back(config);
+    }
+    if (!luna_isnoneornil(L, options_index)) {
+        // listen = "address" or {"address" or {host = ..., port = ...}, ...}
+        int type = luna_getfield(L, options_index, "listen");
+        if (type == LUNA_TTABLE && luna_rawlen(L, -1) > 0) {
+            for (luna_Integer i = 1; luna_rawgeti(L, -1, i) != LUNA_TNIL; i++) {
+                options.listeners.push_back(listener_config(L, luna_gettop(L), backlog));
+                luna_pop(L, 1);
+            }
+            luna_pop(L, 1);  // the nil ending the list
+        } else if (type != LUNA_TNIL) {
+            options.listeners.push_back(listener_config(L, luna_gettop(L), backlog));
+        }
+        luna_pop(L, 1);
+    }
+    if (options.listeners.empty()) {
+        return lunaL_error(L, "nothing to listen on: pass a port or a listen option");
+    }
+    string listening;
+    for (const ListenerConfig &config : options.listeners) {
+        listening += (listening.empty() ? "" : ", ") + config.name;
+    }
 
-static int cbind(luna_State *L) {
-    if (!luna_istable(L, 1)) {
-        lunaL_error(L, "Argument must be a table");
-        return 0;
+    if (strcmp(options.mode, "blocking") != 0 && strcmp(options.mode, "epoll") != 0 &&
+        strcmp(options.mode, "io_uring") != 0) {
+        return lunaL_error(L, "unknown server mode '%s'", options.mode);
     }
 
-    luna_pushnil(L);
+    if (worker_id_ < 0) {
+        if (options.workers != 1) {
+            options.workers = spawn_workers(L, options.workers);
+            printf("Server listening on %s with %d workers...\n", listening.c_str(), options.workers);
+        } else {
+            printf("Server listening on %s...\n", listening.c_str());
+        }
+    }
 
-    while (luna_next(L, 1) != 0) {
-        const char *url = lunaL_checkstring(L, -2);
-        const char *file = lunaL_checkstring(L, -1);
+    // Peers that hang up mid-response must not kill the server; sendfile()
+    // has no MSG_NOSIGNAL equivalent.
+    signal(SIGPIPE, SIG_IGN);
 
-        url_to_file_[url] = file;
+    metrics_local();  // so stats() sees every worker, busy or not
 
-        luna_pop(L, 1);
+    if (strcmp(options.mode, "blocking") == 0) {
+        serve_blocking(options, exit_on_error);
+    } else if (strcmp(options.mode, "io_uring") == 0) {
+        serve_uring(options);
+    } else {
+        serve_epoll(options);
     }
 
     return 0;
 }
 
-static int crun(luna_State *L) {
-    int port = lunaL_checknumber(L, 1);
+static int run(luna_State *L) {
+    return serve(L, false);
+}
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Error creating socket");
-        exit(EXIT_FAILURE);
+static int handle_client_request(int client_socket, const ServerOptions &options) {
+    string buffer;
+    HttpRequest request;
+    http_request_reset(&request);
+
+    // The head has header_timeout from the first read, the body body_timeout
+    // between reads, as in the event loop.
+    uint64_t header_deadline = timer_clock() + options.header_timeout;
+    char chunk[SERVER_READ_CHUNK];
+    int result = HTTP_PARSE_AGAIN;
+    while (result == HTTP_PARSE_AGAIN) {
+        int timeout = -1;
+        if (request.state < HTTP_BODY && options.header_timeout > 0) {
+            uint64_t now = timer_clock();
+            timeout = now < header_deadline ? header_deadline - now : 0;
+        } else if (request.state >= HTTP_BODY && options.body_timeout > 0) {
+            timeout = options.body_timeout;
+        }
+        pollfd pfd{client_socket, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) == 0) {
+            metrics_add(metrics_local()->timeouts);
+            if (!buffer.empty()) {
+                conn_write_error(client_socket, 408);
+                metrics_response(408, 0);
+            }
+            return 0;
+        }
+        ssize_t bytesRead = read(client_socket, chunk, sizeof(chunk));
+        if (bytesRead <= 0) {
+            return 0;
+        }
+        metrics_add(metrics_local()->bytes_received, bytesRead);
+        buffer.append(chunk, bytesRead);
+        result = http_parse_request(&request, &buffer[0], buffer.size(), options.max_body_size);
     }
 
-    int reuse = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0) {
-        perror("Error setting socket option");
-        exit(EXIT_FAILURE);
+    if (result == HTTP_PARSE_ERROR) {
+        conn_write_error(client_socket, request.error_status);
+        metrics_response(request.error_status, 0);
+        return 0;
     }
 
-    sockaddr_in server_address{};
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(port);
+    static thread_local AccessLogEntry log;
+    uint64_t sent = metrics_local()->bytes_sent.load(memory_order_relaxed);
+    if (access_log_enabled()) {
+        access_log_peer(&log, client_socket);
+        access_log_begin(&log, &request, buffer.data());
+    }
 
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Error binding socket");
-        exit(EXIT_FAILURE);
+    uint64_t start = metrics_clock();
+    unowned_status_ = 0;
+    task_failed_ = false;
+    handle_request(client_socket, &request, buffer.data());
+    metrics_response(unowned_status_, start);
+    if (access_log_enabled()) {
+        access_log_end(&log, unowned_status_, metrics_local()->bytes_sent.load(memory_order_relaxed) - sent, start);
     }
+    return task_failed_ ? -1 : 0;
+}
 
-    if (listen(server_socket, 5) < 0) {
-        perror("Error listening on socket");
-        exit(EXIT_FAILURE);
+static void handle_request(int client_socket, const HttpRequest *request, const char *base) {
+    const char *response_template = "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                                    "Vary: Accept-Encoding\r\n%s\r\n";
+    const char *range_template = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\n"
+                                 "Content-Length: %zu\r\nETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n\r\n";
+    const char *not_found_response = "HTTP/1.1 404 Not Found\r\nContent-Length: 15\r\n\r\nFile not found.";
+
+    RouteMatch match;
+    int method = router_method(http_slice(base, request->method));
+    if (!router_match(&router_, method, http_slice(base, request->path), &match)) {
+        if (match.path_matched) {
+            // RFC 9110 requires a 405 to list the methods the resource has
+            char allowed[96];
+            router_format_allowed(match.allowed, allowed, sizeof(allowed));
+            char not_allowed_response[192];
+            int len = snprintf(not_allowed_response, sizeof(not_allowed_response),
+                               "HTTP/1.1 405 Method Not Allowed\r\nAllow: %s\r\nContent-Length: 19\r\n\r\n"
+                               "Method not allowed.", allowed);
+            conn_write(client_socket, not_allowed_response, len);
+        } else if (method == ROUTER_POST) {
+            // Handle case where no POST handler is registered for the URL
+            const char *not_found_response = "HTTP/1.1 404 Not Found\r\nContent-Length: 27\r\n\r\nNo POST handler registered.";
+            conn_write(client_socket, not_found_response, strlen(not_found_response));
+        } else {
+            conn_write(client_socket, not_found_response, strlen(not_found_response));
+        }
+        return;
     }
 
-    printf("Server listening on port %d...\n", port);
+    const Route &route = routes_[match.route];
+    if (route.handler) {
+        route.handler(request, base, client_socket, &match);
+        return;
+    }
 
-    while (true) {
-        int client_socket = accept(server_socket, nullptr, nullptr);
-        if (client_socket < 0) {
-            perror("Error accepting connection");
-            continue;
-        }
+    StaticFile *file = route.file;
+    time_t now = server_now();
+    if (!static_file_open(file, now)) {
+        conn_write(client_socket, not_found_response, strlen(not_found_response));
+        return;
+    }
+    StaticBody body;
+    static_file_negotiate(file, request, base, now, &body);
+    const FileSnapshot *snapshot = body.snapshot.get();
+
+    // Compressed bodies are not sent in ranges; see static_file_negotiate().
+    char extra[64];
+    if (body.encoding) {
+        snprintf(extra, sizeof(extra), "Content-Encoding: %s\r\n", body.encoding);
+    } else {
+        snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\n");
+    }
 
-        if (handle_client_request(client_socket) != 0) {
-            close(server_socket);
-            close(client_socket);
-            exit(EXIT_FAILURE);
-        }
+    char header[384];
+    size_t offset = 0, len = body.size();
+    int status = static_file_status(&body, request, base, &offset, &len);
+    int header_size;
+    if (status == 304) {
+        header_size = snprintf(header, sizeof(header),
+                               "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\nVary: Accept-Encoding\r\n\r\n",
+                               body.etag, snapshot->last_modified);
+    } else if (status == 416) {
+        header_size = snprintf(header, sizeof(header),
+                               "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n",
+                               body.size());
+    } else if (status == 206) {
+        header_size = snprintf(header, sizeof(header), range_template, offset, offset + len - 1, body.size(), len,
+                               body.etag, snapshot->last_modified);
+    } else {
+        header_size = snprintf(header, sizeof(header), response_template, len, body.etag, snapshot->last_modified, extra);
+    }
+    conn_write(client_socket, header, header_size);
+    if ((status != 200 && status != 206) || http_method_is(request, base, "HEAD")) {
+        return;
+    }
+
+    // Small hot files come from memory, everything else (and any range) from
+    // the page cache via sendfile(); neither copies through user space.
+    shared_ptr<const string> cached = body.data;
+    if (!cached && status == 200) {
+        cached = static_file_cached(body.source);
+    }
+    if (cached) {
+        conn_write_shared(client_socket, cached);
+    } else {
+        conn_sendfile(client_socket, body.snapshot, offset, len);
+    }
+}
+
+static int cbind(luna_State *L) {
+    if (!luna_istable(L, 1)) {
+        lunaL_error(L, "Argument must be a table");
+        return 0;
+    }
+
+    luna_pushnil(L);
+
+    while (luna_next(L, 1) != 0) {
+        const char *url = lunaL_checkstring(L, -2);
+        const char *file = lunaL_checkstring(L, -1);
+
+        add_route(L, ROUTER_GET, url, Route{static_file_get(file), nullptr});
 
-        close(client_socket);
+        luna_pop(L, 1);
     }
 
     return 0;
 }
 
+// Like run(), but in blocking mode the process exits once a handler raises.
+static int crun(luna_State *L) {
+    return serve(L, true);
+}
+
 static int init_server(luna_State *L) {
     luna_newtable(L);
 
@@ -281,9 +677,53 @@ static int init_server(luna_State *L) {
     luna_pushcfunction(L, handle_post);
     luna_setfield(L, -2, "handle_post");
 
+    luna_pushcfunction(L, route);
+    luna_setfield(L, -2, "route");
+
     // Add the cwrite function
     luna_pushcfunction(L, cwrite);
     luna_setfield(L, -2, "cwrite");
 
+    // Request and response objects passed to route handlers
+    request_open(L);
+    response_open(L);
+    luna_pushcfunction(L, server_response);
+    luna_setfield(L, -2, "response");
+
+    // WebSocket routes and the objects their handlers get
+    websocket_open(L);
+    luna_pushcfunction(L, websocket);
+    luna_setfield(L, -2, "websocket");
+
+    // Socket helpers that yield to the event loop inside handlers
+    luna_pushcfunction(L, server_connect);
+    luna_setfield(L, -2, "connect");
+
+    luna_pushcfunction(L, server_send);
+    luna_setfield(L, -2, "send");
+
+    luna_pushcfunction(L, server_recv);
+    luna_setfield(L, -2, "recv");
+
+    luna_pushcfunction(L, server_close);
+    luna_setfield(L, -2, "close");
+
+    // Counters of every worker
+    luna_pushcfunction(L, metrics);
+    luna_setfield(L, -2, "metrics");
+
+    luna_pushcfunction(L, stats);
+    luna_setfield(L, -2, "stats");
+
+    // Timers run by the serving loop
+    luna_pushcfunction(L, server_after);
+    luna_setfield(L, -2, "after");
+
+    luna_pushcfunction(L, server_every);
+    luna_setfield(L, -2, "every");
+
+    luna_pushcfunction(L, server_cancel);
+    luna_setfield(L, -2, "cancel");
+
     return 1;
 }
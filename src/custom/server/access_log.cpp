@@ -0,0 +1,270 @@
+// Access log in the combined format, plus the time spent on each request:
+//
+//   127.0.0.1 - - [18/Oct/2026:05:40:00 +0000] "GET / HTTP/1.1" 200 1432 "-" "curl/8.5.0" 0.001
+//
+// The size is the whole response, head included. Serving threads never
+// touch the log file: each formats its lines into a ring buffer of its own,
+// which a background thread drains with one writev() for every worker's
+// pending lines. A ring has a single producer and a single consumer, so
+// both sides only need acquire/release loads and stores. A line that does
+// not fit is dropped and counted rather than waited for.
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <climits>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define ACCESS_LOG_MAX_RINGS METRICS_MAX_WORKERS
+#define ACCESS_LOG_MAX_LINE 4096      // longer lines have their fields cut short
+#define ACCESS_LOG_MAX_FIELD 1024     // longest target, referer or user agent logged
+#define ACCESS_LOG_IDLE_MS 20         // the writer's nap when every ring is empty
+
+struct AccessLogRing {
+    char *data;
+    size_t size;                      // a power of two
+    alignas(64) std::atomic<size_t> head;  // bytes ever written, by the worker
+    alignas(64) std::atomic<size_t> tail;  // bytes ever written out, by the log thread
+};
+
+// What is known about a request when it is dispatched: "peer - - " and
+// "\"request line\"" and " \"referer\" \"user agent\"", back to back.
+struct AccessLogEntry {
+    std::string text;
+    size_t request;                   // offset of the request line
+    size_t tail;                      // offset of the referer
+    char peer[INET6_ADDRSTRLEN];      // client address, set once per connection
+};
+
+struct AccessLog {
+    std::mutex lock;                  // guards opening
+    std::atomic<int> fd{-1};          // -1 while logging is off
+    size_t ring_size;
+    AccessLogRing *rings[ACCESS_LOG_MAX_RINGS];
+    std::atomic<int> ring_count{0};
+};
+
+static AccessLog access_log_;
+static thread_local AccessLogRing *access_log_ring_ = nullptr;
+
+static inline bool access_log_enabled() {
+    return access_log_.fd.load(std::memory_order_relaxed) >= 0;
+}
+
+// Writes out everything the rings hold, in as few writev() calls as fit.
+static bool access_log_drain() {
+    iovec iov[IOV_MAX];
+    size_t heads[ACCESS_LOG_MAX_RINGS];
+    int count = 0;
+    int rings = access_log_.ring_count.load(std::memory_order_acquire);
+    int scanned = 0;
+    for (; scanned < rings && count + 2 <= IOV_MAX; scanned++) {
+        int i = scanned;
+        AccessLogRing *ring = access_log_.rings[i];
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        heads[i] = ring->head.load(std::memory_order_acquire);
+        size_t pending = heads[i] - tail;
+        if (pending == 0) {
+            continue;
+        }
+        size_t start = tail & (ring->size - 1);
+        size_t first = pending < ring->size - start ? pending : ring->size - start;
+        iov[count++] = iovec{ring->data + start, first};
+        if (first < pending) {
+            iov[count++] = iovec{ring->data, pending - first};
+        }
+    }
+    if (count == 0) {
+        return false;
+    }
+
+    int fd = access_log_.fd.load(std::memory_order_relaxed);
+    iovec *next = iov;
+    while (count > 0) {
+        ssize_t n = writev(fd, next, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // the lines are lost, as if dropped
+        }
+        while (count > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    for (int i = 0; i < scanned; i++) {
+        access_log_.rings[i]->tail.store(heads[i], std::memory_order_release);
+    }
+    return true;
+}
+
+static void access_log_main() {
+    while (true) {
+        if (!access_log_drain()) {
+            timespec nap{0, ACCESS_LOG_IDLE_MS * 1000000};
+            nanosleep(&nap, nullptr);
+        }
+    }
+}
+
+// Starts logging to path ("-" for stdout) with ring_size bytes of buffer per
+// worker. Workers re-running the script ask again; only the first call opens
+// anything. Returns false if the file cannot be opened.
+static bool access_log_open(const char *path, size_t ring_size) {
+    std::lock_guard<std::mutex> guard(access_log_.lock);
+    if (access_log_enabled()) {
+        return true;
+    }
+    int fd = strcmp(path, "-") == 0 ? dup(STDOUT_FILENO)
+                                    : open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t size = 4096;
+    while (size < ring_size) {
+        size *= 2;
+    }
+    access_log_.ring_size = size;
+    access_log_.fd.store(fd, std::memory_order_release);
+    std::thread(access_log_main).detach();
+    return true;
+}
+
+// The calling thread's ring, created on first use.
+static AccessLogRing *access_log_local() {
+    if (!access_log_ring_) {
+        AccessLogRing *ring = new AccessLogRing();
+        ring->size = access_log_.ring_size;
+        ring->data = new char[ring->size];
+        std::lock_guard<std::mutex> guard(access_log_.lock);
+        int index = access_log_.ring_count.load(std::memory_order_relaxed);
+        if (index < ACCESS_LOG_MAX_RINGS) {
+            access_log_.rings[index] = ring;
+            access_log_.ring_count.store(index + 1, std::memory_order_release);
+        }
+        access_log_ring_ = ring;  // past the limit it fills up and drops everything
+    }
+    return access_log_ring_;
+}
+
+// Appends value with quotes, backslashes and control bytes escaped the way
+// nginx does.
+static void access_log_append_escaped(std::string *out, std::string_view value) {
+    if (value.size() > ACCESS_LOG_MAX_FIELD) {
+        value = value.substr(0, ACCESS_LOG_MAX_FIELD);
+    }
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+            char escaped[5];
+            snprintf(escaped, sizeof(escaped), "\\x%02X", c);
+            out->append(escaped, 4);
+        } else {
+            out->push_back(c);
+        }
+    }
+}
+
+// Appends value escaped and quoted, or "-" if it is empty.
+static void access_log_append_quoted(std::string *out, std::string_view value) {
+    out->push_back('"');
+    if (value.empty()) {
+        out->push_back('-');
+    } else {
+        access_log_append_escaped(out, value);
+    }
+    out->push_back('"');
+}
+
+// Formats the address of the client on fd into entry->peer.
+static void access_log_peer(AccessLogEntry *entry, int fd) {
+    char *out = entry->peer;
+    sockaddr_storage address;
+    socklen_t len = sizeof(address);
+    out[0] = '-';
+    out[1] = '\0';
+    if (getpeername(fd, (sockaddr *)&address, &len) < 0) {
+        return;
+    }
+    if (address.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((sockaddr_in *)&address)->sin_addr, out, INET6_ADDRSTRLEN);
+    } else if (address.ss_family == AF_INET6) {
+        const in6_addr *ip = &((sockaddr_in6 *)&address)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            inet_ntop(AF_INET, ip->s6_addr + 12, out, INET6_ADDRSTRLEN);  // an IPv4 client of [::]
+        } else {
+            inet_ntop(AF_INET6, ip, out, INET6_ADDRSTRLEN);
+        }
+    } else if (address.ss_family == AF_UNIX) {
+        strcpy(out, "unix:");
+    }
+}
+
+// Records what the request itself says; the rest comes at access_log_end().
+static void access_log_begin(AccessLogEntry *entry, const HttpRequest *request, const char *base) {
+    std::string &text = entry->text;
+    text.assign(entry->peer).append(" - - ");
+    entry->request = text.size();
+
+    text.push_back('"');
+    access_log_append_escaped(&text, http_slice(base, request->method));
+    text.push_back(' ');
+    access_log_append_escaped(&text, http_slice(base, request->target));
+    text.append(request->minor_version ? " HTTP/1.1\"" : " HTTP/1.0\"");
+    entry->tail = text.size();
+
+    const HttpHeader *referer = http_find_header(request, base, "Referer");
+    const HttpHeader *agent = http_find_header(request, base, "User-Agent");
+    text.push_back(' ');
+    access_log_append_quoted(&text, referer ? http_slice(base, referer->value) : std::string_view());
+    text.push_back(' ');
+    access_log_append_quoted(&text, agent ? http_slice(base, agent->value) : std::string_view());
+}
+
+// Completes entry with the outcome and queues the line for the log thread.
+static void access_log_end(const AccessLogEntry *entry, int status, uint64_t bytes, uint64_t start) {
+    // The timestamp only changes once a second
+    static thread_local time_t stamp_time = 0;
+    static thread_local char stamp[48];
+    time_t now = time(nullptr);
+    if (now != stamp_time) {
+        tm utc;
+        gmtime_r(&now, &utc);
+        snprintf(stamp, sizeof(stamp), "[%02d/%s/%04d:%02d:%02d:%02d +0000] ", utc.tm_mday, http_months_[utc.tm_mon],
+                 utc.tm_year + 1900, utc.tm_hour, utc.tm_min, utc.tm_sec);
+        stamp_time = now;
+    }
+
+    char line[ACCESS_LOG_MAX_LINE];
+    const std::string &text = entry->text;
+    uint64_t elapsed = metrics_clock() - start;
+    int len = snprintf(line, sizeof(line), "%.*s%s%.*s %d %llu%.*s %llu.%03llu\n", (int)entry->request, text.data(),
+                       stamp, (int)(entry->tail - entry->request), text.data() + entry->request, status,
+                       (unsigned long long)bytes, (int)(text.size() - entry->tail), text.data() + entry->tail,
+                       (unsigned long long)(elapsed / 1000000), (unsigned long long)(elapsed / 1000 % 1000));
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    AccessLogRing *ring = access_log_local();
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t tail = ring->tail.load(std::memory_order_acquire);
+    if (ring->size - (head - tail) < (size_t)len) {
+        metrics_add(metrics_local()->log_dropped);
+        return;
+    }
+    size_t start_index = head & (ring->size - 1);
+    size_t first = (size_t)len < ring->size - start_index ? len : ring->size - start_index;
+    memcpy(ring->data + start_index, line, first);
+    memcpy(ring->data, line + first, len - first);
+    ring->head.store(head + len, std::memory_order_release);
+}
@@ -0,0 +1,1180 @@
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <strings.h>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define SERVER_READ_CHUNK 16384
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_IOV 16
+// Pipelined requests are not dispatched while this much output is queued.
+#define SERVER_MAX_PENDING_OUTPUT (256 * 1024)
+// ... and a client is not read from while this much input waits behind them.
+#define SERVER_MAX_PENDING_INPUT (256 * 1024)
+// A handler writing past the high-water mark is parked until output drains
+// below the low-water mark.
+#define SERVER_HIGH_WATER (1024 * 1024)
+#define SERVER_LOW_WATER (256 * 1024)
+// Streamed responses keep less queued, so a generator runs at the pace the
+// client reads rather than filling memory ahead of it.
+#define SERVER_STREAM_HIGH_WATER (64 * 1024)
+#define SERVER_STREAM_LOW_WATER (16 * 1024)
+// Buffers a pooled connection keeps for its next client; larger ones are freed.
+#define CONN_KEEP_BUFFER (64 * 1024)
+
+// An address to accept connections on, resolved when run() is called.
+struct ListenerConfig {
+    string name;             // as given, for messages
+    sockaddr_storage address;
+    socklen_t address_len;
+    int backlog;
+    bool v6only;             // IPv6 only: no IPv4 clients through mapped addresses
+    int unix_mode;           // Unix sockets: permissions of the socket file, -1 to leave them
+};
+
+struct ServerOptions {
+    const char *mode;
+    bool keep_alive;
+    // Deadlines in ms, 0 to disable
+    int idle_timeout;        // idle kept-alive connection, or no write progress
+    int header_timeout;      // whole request head, from its first byte
+    int body_timeout;        // between reads of a request body
+    size_t max_body_size;    // 0 for no limit
+    int workers;             // threads with their own interpreter, 0 for one per CPU
+    vector<ListenerConfig> listeners;
+};
+
+enum OutputKind {
+    OUTPUT_BYTES,            // a range of Connection::out_buf
+    OUTPUT_SHARED,           // a range of a shared, immutable buffer
+    OUTPUT_FILE              // a range of a file, sent with sendfile()
+};
+
+struct OutputSegment {
+    OutputKind kind;
+    size_t offset;
+    size_t length;           // bytes not yet sent
+    shared_ptr<const string> shared;
+    shared_ptr<FileSnapshot> file;
+};
+
+struct Connection;
+struct RequestObject;
+struct Response;
+struct Uring;
+struct UringSend;
+struct WebSocket;
+struct ResponseCacheEntry;
+
+// What a connection is waiting for, which decides its deadline.
+enum ConnPhase {
+    CONN_IDLE,               // between requests
+    CONN_HEADERS,            // part of a request head has arrived
+    CONN_BODY,               // reading a request body
+    CONN_WRITING,            // output queued that the client has not read
+    CONN_HANDLER,            // a handler is running; it has no deadline
+    CONN_WEBSOCKET           // upgraded and waiting for frames, for as long as it takes
+};
+
+// A Lua handler running in its own coroutine. When it would block on a
+// socket it yields back to the loop, which resumes it once the socket is
+// ready, so one interpreter can have many requests in flight.
+struct HandlerTask {
+    luna_State *L;           // main thread of the interpreter owning the handler
+    luna_State *co;
+    int ref;                 // registry anchor for co
+    Connection *conn;        // connection being answered, null in blocking mode
+    int wait_fd;             // fd the handler is parked on, -1 if none
+    bool wait_drain;         // parked until the connection's output drains
+    bool wait_aio;           // parked until a file operation (aio.cpp) completes
+    size_t drain_below;      // ... below this many bytes
+    bool answers_request;    // the connection's current request is done when it returns
+    RequestObject *request;  // request object passed to the handler, if any
+    Response *response;      // ... and its response object
+};
+
+static void task_resume(HandlerTask *task);
+
+struct Connection {
+    int fd;
+    string in;               // bytes read but not yet dispatched
+    // Output the kernel has not accepted yet, in order. Both containers keep
+    // their capacity between responses, so steady-state queuing is free.
+    string out_buf;
+    vector<OutputSegment> out;
+    size_t out_head;         // first unsent segment
+    size_t out_bytes;        // total unsent bytes
+    HttpRequest request;     // parser state for the request at the front of 'in'
+    bool close_after_write;
+    bool keep_alive;         // current request allows the connection to persist
+    bool response_started;   // the handler has written part of its response
+    bool closing;            // closed while a handler still refers to the fd
+    HandlerTask *task;       // handler answering the current request, if suspended
+    ConnPhase phase;
+    Timer timer;             // deadline of the current phase
+    UringSend *send;         // io_uring only: output handed to the kernel
+    int uring_ops;           // io_uring only: requests in flight for this connection
+    uint64_t request_start;  // metrics_clock() when the current request was dispatched
+    int status;              // of the current response, once it has started
+    uint64_t response_bytes; // queued for the current response so far
+    AccessLogEntry log;      // the current request, while access logging
+    WebSocket *ws;           // set once the connection is upgraded
+    bool flush_queued;       // in EventLoop::flush
+    bool read_paused;        // not reading, though the socket may have input
+    bool recv_stopped;       // io_uring only: ... and no recv is in flight
+    ResponseCacheEntry *cache_entry;  // the current request's handler fills it, or
+    bool cache_waiting;               // ... the request waits for another to
+};
+
+struct EventLoop {
+    int epoll_fd;
+    Uring *ring;             // set when serving with io_uring instead of epoll
+    vector<int> listeners;   // parallel to options.listeners
+    ServerOptions options;
+    time_t now;              // coarse monotonic clock, updated once per wakeup
+    vector<Connection *> connections;  // indexed by fd
+    vector<HandlerTask *> waiters;     // handlers parked on other fds, indexed by fd
+    vector<HandlerTask *> ready;       // handlers that yielded without waiting
+    vector<int> flush;                 // connections written to from outside their own processing
+};
+
+static thread_local EventLoop *loop_ = nullptr;
+// Connection objects, with their buffers, outlive the sockets they served.
+static thread_local SlabPool<Connection> conn_pool_;
+
+// Unix socket listeners, by path. A path can only be bound once and there
+// is no SO_REUSEPORT for them, so every worker accepts from the same socket.
+static mutex unix_listeners_lock_;
+static unordered_map<string, int> unix_listeners_;
+
+static bool is_abstract_socket(const sockaddr_un *address) {
+    return address->sun_path[0] == '\0';
+}
+
+// Removes a socket file nothing accepts on any more, as left behind by a
+// server that did not exit cleanly. Anything else at the path is left for
+// bind() to fail on.
+static void unlink_stale_socket(const sockaddr_un *address, socklen_t len) {
+    struct stat info;
+    if (is_abstract_socket(address) || lstat(address->sun_path, &info) < 0 || !S_ISSOCK(info.st_mode)) {
+        return;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return;
+    }
+    if (connect(probe, (const sockaddr *)address, len) < 0 && errno == ECONNREFUSED) {
+        unlink(address->sun_path);
+    }
+    close(probe);
+}
+
+// Opens a non-blocking listener for config, or returns the one the process
+// already has for a Unix socket path.
+static int open_listener(const ListenerConfig &config, bool reuse_port) {
+    int family = config.address.ss_family;
+    const sockaddr_un *unix_address = (const sockaddr_un *)&config.address;
+    unique_lock<mutex> guard(unix_listeners_lock_, defer_lock);
+    if (family == AF_UNIX) {
+        guard.lock();
+        auto it = unix_listeners_.find(config.name);
+        if (it != unix_listeners_.end()) {
+            return it->second;
+        }
+        unlink_stale_socket(unix_address, config.address_len);
+    }
+
+    int server_socket = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_socket < 0) {
+        perror("Error creating socket");
+        exit(EXIT_FAILURE);
+    }
+
+    int reuse = 1;
+    if (family != AF_UNIX && setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0) {
+        perror("Error setting socket option");
+        exit(EXIT_FAILURE);
+    }
+
+    // Workers each bind their own listener and the kernel spreads connections.
+    if (family != AF_UNIX && reuse_port &&
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) < 0) {
+        perror("Error setting socket option");
+        exit(EXIT_FAILURE);
+    }
+
+    // [::] takes IPv4 clients too unless told otherwise, whatever the
+    // system default (net.ipv6.bindv6only) says.
+    int v6only = config.v6only;
+    if (family == AF_INET6 &&
+        setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+        perror("Error setting socket option");
+        exit(EXIT_FAILURE);
+    }
+
+    if (::bind(server_socket, (const sockaddr *)&config.address, config.address_len) < 0) {
+        fprintf(stderr, "Error binding %s: %s\n", config.name.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (family == AF_UNIX && config.unix_mode >= 0 && !is_abstract_socket(unix_address) &&
+        chmod(unix_address->sun_path, config.unix_mode) < 0) {
+        fprintf(stderr, "Error setting permissions of %s: %s\n", config.name.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(server_socket, config.backlog) < 0) {
+        perror("Error listening on socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (family == AF_UNIX) {
+        unix_listeners_[config.name] = server_socket;
+    }
+    return server_socket;
+}
+
+// Opens every listener the options ask for into loop->listeners.
+static void loop_open_listeners(EventLoop *loop) {
+    for (const ListenerConfig &config : loop->options.listeners) {
+        loop->listeners.push_back(open_listener(config, loop->options.workers != 1));
+    }
+}
+
+static bool loop_is_listener(const EventLoop *loop, int fd) {
+    for (int listener : loop->listeners) {
+        if (listener == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a failed call on a non-blocking socket just has to wait. EAGAIN
+// and EWOULDBLOCK are the same on Linux, but need not be elsewhere.
+static bool would_block(int error) {
+#if EAGAIN == EWOULDBLOCK
+    return error == EAGAIN;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK;
+#endif
+}
+
+// Finds a header in the block [buf, end) and returns a pointer to its value.
+static const char *find_header(const char *buf, const char *end, const char *name, size_t name_len) {
+    const char *line = (const char *)memchr(buf, '\n', end - buf);
+    while (line && line + 1 < end) {
+        line++;
+        if ((size_t)(end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char *value = line + name_len + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            return value;
+        }
+        line = (const char *)memchr(line, '\n', end - line);
+    }
+    return nullptr;
+}
+
+static bool header_has_token(const char *value, const char *end, const char *token) {
+    const char *eol = (const char *)memchr(value, '\r', end - value);
+    size_t len = strlen(token);
+    for (const char *p = value; eol && p + len <= eol; p++) {
+        if (strncasecmp(p, token, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Status code of a response starting with data, 0 if it is not a status line.
+static int response_status(const char *data, size_t len) {
+    if (len < 12 || memcmp(data, "HTTP/1.", 7) != 0 || data[8] != ' ') {
+        return 0;
+    }
+    int status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            return 0;
+        }
+        status = status * 10 + data[i] - '0';
+    }
+    return status;
+}
+
+// Status of the response being written on a socket the reactor does not own
+// (blocking mode), once its first bytes are out; callers reset it to 0.
+static thread_local int unowned_status_ = 0;
+
+// A response can share its connection only if the client can tell where it
+// ends, so anything without a Content-Length or chunked encoding (or asking
+// to close) closes. 204 and 304 responses never have a body, and after a
+// 101 the connection speaks another protocol.
+static bool response_allows_keep_alive(const char *data, size_t len) {
+    const char *end = (const char *)memmem(data, len, "\r\n\r\n", 4);
+    if (!end) {
+        return false;
+    }
+    end += 2;
+    const char *connection = find_header(data, end, "Connection", 10);
+    if (connection && header_has_token(connection, end, "close")) {
+        return false;
+    }
+    int status = response_status(data, len);
+    if (status == 101 || status == 204 || status == 304) {
+        return true;
+    }
+    if (find_header(data, end, "Content-Length", 14)) {
+        return true;
+    }
+    const char *encoding = find_header(data, end, "Transfer-Encoding", 17);
+    return encoding && header_has_token(encoding, end, "chunked");
+}
+
+// Writes everything or fails; used for sockets the reactor does not own.
+static bool send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        metrics_add(metrics_local()->bytes_sent, n);
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// sendmsg() until every iovec is out, resuming after short writes. A
+// non-blocking socket that fills up is waited on with poll().
+static bool sendv_all(int fd, iovec *iov, int count) {
+    while (count > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count < IOV_MAX ? count : IOV_MAX;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // On a blocking socket this is SO_SNDTIMEO expiring.
+            if (would_block(errno) && (fcntl(fd, F_GETFL) & O_NONBLOCK)) {
+                pollfd pfd{fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return false;
+        }
+        metrics_add(metrics_local()->bytes_sent, n);
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static bool uring_flush(Connection *conn);
+static void uring_release(Connection *conn);
+static void uring_send_reset(UringSend *send);
+static void uring_pause_recv(Connection *conn);
+static void uring_resume_recv(Connection *conn);
+static void websocket_process(Connection *conn);
+static void websocket_closed(Connection *conn);
+static void response_cache_capture(Connection *conn, const char *data, size_t len);
+static void response_cache_done(Connection *conn);
+static void response_cache_abandon(Connection *conn);
+
+static Connection *conn_lookup(int fd) {
+    if (!loop_ || fd < 0 || (size_t)fd >= loop_->connections.size()) {
+        return nullptr;
+    }
+    return loop_->connections[fd];
+}
+
+// Puts a connection that is done with its socket back in the pool.
+static void conn_release(Connection *conn) {
+    if (conn->in.capacity() > CONN_KEEP_BUFFER) {
+        string().swap(conn->in);
+    }
+    if (conn->out_buf.capacity() > CONN_KEEP_BUFFER) {
+        string().swap(conn->out_buf);
+    }
+    conn->out.clear();  // drops file and shared buffer references
+    if (conn->send) {
+        uring_send_reset(conn->send);
+    }
+    pool_put(&conn_pool_, conn);
+}
+
+static void conn_close(Connection *conn) {
+    timer_cancel(&conn->timer);
+    if (conn->task) {
+        // The handler still holds this socket number; keep the fd open until
+        // it returns so the number cannot be reused by another client.
+        if (!conn->closing) {
+            conn->closing = true;
+            if (!loop_->ring) {
+                epoll_ctl(loop_->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+            }
+            shutdown(conn->fd, SHUT_RDWR);
+            if (conn->task->wait_drain) {
+                conn->task->wait_drain = false;
+                loop_->ready.push_back(conn->task);
+            }
+        }
+        return;
+    }
+    loop_->connections[conn->fd] = nullptr;
+    metrics_add(metrics_local()->connections_closed);
+    if (conn->ws) {
+        websocket_closed(conn);
+    }
+    if (conn->cache_entry) {
+        response_cache_abandon(conn);
+    }
+    if (loop_->ring) {
+        uring_release(conn);  // freed once the kernel is done with it
+        return;
+    }
+    close(conn->fd);  // also removes it from the epoll set
+    conn_release(conn);
+}
+
+static bool sendfile_all(int fd, int file_fd, size_t offset, size_t len) {
+    off_t position = offset;
+    while (len > 0) {
+        ssize_t n = sendfile(fd, file_fd, &position, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        metrics_add(metrics_local()->bytes_sent, n);
+        len -= n;
+    }
+    return true;
+}
+
+// Marks n bytes from segment *head on as sent.
+static void output_consume(vector<OutputSegment> &out, size_t *head, size_t n) {
+    while (n > 0) {
+        OutputSegment *seg = &out[*head];
+        size_t step = n < seg->length ? n : seg->length;
+        seg->offset += step;
+        seg->length -= step;
+        n -= step;
+        if (seg->length == 0) {
+            seg->shared.reset();
+            seg->file.reset();
+            (*head)++;
+        }
+    }
+}
+
+static void conn_consume(Connection *conn, size_t n) {
+    metrics_add(metrics_local()->bytes_sent, n);
+    conn->out_bytes -= n;
+    output_consume(conn->out, &conn->out_head, n);
+}
+
+// Pushes queued output to the kernel: consecutive memory segments go out in
+// one sendmsg(), file segments with sendfile(). Returns false if the socket
+// is dead.
+static bool conn_flush(Connection *conn) {
+    if (loop_->ring) {
+        return uring_flush(conn);
+    }
+    while (conn->out_head < conn->out.size()) {
+        OutputSegment *head = &conn->out[conn->out_head];
+        ssize_t n;
+        if (head->kind == OUTPUT_FILE) {
+            off_t position = head->offset;
+            n = sendfile(conn->fd, head->file->fd, &position, head->length);
+            if (n == 0) {
+                return false;  // file shrank underneath us
+            }
+        } else {
+            iovec iov[SERVER_MAX_IOV];
+            int count = 0;
+            for (size_t i = conn->out_head; i < conn->out.size() && count < SERVER_MAX_IOV; i++) {
+                OutputSegment *seg = &conn->out[i];
+                if (seg->kind == OUTPUT_FILE) {
+                    break;
+                }
+                const char *base = seg->kind == OUTPUT_BYTES ? conn->out_buf.data() : seg->shared->data();
+                iov[count].iov_base = (void *)(base + seg->offset);
+                iov[count].iov_len = seg->length;
+                count++;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block(errno)) {
+                return true;  // EPOLLOUT will bring us back
+            }
+            return false;
+        }
+        conn_consume(conn, n);
+    }
+    conn->out.clear();
+    conn->out_head = 0;
+    conn->out_buf.clear();
+    return true;
+}
+
+static void conn_push(Connection *conn, OutputKind kind, size_t offset, size_t length) {
+    conn->out.push_back(OutputSegment{kind, offset, length, nullptr, nullptr});
+    conn->out_bytes += length;
+    conn->response_bytes += length;
+}
+
+// Entry point for every response byte. On a reactor socket the data is only
+// queued; it is flushed once the current batch of requests has been handled
+// so small writes coalesce and a slow reader never blocks the loop.
+static void conn_write(int fd, const char *data, size_t len) {
+    Connection *conn = conn_lookup(fd);
+    if (!conn) {
+        if (unowned_status_ == 0) {
+            unowned_status_ = response_status(data, len);
+        }
+        send_all(fd, data, len);
+        return;
+    }
+    if (conn->closing) {
+        return;
+    }
+    if (!conn->response_started) {
+        conn->response_started = true;
+        conn->status = response_status(data, len);
+        if (!response_allows_keep_alive(data, len)) {
+            conn->keep_alive = false;
+        }
+    }
+    if (len == 0) {
+        return;
+    }
+    if (conn->cache_entry) {
+        response_cache_capture(conn, data, len);
+    }
+    OutputSegment *tail = conn->out.size() > conn->out_head ? &conn->out.back() : nullptr;
+    if (tail && tail->kind == OUTPUT_BYTES && tail->offset + tail->length == conn->out_buf.size()) {
+        tail->length += len;
+        conn->out_bytes += len;
+        conn->response_bytes += len;
+    } else {
+        conn_push(conn, OUTPUT_BYTES, conn->out_buf.size(), len);
+    }
+    conn->out_buf.append(data, len);
+}
+
+// Drops the part of the output queue that has been sent. conn_flush() only
+// does so once everything is out, which a connection that is always sending
+// may never reach.
+static void conn_compact_output(Connection *conn) {
+    if (loop_->ring || conn->out_head == 0) {
+        return;  // io_uring hands the queue to the kernel and starts a fresh one
+    }
+    size_t sent = conn->out_buf.size();
+    for (size_t i = conn->out_head; i < conn->out.size(); i++) {
+        if (conn->out[i].kind == OUTPUT_BYTES) {
+            sent = conn->out[i].offset;
+            break;
+        }
+    }
+    conn->out.erase(conn->out.begin(), conn->out.begin() + conn->out_head);
+    conn->out_head = 0;
+    conn->out_buf.erase(0, sent);
+    for (OutputSegment &seg : conn->out) {
+        if (seg.kind == OUTPUT_BYTES) {
+            seg.offset -= sent;
+        }
+    }
+}
+
+// Queues several pieces as one response write; they coalesce into a single
+// segment of the connection's output buffer. iov may be modified.
+static void conn_writev(int fd, iovec *iov, int count) {
+    Connection *conn = conn_lookup(fd);
+    if (!conn) {
+        if (unowned_status_ == 0 && count > 0) {
+            unowned_status_ = response_status((const char *)iov[0].iov_base, iov[0].iov_len);
+        }
+        sendv_all(fd, iov, count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        conn_write(fd, (const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+// Queues an immutable buffer without copying it.
+static void conn_write_shared(int fd, const shared_ptr<const string> &data) {
+    Connection *conn = conn_lookup(fd);
+    if (!conn) {
+        send_all(fd, data->data(), data->size());
+        return;
+    }
+    if (data->empty()) {
+        return;
+    }
+    if (conn->cache_entry) {
+        response_cache_capture(conn, nullptr, 0);
+    }
+    conn_push(conn, OUTPUT_SHARED, 0, data->size());
+    conn->out.back().shared = data;
+}
+
+// Queues len bytes of an open file starting at offset, sent with sendfile().
+static void conn_sendfile(int fd, const shared_ptr<FileSnapshot> &file, size_t offset, size_t len) {
+    Connection *conn = conn_lookup(fd);
+    if (!conn) {
+        sendfile_all(fd, file->fd, offset, len);
+        return;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (conn->cache_entry) {
+        response_cache_capture(conn, nullptr, 0);
+    }
+    conn_push(conn, OUTPUT_FILE, offset, len);
+    conn->out.back().file = file;
+}
+
+static void conn_write_error(int fd, int status) {
+    char response[128];
+    int size = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                        status, http_reason(status));
+    conn_write(fd, response, size);
+}
+
+static void conn_process(Connection *conn);
+static void conn_finish(Connection *conn);
+
+// Arms the deadline for what the connection waits on now. Called after every
+// bit of progress, which pushes the deadline back, except while the request
+// head is incomplete: that deadline runs from its first byte, so a client
+// trickling header bytes cannot hold the connection open.
+static void conn_update_deadline(Connection *conn) {
+    const ServerOptions &options = loop_->options;
+    ConnPhase phase;
+    int timeout;
+    if ((conn->task && !conn->task->wait_drain) || conn->cache_waiting) {
+        phase = CONN_HANDLER;
+        timeout = 0;
+    } else if (conn->out_bytes > 0) {
+        phase = CONN_WRITING;
+        timeout = options.idle_timeout;
+    } else if (conn->ws) {
+        phase = CONN_WEBSOCKET;
+        timeout = 0;
+    } else if (conn->request.state >= HTTP_BODY) {
+        phase = CONN_BODY;
+        timeout = options.body_timeout;
+    } else if (!conn->in.empty()) {
+        phase = CONN_HEADERS;
+        timeout = options.header_timeout;
+    } else {
+        phase = CONN_IDLE;
+        timeout = options.idle_timeout;
+    }
+
+    if (timeout <= 0) {
+        timer_cancel(&conn->timer);
+    } else if (phase != CONN_HEADERS || conn->phase != CONN_HEADERS || !timer_pending(&conn->timer)) {
+        timer_schedule(&conn->timer, timeout);
+    }
+    conn->phase = phase;
+}
+
+// A client that stalls mid-request is told so; anything else is just closed.
+static void conn_on_timeout(Timer *timer) {
+    Connection *conn = (Connection *)timer->data;
+    metrics_add(metrics_local()->timeouts);
+    if (conn->phase == CONN_HEADERS || conn->phase == CONN_BODY) {
+        conn->response_started = true;
+        conn_write_error(conn->fd, 408);
+        metrics_response(408, 0);
+        conn->close_after_write = true;
+        conn_finish(conn);
+        return;
+    }
+    conn_close(conn);
+}
+
+// The handler for the current request has returned.
+static void conn_request_done(Connection *conn) {
+    if (conn->cache_entry) {
+        response_cache_done(conn);
+    }
+    metrics_response(conn->status, conn->request_start);
+    if (access_log_enabled()) {
+        access_log_end(&conn->log, conn->status, conn->response_bytes, conn->request_start);
+    }
+    if (!conn->keep_alive || !conn->response_started) {
+        conn->close_after_write = true;
+    }
+}
+
+// Whether requests waiting in conn->in cannot be dispatched yet.
+static bool conn_dispatch_held(const Connection *conn) {
+    return conn->task || conn->cache_waiting || conn->close_after_write ||
+           conn->out_bytes >= SERVER_MAX_PENDING_OUTPUT;
+}
+
+// Stops reading from a client whose input piles up behind a held dispatch,
+// as one pipelining requests without reading the responses does, and reads
+// again once either goes down.
+static void conn_throttle_input(Connection *conn) {
+    bool throttled = conn->in.size() >= SERVER_MAX_PENDING_INPUT && conn_dispatch_held(conn);
+    if (throttled && !conn->read_paused) {
+        conn->read_paused = true;
+        if (loop_->ring) {
+            uring_pause_recv(conn);
+        }
+    } else if (!throttled && conn->read_paused) {
+        conn->read_paused = false;
+        if (loop_->ring) {
+            uring_resume_recv(conn);
+            return;
+        }
+        // Modifying an edge-triggered registration reports input that is
+        // already waiting.
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = conn->fd;
+        epoll_ctl(loop_->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+}
+
+// Flushes queued output and keeps serving pipelined requests for as long as
+// the socket accepts data. Closes the connection once it has nothing left.
+static void conn_finish(Connection *conn) {
+    while (true) {
+        if (!conn_flush(conn)) {
+            conn_close(conn);
+            return;
+        }
+        if (conn->task) {
+            // A suspended handler owns the connection until it returns.
+            HandlerTask *task = conn->task;
+            if (task->wait_drain && conn->out_bytes < task->drain_below) {
+                task->wait_drain = false;
+                conn_update_deadline(conn);
+                task_resume(task);
+                return;
+            }
+            break;
+        }
+        if (conn->out_bytes > 0) {
+            break;  // EPOLLOUT resumes us
+        }
+        if (conn->close_after_write) {
+            conn_close(conn);
+            return;
+        }
+        size_t pending = conn->in.size();
+        if (pending == 0) {
+            break;
+        }
+        conn_process(conn);
+        if (conn->in.size() == pending && conn->out_bytes == 0) {
+            break;  // partial request, wait for more bytes
+        }
+    }
+    conn_throttle_input(conn);
+    conn_update_deadline(conn);
+}
+
+// Dispatches every complete request sitting in the input buffer, in order, so
+// pipelined requests that arrive in one read are all answered.
+static void conn_process(Connection *conn) {
+    if (conn->ws) {
+        websocket_process(conn);
+        return;
+    }
+    size_t consumed = 0;
+    while (!conn->close_after_write && !conn->task && !conn->ws && !conn->cache_waiting &&
+           conn->out_bytes < SERVER_MAX_PENDING_OUTPUT && consumed < conn->in.size()) {
+        char *buf = &conn->in[consumed];
+        HttpRequest *request = &conn->request;
+        int result = http_parse_request(request, buf, conn->in.size() - consumed, loop_->options.max_body_size);
+        if (result == HTTP_PARSE_AGAIN) {
+            break;
+        }
+        if (result == HTTP_PARSE_ERROR) {
+            conn->response_started = true;
+            conn_write_error(conn->fd, request->error_status);
+            metrics_response(request->error_status, 0);
+            conn->close_after_write = true;
+            break;
+        }
+
+        conn->keep_alive = loop_->options.keep_alive && request->keep_alive;
+        conn->response_started = false;
+        conn->status = 0;
+        conn->response_bytes = 0;
+        conn->request_start = metrics_clock();
+        if (access_log_enabled()) {
+            access_log_begin(&conn->log, request, buf);
+        }
+        handle_request(conn->fd, request, buf);
+        if (conn->cache_waiting) {
+            // Left unconsumed, to be dispatched again once the identical
+            // request in flight is done
+            http_request_reset(request);
+            break;
+        }
+        consumed += request->pos;
+        http_request_reset(request);
+
+        if (conn->task) {
+            break;  // the handler yielded; later requests wait for it
+        }
+        conn_request_done(conn);
+    }
+    conn->in.erase(0, consumed);
+    if (conn->ws) {
+        websocket_process(conn);  // frames sent right behind the upgrade request
+    }
+}
+
+// Serves what has arrived in conn->in; peer_closed once the client has sent
+// everything it will.
+static void conn_on_input(Connection *conn, bool peer_closed) {
+    conn_process(conn);
+
+    if (peer_closed && conn->out_bytes == 0) {
+        conn_close(conn);
+        return;
+    }
+    if (peer_closed) {
+        conn->close_after_write = true;
+    }
+    conn_finish(conn);
+}
+
+// Reads at most SERVER_MAX_PENDING_INPUT before serving it; conn_finish()
+// reads on if the socket may hold more.
+static void conn_on_readable(Connection *conn) {
+    if (conn->read_paused) {
+        conn_finish(conn);  // only the output side can move
+        return;
+    }
+    char chunk[SERVER_READ_CHUNK];
+    bool peer_closed = false;
+    size_t limit = conn->in.size() + SERVER_MAX_PENDING_INPUT;
+
+    while (true) {
+        if (conn->in.size() >= limit) {
+            conn->read_paused = true;
+            break;
+        }
+        ssize_t n = read(conn->fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            metrics_add(metrics_local()->bytes_received, n);
+            conn->in.append(chunk, n);
+            continue;
+        }
+        if (n == 0) {
+            peer_closed = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!would_block(errno)) {
+            peer_closed = true;
+        }
+        break;
+    }
+    conn_on_input(conn, peer_closed);
+}
+
+static void conn_on_writable(Connection *conn) {
+    conn_finish(conn);
+}
+
+// Has conn flushed at the end of this pass of the loop. For output queued
+// from outside the connection's own processing (another connection's
+// handler, a timer), which nothing else would send.
+static void conn_schedule_flush(Connection *conn) {
+    if (!conn->flush_queued) {
+        conn->flush_queued = true;
+        loop_->flush.push_back(conn->fd);
+    }
+}
+
+static void loop_flush_scheduled(EventLoop *loop) {
+    size_t count = loop->flush.size();
+    for (size_t i = 0; i < count; i++) {
+        Connection *conn = conn_lookup(loop->flush[i]);
+        if (conn && conn->flush_queued) {
+            conn->flush_queued = false;
+            if (!conn->closing) {
+                conn_finish(conn);
+            }
+        }
+    }
+    loop->flush.erase(loop->flush.begin(), loop->flush.begin() + count);
+}
+
+static time_t loop_clock() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static time_t server_now() {
+    return loop_ ? loop_->now : loop_clock();
+}
+
+// Starts tracking a freshly accepted client socket.
+static Connection *conn_open(EventLoop *loop, int client_socket) {
+    int nodelay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if ((size_t)client_socket >= loop->connections.size()) {
+        loop->connections.resize(client_socket * 2 + 1, nullptr);
+    }
+    // Everything but the buffers starts over
+    Connection *conn = pool_get(&conn_pool_);
+    string in = move(conn->in), out_buf = move(conn->out_buf), log_text = move(conn->log.text);
+    vector<OutputSegment> out = move(conn->out);
+    UringSend *send = conn->send;
+    *conn = Connection();
+    conn->in = move(in);
+    conn->in.clear();
+    conn->out_buf = move(out_buf);
+    conn->out_buf.clear();
+    conn->out = move(out);
+    conn->log.text = move(log_text);
+    conn->send = send;
+
+    conn->fd = client_socket;
+    conn->phase = CONN_IDLE;
+    conn->timer.fire = conn_on_timeout;
+    conn->timer.data = conn;
+    http_request_reset(&conn->request);
+    loop->connections[client_socket] = conn;
+    WorkerMetrics *m = metrics_local();
+    metrics_add(m->connections_opened);
+    m->connections_peak.store(conn_pool_.high_water, memory_order_relaxed);
+    m->connection_objects.store(pool_capacity(&conn_pool_), memory_order_relaxed);
+    if (access_log_enabled()) {
+        access_log_peer(&conn->log, client_socket);
+    }
+    conn_update_deadline(conn);
+    return conn;
+}
+
+static void loop_accept(EventLoop *loop, int server_socket) {
+    while (true) {
+        int client_socket = accept4(server_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!would_block(errno)) {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = client_socket;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+            perror("Error registering connection");
+            close(client_socket);
+            continue;
+        }
+        conn_open(loop, client_socket);
+    }
+}
+
+// Edge-triggered epoll reactor: one thread multiplexes every connection, and
+// sockets only cost their buffers while they wait on the network.
+static void serve_epoll(const ServerOptions &options) {
+    EventLoop loop{};
+    loop.options = options;
+    loop.now = loop_clock();
+    loop_open_listeners(&loop);
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    epoll_event event{};
+    for (size_t i = 0; i < loop.listeners.size(); i++) {
+        event.events = EPOLLIN | EPOLLET;
+        // A Unix socket listener is shared by the workers; wake one of them
+        // per connection, not all.
+        if (options.listeners[i].address.ss_family == AF_UNIX) {
+            event.events |= EPOLLEXCLUSIVE;
+        }
+        event.data.fd = loop.listeners[i];
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listeners[i], &event) < 0) {
+            perror("Error registering listener");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Static files are revalidated through inotify when it is available.
+    int inotify_fd = static_files_watch_start();
+    if (inotify_fd >= 0) {
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = inotify_fd;
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event);
+    }
+    int aio_fd = aio_event_fd();
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = aio_fd;
+    epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, aio_fd, &event);
+
+    loop_ = &loop;
+
+    epoll_event events[SERVER_MAX_EVENTS];
+    while (true) {
+        int timeout = loop.ready.empty() && loop.flush.empty() ? timers_next_delay() : 0;
+        int count = epoll_wait(loop.epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+        loop.now = loop_clock();
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (loop_is_listener(&loop, fd)) {
+                loop_accept(&loop, fd);
+                continue;
+            }
+            if (fd == inotify_fd) {
+                static_files_on_inotify();
+                continue;
+            }
+            if (fd == aio_fd) {
+                aio_drain();
+                continue;
+            }
+
+            if ((size_t)fd < loop.waiters.size() && loop.waiters[fd]) {
+                HandlerTask *task = loop.waiters[fd];
+                loop.waiters[fd] = nullptr;
+                epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                task->wait_fd = -1;
+                task_resume(task);
+                continue;
+            }
+
+            Connection *conn = conn_lookup(fd);
+            if (!conn) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                conn_on_readable(conn);
+            } else if (events[i].events & EPOLLOUT) {
+                conn_on_writable(conn);
+            }
+        }
+
+        // Handlers that yielded without waiting on anything run again now;
+        // ones that yield again during this pass wait for the next one.
+        size_t ready = loop.ready.size();
+        for (size_t i = 0; i < ready; i++) {
+            task_resume(loop.ready[i]);
+        }
+        loop.ready.erase(loop.ready.begin(), loop.ready.begin() + ready);
+
+        timers_run();
+        loop_flush_scheduled(&loop);
+    }
+}
+
+static void set_timeout(int fd, int option, int ms) {
+    timeval tv{ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+// The original accept-then-handle loop, kept for debugging: requests are
+// served strictly one at a time and every connection closes after its response.
+// Timers only fire between connections.
+static void serve_blocking(const ServerOptions &options, bool exit_on_error) {
+    // The listeners, then the completions of file operations with callbacks
+    vector<pollfd> fds;
+    for (const ListenerConfig &config : options.listeners) {
+        fds.push_back(pollfd{open_listener(config, options.workers != 1), POLLIN, 0});
+    }
+    int aio_fd = aio_event_fd();
+    fds.push_back(pollfd{aio_fd, POLLIN, 0});
+
+    while (true) {
+        int ready = poll(fds.data(), fds.size(), timers_next_delay());
+        timers_run();
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (const pollfd &listener : fds) {
+            if (!(listener.revents & POLLIN)) {
+                continue;
+            }
+            if (listener.fd == aio_fd) {
+                aio_drain();
+                continue;
+            }
+            // Listeners are non-blocking: another worker may have taken the
+            // connection from a shared one first.
+            int client_socket = accept4(listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (!would_block(errno) && errno != EINTR) {
+                    perror("Error accepting connection");
+                }
+                continue;
+            }
+            metrics_add(metrics_local()->connections_opened);
+            // A client that stops reading cannot block the server forever.
+            if (options.idle_timeout > 0) {
+                set_timeout(client_socket, SO_SNDTIMEO, options.idle_timeout);
+            }
+
+            if (handle_client_request(client_socket, options) != 0 && exit_on_error) {
+                close(client_socket);
+                exit(EXIT_FAILURE);
+            }
+
+            close(client_socket);
+            metrics_add(metrics_local()->connections_closed);
+        }
+    }
+}
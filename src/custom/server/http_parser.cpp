@@ -0,0 +1,452 @@
+// Incremental HTTP/1.x request parser.
+//
+// The parser never copies: every field is a slice (offset + length) relative
+// to the start of the request in the caller's buffer, so the buffer may grow
+// (and move) between calls. Feed it the whole buffer each time more bytes
+// arrive; it resumes from where it stopped. Chunked bodies are decoded in
+// place, so once a request is complete its body is one contiguous slice.
+//
+// Only depends on the C library so the benchmarks can include it directly.
+#include <strings.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEADER_SIZE (64 * 1024)
+#define HTTP_MAX_CHUNK_LINE 1024
+
+enum HttpParseState {
+    HTTP_REQUEST_LINE,
+    HTTP_HEADERS,
+    HTTP_BODY,
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,
+    HTTP_TRAILERS,
+    HTTP_DONE,
+    HTTP_ERROR
+};
+
+enum HttpParseResult {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_AGAIN = 0,
+    HTTP_PARSE_DONE = 1
+};
+
+struct HttpSlice {
+    size_t off;
+    size_t len;
+};
+
+struct HttpHeader {
+    HttpSlice name;
+    HttpSlice value;
+};
+
+struct HttpRequest {
+    HttpParseState state;
+    size_t pos;              // next unparsed byte; the request size once done
+    int error_status;        // HTTP status to answer with when parsing fails
+
+    HttpSlice method;
+    HttpSlice target;        // path plus query string, as sent
+    HttpSlice path;
+    HttpSlice query;         // without the '?', empty if absent
+    int minor_version;
+
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    int header_count;
+    size_t header_size;
+
+    bool chunked;
+    bool keep_alive;
+    bool has_length;         // a Content-Length header was sent
+    size_t content_length;
+    size_t chunk_remaining;
+    HttpSlice body;
+};
+
+static inline std::string_view http_slice(const char *base, HttpSlice slice) {
+    return std::string_view(base + slice.off, slice.len);
+}
+
+static inline void http_request_reset(HttpRequest *r) {
+    r->state = HTTP_REQUEST_LINE;
+    r->pos = 0;
+    r->error_status = 0;
+    r->header_count = 0;
+    r->chunked = false;
+    r->keep_alive = false;
+    r->has_length = false;
+    r->content_length = 0;
+    r->chunk_remaining = 0;
+    r->body = HttpSlice{0, 0};
+    r->query = HttpSlice{0, 0};
+}
+
+static inline bool http_method_is(const HttpRequest *r, const char *base, const char *method) {
+    size_t len = strlen(method);
+    return r->method.len == len && memcmp(base + r->method.off, method, len) == 0;
+}
+
+static inline const HttpHeader *http_find_header(const HttpRequest *r, const char *base, const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < r->header_count; i++) {
+        const HttpHeader *h = &r->headers[i];
+        if (h->name.len == len && strncasecmp(base + h->name.off, name, len) == 0) {
+            return h;
+        }
+    }
+    return nullptr;
+}
+
+static const char *http_reason(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 411: return "Length Required";
+        case 412: return "Precondition Failed";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 416: return "Range Not Satisfiable";
+        case 422: return "Unprocessable Content";
+        case 426: return "Upgrade Required";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Unknown";
+    }
+}
+
+static int http_fail(HttpRequest *r, int status) {
+    r->state = HTTP_ERROR;
+    r->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// True if the comma separated header value contains token (case-insensitive).
+static bool http_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = value + len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+        }
+        const char *item = value;
+        while (value < end && *value != ',') {
+            value++;
+        }
+        const char *item_end = value;
+        while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+            item_end--;
+        }
+        if ((size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int http_parse_request_line(HttpRequest *r, const char *buf, size_t start, size_t len) {
+    const char *line = buf + start;
+    const char *end = line + len;
+
+    const char *sp1 = (const char *)memchr(line, ' ', len);
+    if (!sp1 || sp1 == line) {
+        return http_fail(r, 400);
+    }
+    const char *target = sp1 + 1;
+    const char *sp2 = (const char *)memchr(target, ' ', end - target);
+    if (!sp2 || sp2 == target) {
+        return http_fail(r, 400);
+    }
+    const char *version = sp2 + 1;
+    if (end - version != 8 || memcmp(version, "HTTP/1.", 7) != 0) {
+        return http_fail(r, end - version >= 5 && memcmp(version, "HTTP/", 5) == 0 ? 505 : 400);
+    }
+    if (version[7] != '0' && version[7] != '1') {
+        return http_fail(r, 505);
+    }
+
+    r->method = HttpSlice{start, (size_t)(sp1 - line)};
+    r->target = HttpSlice{(size_t)(target - buf), (size_t)(sp2 - target)};
+    const char *question = (const char *)memchr(target, '?', sp2 - target);
+    if (question) {
+        r->path = HttpSlice{r->target.off, (size_t)(question - target)};
+        r->query = HttpSlice{(size_t)(question + 1 - buf), (size_t)(sp2 - question - 1)};
+    } else {
+        r->path = r->target;
+    }
+    r->minor_version = version[7] - '0';
+    r->keep_alive = r->minor_version == 1;
+    return HTTP_PARSE_AGAIN;
+}
+
+static int http_parse_header_line(HttpRequest *r, const char *buf, size_t start, size_t len) {
+    const char *line = buf + start;
+    if (line[0] == ' ' || line[0] == '\t') {
+        return http_fail(r, 400);  // obsolete line folding
+    }
+    const char *colon = (const char *)memchr(line, ':', len);
+    if (!colon || colon == line) {
+        return http_fail(r, 400);
+    }
+    for (const char *p = line; p < colon; p++) {
+        if (*p == ' ' || *p == '\t') {
+            return http_fail(r, 400);
+        }
+    }
+    if (r->header_count == HTTP_MAX_HEADERS) {
+        return http_fail(r, 431);
+    }
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+
+    HttpHeader *h = &r->headers[r->header_count++];
+    h->name = HttpSlice{start, (size_t)(colon - line)};
+    h->value = HttpSlice{(size_t)(value - buf), (size_t)(end - value)};
+
+    size_t name_len = h->name.len;
+    size_t value_len = h->value.len;
+    if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        if (value_len == 0 || value_len > 18) {
+            return http_fail(r, 400);
+        }
+        size_t length = 0;
+        for (const char *p = value; p < end; p++) {
+            if (*p < '0' || *p > '9') {
+                return http_fail(r, 400);
+            }
+            length = length * 10 + (*p - '0');
+        }
+        if (r->has_length && r->content_length != length) {
+            return http_fail(r, 400);
+        }
+        r->has_length = true;
+        r->content_length = length;
+    } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+        // chunked must be the last coding applied, and only once; codings
+        // before it would have to be undone, which is not supported
+        const char *last = end;
+        while (last > value && last[-1] != ',') {
+            last--;
+        }
+        while (last < end && (*last == ' ' || *last == '\t')) {
+            last++;
+        }
+        if (r->chunked || end - last != 7 || strncasecmp(last, "chunked", 7) != 0) {
+            return http_fail(r, 400);
+        }
+        if (http_has_token(value, last - value, "chunked")) {
+            return http_fail(r, 400);
+        }
+        if (strspn(value, ", \t") < (size_t)(last - value)) {
+            return http_fail(r, 501);
+        }
+        r->chunked = true;
+    } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+        if (http_has_token(value, value_len, "close")) {
+            r->keep_alive = false;
+        } else if (http_has_token(value, value_len, "keep-alive")) {
+            r->keep_alive = true;
+        }
+    }
+    return HTTP_PARSE_AGAIN;
+}
+
+// Decides how the body is framed once the blank line after the headers is in.
+static int http_headers_done(HttpRequest *r, size_t max_body) {
+    r->header_size = r->pos;
+    r->body = HttpSlice{r->pos, 0};
+    if (r->chunked) {
+        if (r->has_length) {
+            return http_fail(r, 400);  // ambiguous framing, a smuggling vector
+        }
+        r->state = HTTP_CHUNK_SIZE;
+    } else if (r->content_length > 0) {
+        if (max_body && r->content_length > max_body) {
+            return http_fail(r, 413);
+        }
+        r->state = HTTP_BODY;
+    } else {
+        r->state = HTTP_DONE;
+    }
+    return HTTP_PARSE_AGAIN;
+}
+
+// Parses as much of buf[0, len) as possible. Returns HTTP_PARSE_DONE when a
+// full request is available (r->pos is then its size in bytes),
+// HTTP_PARSE_AGAIN when more bytes are needed, or HTTP_PARSE_ERROR with
+// r->error_status set. max_body of 0 means no body size limit.
+static int http_parse_request(HttpRequest *r, char *buf, size_t len, size_t max_body) {
+    while (true) {
+        switch (r->state) {
+            case HTTP_REQUEST_LINE:
+            case HTTP_HEADERS:
+            case HTTP_TRAILERS: {
+                const char *nl = (const char *)memchr(buf + r->pos, '\n', len - r->pos);
+                if (!nl) {
+                    size_t from = r->state == HTTP_TRAILERS ? r->pos : 0;
+                    if (len - from > HTTP_MAX_HEADER_SIZE) {
+                        return http_fail(r, 431);
+                    }
+                    return HTTP_PARSE_AGAIN;
+                }
+                size_t line_start = r->pos;
+                size_t line_len = nl - (buf + line_start);
+                if (line_len > 0 && buf[line_start + line_len - 1] == '\r') {
+                    line_len--;
+                }
+                r->pos = nl - buf + 1;
+                if (r->state != HTTP_TRAILERS && r->pos > HTTP_MAX_HEADER_SIZE) {
+                    return http_fail(r, 431);
+                }
+
+                if (r->state == HTTP_REQUEST_LINE) {
+                    if (line_len == 0) {
+                        continue;  // tolerate stray CRLFs between requests
+                    }
+                    if (http_parse_request_line(r, buf, line_start, line_len) < 0) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                    r->state = HTTP_HEADERS;
+                } else if (r->state == HTTP_HEADERS) {
+                    if (line_len == 0) {
+                        if (http_headers_done(r, max_body) < 0) {
+                            return HTTP_PARSE_ERROR;
+                        }
+                    } else if (http_parse_header_line(r, buf, line_start, line_len) < 0) {
+                        return HTTP_PARSE_ERROR;
+                    }
+                } else if (line_len == 0) {
+                    r->state = HTTP_DONE;
+                }
+                break;
+            }
+
+            case HTTP_BODY:
+                if (len - r->pos < r->content_length) {
+                    return HTTP_PARSE_AGAIN;
+                }
+                r->body.len = r->content_length;
+                r->pos += r->content_length;
+                r->state = HTTP_DONE;
+                break;
+
+            case HTTP_CHUNK_SIZE: {
+                const char *nl = (const char *)memchr(buf + r->pos, '\n', len - r->pos);
+                if (!nl) {
+                    if (len - r->pos > HTTP_MAX_CHUNK_LINE) {
+                        return http_fail(r, 400);
+                    }
+                    return HTTP_PARSE_AGAIN;
+                }
+                size_t size = 0;
+                const char *p = buf + r->pos;
+                int digits = 0;
+                for (; p < nl; p++, digits++) {
+                    int v;
+                    if (*p >= '0' && *p <= '9') {
+                        v = *p - '0';
+                    } else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+                        v = (*p | 0x20) - 'a' + 10;
+                    } else {
+                        break;
+                    }
+                    if (digits == 15) {
+                        return http_fail(r, 413);
+                    }
+                    size = size * 16 + v;
+                }
+                if (digits == 0 || (p < nl && *p != ';' && *p != '\r' && *p != ' ' && *p != '\t')) {
+                    return http_fail(r, 400);
+                }
+                r->pos = nl - buf + 1;
+                if (size == 0) {
+                    r->state = HTTP_TRAILERS;
+                } else {
+                    if (max_body && r->body.len + size > max_body) {
+                        return http_fail(r, 413);
+                    }
+                    r->chunk_remaining = size;
+                    r->state = HTTP_CHUNK_DATA;
+                }
+                break;
+            }
+
+            case HTTP_CHUNK_DATA: {
+                // Slide the chunk payload down over the framing consumed so far
+                // so the decoded body stays contiguous.
+                size_t avail = len - r->pos;
+                if (avail > r->chunk_remaining) {
+                    avail = r->chunk_remaining;
+                }
+                size_t body_end = r->body.off + r->body.len;
+                if (body_end != r->pos) {
+                    memmove(buf + body_end, buf + r->pos, avail);
+                }
+                r->body.len += avail;
+                r->pos += avail;
+                r->chunk_remaining -= avail;
+                if (r->chunk_remaining > 0) {
+                    return HTTP_PARSE_AGAIN;
+                }
+                r->state = HTTP_CHUNK_DATA_END;
+                break;
+            }
+
+            case HTTP_CHUNK_DATA_END:
+                if (len - r->pos < 1 || (buf[r->pos] == '\r' && len - r->pos < 2)) {
+                    return HTTP_PARSE_AGAIN;
+                }
+                if (buf[r->pos] == '\r') {
+                    r->pos++;
+                }
+                if (buf[r->pos] != '\n') {
+                    return http_fail(r, 400);
+                }
+                r->pos++;
+                r->state = HTTP_CHUNK_SIZE;
+                break;
+
+            case HTTP_DONE:
+                return HTTP_PARSE_DONE;
+
+            case HTTP_ERROR:
+                return HTTP_PARSE_ERROR;
+        }
+    }
+}
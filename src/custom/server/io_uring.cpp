@@ -0,0 +1,518 @@
+// io_uring backend for the serving loop, selected with {mode = "io_uring"}.
+//
+// The epoll loop is told a socket is ready and then makes the accept, read or
+// write call itself. Here the kernel does the I/O and only reports results,
+// so one io_uring_enter() per wakeup covers everything:
+//   - a single multishot accept on the listener yields every new client,
+//   - each connection has one multishot recv that takes buffers from a ring
+//     shared by all connections, so idle sockets hold no read buffer,
+//   - queued output goes out as a chain of linked sendmsg requests.
+// File segments still go through sendfile(), which io_uring has no
+// equivalent of. Parsing, handlers and deadlines are shared with the epoll
+// loop. The raw system calls are used, so there is no liburing dependency;
+// when the kernel cannot do all of the above the server falls back to epoll.
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024           // recv buffers shared by all connections, a power of 2
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_LINKS 4           // sendmsg requests chained per flush
+
+// What a completion belongs to, kept in the low bits of its user_data; the
+// rest is the Connection or HandlerTask it is for.
+enum UringOp {
+    URING_ACCEPT,
+    URING_INOTIFY,
+    URING_RECV,
+    URING_SEND,
+    URING_WRITABLE,                  // sendfile() found the socket buffer full
+    URING_WAIT,                      // a handler parked on some other fd
+    URING_AIO,                       // file operations completed (aio.cpp)
+    URING_CANCEL                     // a connection's recv was asked to stop
+};
+#define URING_OP_MASK 7
+
+struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_local_tail;          // SQEs filled in, published on submit
+    io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+    io_uring_buf_ring *buffers;
+    char *buffer_data;
+    unsigned short buffer_tail;
+};
+
+// Output being sent by the kernel. The iovecs point into it, so it must not
+// move until the sends complete; writes meanwhile queue on the connection.
+struct UringSend {
+    string buf;
+    vector<OutputSegment> out;
+    size_t head;
+    int in_flight;                   // linked sendmsg requests not completed yet
+    bool wait_writable;
+    bool failed;
+    msghdr msg[URING_SEND_LINKS];
+    iovec iov[URING_SEND_LINKS][SERVER_MAX_IOV];
+};
+
+static int uring_enter(Uring *ring, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, arg, arg_size);
+}
+
+static unsigned uring_unsubmitted(Uring *ring) {
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Hands every filled SQE to the kernel and, with wait_ms >= 0, waits up to
+// that long for a completion (-1 waits until there is one).
+static void uring_submit(Uring *ring, int wait_ms, bool wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    __kernel_timespec ts{wait_ms / 1000, (wait_ms % 1000) * 1000000LL};
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = wait && wait_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    int result = uring_enter(ring, uring_unsubmitted(ring), wait && wait_ms != 0 ? 1 : 0, flags, &arg, sizeof(arg));
+    if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+        perror("Error entering io_uring");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Makes sure count SQEs can be filled without an implicit submit in between,
+// so a chain of linked requests reaches the kernel in one piece.
+static void uring_reserve(Uring *ring, unsigned count) {
+    while (ring->sq_entries - uring_unsubmitted(ring) < count) {
+        uring_submit(ring, 0, false);
+    }
+}
+
+static io_uring_sqe *uring_sqe(Uring *ring, uint8_t opcode, int fd, uint64_t user_data) {
+    uring_reserve(ring, 1);
+    io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+static uint64_t uring_data(void *owner, UringOp op) {
+    return (uint64_t)(uintptr_t)owner | op;
+}
+
+static void uring_recycle(Uring *ring, unsigned short bid) {
+    // Not ring->buffers->bufs: in C++ the header's flex array member sits
+    // behind an empty struct, one slot off from where the kernel reads it.
+    io_uring_buf *buf = (io_uring_buf *)ring->buffers + (ring->buffer_tail & (URING_BUFFERS - 1));
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffer_data + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buffer_tail++;
+    __atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+static void *uring_map(int fd, size_t size, off_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+// Sets up the rings and the recv buffers. Returns why io_uring cannot be
+// used, or null.
+static const char *uring_open(Uring *ring) {
+    // Each worker thread has its own ring, so the kernel may skip locking
+    // and defer completion work until we ask for events.
+    io_uring_params params{};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        params = io_uring_params{};
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        // SINGLE_ISSUER came with multishot recv in 6.0, which is required.
+        return errno == EINVAL ? "kernel older than 6.0" : strerror(errno);
+    }
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed) {
+        close(ring->fd);
+        return "missing io_uring features";
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    char *rings = (char *)uring_map(ring->fd, sq_size > cq_size ? sq_size : cq_size, IORING_OFF_SQ_RING);
+    ring->sqes = (io_uring_sqe *)uring_map(ring->fd, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+    if (!rings || !ring->sqes) {
+        close(ring->fd);
+        return "cannot map the rings";
+    }
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_local_tail = *ring->sq_tail;
+    unsigned *sq_array = (unsigned *)(rings + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    void *buffers = mmap(nullptr, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *data = mmap(nullptr, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED || data == MAP_FAILED) {
+        close(ring->fd);
+        return "cannot allocate recv buffers";
+    }
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)(uintptr_t)buffers;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        close(ring->fd);
+        return "no provided buffer rings";
+    }
+    ring->buffers = (io_uring_buf_ring *)buffers;
+    ring->buffer_data = (char *)data;
+    ring->buffer_tail = 0;
+    for (unsigned bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_recycle(ring, bid);
+    }
+    return nullptr;
+}
+
+// Accepts on the loop's listener at index, which the completions carry in
+// place of an owner.
+static void uring_accept(Uring *ring, size_t index) {
+    void *owner = (void *)(uintptr_t)(index * (URING_OP_MASK + 1));
+    io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_ACCEPT, loop_->listeners[index], uring_data(owner, URING_ACCEPT));
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void uring_recv(Connection *conn) {
+    io_uring_sqe *sqe = uring_sqe(loop_->ring, IORING_OP_RECV, conn->fd, uring_data(conn, URING_RECV));
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    conn->uring_ops++;
+}
+
+// Ends the multishot recv of a connection whose input is throttled. Input it
+// delivers before the cancellation lands is still kept.
+static void uring_pause_recv(Connection *conn) {
+    io_uring_sqe *sqe = uring_sqe(loop_->ring, IORING_OP_ASYNC_CANCEL, -1, uring_data(conn, URING_CANCEL));
+    sqe->addr = uring_data(conn, URING_RECV);
+    conn->uring_ops++;
+}
+
+// Receives again once the throttle lifts; a recv that has not ended yet is
+// rearmed by uring_on_recv() when it does.
+static void uring_resume_recv(Connection *conn) {
+    if (conn->recv_stopped) {
+        conn->recv_stopped = false;
+        uring_recv(conn);
+    }
+}
+
+static void uring_poll(int fd, uint32_t events, uint64_t user_data, bool multishot) {
+    io_uring_sqe *sqe = uring_sqe(loop_->ring, IORING_OP_POLL_ADD, fd, user_data);
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+}
+
+// Parks a handler task on fd; events are EPOLLIN/EPOLLOUT, which share their
+// values with poll().
+static void uring_wait_fd(HandlerTask *task, int fd, uint32_t events) {
+    uring_poll(fd, events, uring_data(task, URING_WAIT), false);
+}
+
+// Readies the send state of a pooled connection for its next client.
+static void uring_send_reset(UringSend *send) {
+    send->out.clear();
+    send->buf.clear();
+    send->head = 0;
+    send->in_flight = 0;
+    send->wait_writable = false;
+    send->failed = false;
+}
+
+// Counterpart of conn_flush(): starts sending queued output unless a send is
+// already in flight, in which case its completion continues from here.
+static bool uring_flush(Connection *conn) {
+    if (!conn->send) {
+        conn->send = new UringSend();
+    }
+    UringSend *send = conn->send;
+    if (send->in_flight > 0 || send->wait_writable) {
+        return true;
+    }
+
+    while (true) {
+        if (send->head == send->out.size()) {
+            send->out.clear();
+            send->buf.clear();
+            send->head = 0;
+            if (conn->out.empty()) {
+                return true;
+            }
+            // conn->out_head stays 0 in this mode: nothing is sent from there
+            swap(send->out, conn->out);
+            swap(send->buf, conn->out_buf);
+        }
+
+        OutputSegment *seg = &send->out[send->head];
+        if (seg->kind == OUTPUT_FILE) {
+            off_t position = seg->offset;
+            ssize_t n = sendfile(conn->fd, seg->file->fd, &position, seg->length);
+            if (n > 0) {
+                metrics_add(metrics_local()->bytes_sent, n);
+                output_consume(send->out, &send->head, n);
+                conn->out_bytes -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && would_block(errno)) {
+                uring_poll(conn->fd, POLLOUT, uring_data(conn, URING_WRITABLE), false);
+                conn->uring_ops++;
+                send->wait_writable = true;
+                return true;
+            }
+            return false;
+        }
+
+        // Memory segments up to the next file, as linked sendmsg requests.
+        // MSG_WAITALL makes a short send fail the link, so a later request
+        // never runs after an earlier one stopped halfway.
+        int links = 0;
+        size_t i = send->head;
+        while (links < URING_SEND_LINKS && i < send->out.size() && send->out[i].kind != OUTPUT_FILE) {
+            int count = 0;
+            for (; i < send->out.size() && count < SERVER_MAX_IOV && send->out[i].kind != OUTPUT_FILE; i++) {
+                const OutputSegment &s = send->out[i];
+                const char *base = s.kind == OUTPUT_BYTES ? send->buf.data() : s.shared->data();
+                send->iov[links][count++] = iovec{(void *)(base + s.offset), s.length};
+            }
+            send->msg[links] = msghdr{};
+            send->msg[links].msg_iov = send->iov[links];
+            send->msg[links].msg_iovlen = count;
+            links++;
+        }
+        uring_reserve(loop_->ring, links);
+        for (int l = 0; l < links; l++) {
+            io_uring_sqe *sqe = uring_sqe(loop_->ring, IORING_OP_SENDMSG, conn->fd, uring_data(conn, URING_SEND));
+            sqe->addr = (uint64_t)(uintptr_t)&send->msg[l];
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            if (l + 1 < links) {
+                sqe->flags = IOSQE_IO_LINK;
+            }
+        }
+        send->in_flight = links;
+        conn->uring_ops += links;
+        return true;
+    }
+}
+
+// Called by conn_close(): the kernel may still hold requests for conn, and
+// the fd stays open until they finish so its number cannot be reused.
+static void uring_release(Connection *conn) {
+    shutdown(conn->fd, SHUT_RDWR);  // ends whatever is still in flight
+    if (conn->uring_ops == 0) {
+        close(conn->fd);
+        conn_release(conn);
+    }
+}
+
+static bool uring_released(Connection *conn) {
+    return (size_t)conn->fd >= loop_->connections.size() || loop_->connections[conn->fd] != conn;
+}
+
+static void uring_on_recv(Connection *conn, const io_uring_cqe *cqe) {
+    if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        metrics_add(metrics_local()->bytes_received, cqe->res);
+        conn->in.append(loop_->ring->buffer_data + (size_t)bid * URING_BUFFER_SIZE, cqe->res);
+        uring_recycle(loop_->ring, bid);
+    }
+    if (conn->closing) {
+        return;  // shut down; waiting for its handler to return
+    }
+    bool peer_closed = cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED);
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !peer_closed) {
+        if (conn->read_paused) {
+            conn->recv_stopped = true;
+        } else {
+            uring_recv(conn);  // ran out of buffers or the kernel ended it
+        }
+    }
+    if (cqe->res > 0 || peer_closed) {
+        conn_on_input(conn, peer_closed);
+    }
+}
+
+static void uring_on_send(Connection *conn, const io_uring_cqe *cqe) {
+    UringSend *send = conn->send;
+    send->in_flight--;
+    if (cqe->res > 0) {
+        metrics_add(metrics_local()->bytes_sent, cqe->res);
+        output_consume(send->out, &send->head, cqe->res);
+        conn->out_bytes -= cqe->res;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        send->failed = true;
+    }
+    if (send->in_flight > 0 || conn->closing) {
+        return;
+    }
+    if (send->failed) {
+        conn_close(conn);
+        return;
+    }
+    conn_finish(conn);
+}
+
+static void uring_complete(const io_uring_cqe *cqe) {
+    Uring *ring = loop_->ring;
+    void *owner = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (cqe->user_data & URING_OP_MASK) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                uring_recv(conn_open(loop_, cqe->res));
+            } else {
+                fprintf(stderr, "Error accepting connection: %s\n", strerror(-cqe->res));
+            }
+            if (!more) {
+                uring_accept(ring, (uintptr_t)owner / (URING_OP_MASK + 1));
+            }
+            return;
+        case URING_INOTIFY:
+            static_files_on_inotify();
+            if (!more) {
+                uring_poll(static_files_.inotify_fd, POLLIN, URING_INOTIFY, true);
+            }
+            return;
+        case URING_AIO:
+            aio_drain();
+            if (!more) {
+                uring_poll(aio_event_fd(), POLLIN, URING_AIO, true);
+            }
+            return;
+        case URING_WAIT: {
+            HandlerTask *task = (HandlerTask *)owner;
+            task->wait_fd = -1;
+            task_resume(task);
+            return;
+        }
+    }
+
+    Connection *conn = (Connection *)owner;
+    if (!more) {
+        conn->uring_ops--;
+    }
+    if (uring_released(conn)) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_recycle(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (conn->uring_ops == 0) {
+            close(conn->fd);
+            conn_release(conn);
+        }
+        return;
+    }
+
+    switch (cqe->user_data & URING_OP_MASK) {
+        case URING_RECV:
+            uring_on_recv(conn, cqe);
+            break;
+        case URING_SEND:
+            uring_on_send(conn, cqe);
+            break;
+        case URING_WRITABLE:
+            conn->send->wait_writable = false;
+            if (!conn->closing) {
+                conn_finish(conn);
+            }
+            break;
+        case URING_CANCEL:
+            break;
+    }
+}
+
+// Handles every completion posted so far.
+static void uring_reap(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        uring_complete(&cqe);
+        if (head == tail) {
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+static void serve_uring(const ServerOptions &options) {
+    Uring ring{};
+    const char *error = uring_open(&ring);
+    if (error) {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", error);
+        serve_epoll(options);
+        return;
+    }
+
+    EventLoop loop{};
+    loop.options = options;
+    loop.now = loop_clock();
+    loop.epoll_fd = -1;
+    loop.ring = &ring;
+    loop_open_listeners(&loop);
+    loop_ = &loop;
+
+    for (size_t i = 0; i < loop.listeners.size(); i++) {
+        uring_accept(&ring, i);
+    }
+    int inotify_fd = static_files_watch_start();
+    if (inotify_fd >= 0) {
+        uring_poll(inotify_fd, POLLIN, URING_INOTIFY, true);
+    }
+    uring_poll(aio_event_fd(), POLLIN, URING_AIO, true);
+
+    while (true) {
+        uring_submit(&ring, loop.ready.empty() && loop.flush.empty() ? timers_next_delay() : 0, true);
+        loop.now = loop_clock();
+        uring_reap(&ring);
+
+        size_t ready = loop.ready.size();
+        for (size_t i = 0; i < ready; i++) {
+            task_resume(loop.ready[i]);
+        }
+        loop.ready.erase(loop.ready.begin(), loop.ready.begin() + ready);
+
+        timers_run();
+        loop_flush_scheduled(&loop);
+    }
+}
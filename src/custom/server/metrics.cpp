@@ -0,0 +1,225 @@
+// Request, connection and latency counters, summed over every worker on
+// demand for the /metrics route and server.stats().
+//
+// Each serving thread owns one cache-line-aligned block and is its only
+// writer, so recording is a relaxed load and store: no lock, no locked
+// instruction and no allocation on the request path. Readers in any thread
+// add the blocks up. Latencies go into a log-linear histogram with 8
+// sub-buckets per power of two of microseconds, so quantiles read from it
+// are within 12.5%.
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+#define METRICS_MAX_WORKERS 256
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXPONENT 40  // 2^40 us, about 12 days
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+
+struct alignas(64) WorkerMetrics {
+    std::atomic<uint64_t> connections_opened;
+    std::atomic<uint64_t> connections_closed;
+    std::atomic<uint64_t> connections_peak;    // most open at once
+    std::atomic<uint64_t> connection_objects;  // pooled connection objects, in use or not
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> responses[6];  // by status class, [0] for unrecognised
+    std::atomic<uint64_t> timeouts;
+    std::atomic<uint64_t> bytes_received;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> log_dropped;   // access log lines that found the ring full
+    std::atomic<uint64_t> cache_hits;      // answered from the response cache
+    std::atomic<uint64_t> cache_misses;    // ... by a handler whose response may be cached
+    std::atomic<uint64_t> cache_coalesced; // ... after waiting for an identical miss
+    std::atomic<uint64_t> latency_sum;   // us
+    std::atomic<uint64_t> latency[METRICS_BUCKETS];
+};
+
+// A plain copy of the counters, summed over workers.
+struct MetricsTotals {
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t connections_peak;
+    uint64_t connection_objects;
+    uint64_t requests;
+    uint64_t responses[6];
+    uint64_t timeouts;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t log_dropped;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_coalesced;
+    uint64_t latency_sum;
+    uint64_t latency[METRICS_BUCKETS];
+};
+
+static std::atomic<WorkerMetrics *> metrics_workers_[METRICS_MAX_WORKERS];
+static std::atomic<int> metrics_worker_count_{0};
+static thread_local WorkerMetrics *metrics_ = nullptr;
+
+// The calling thread's block, registered on first use. Threads past
+// METRICS_MAX_WORKERS still record, but are left out of the totals.
+static WorkerMetrics *metrics_local() {
+    if (!metrics_) {
+        metrics_ = new WorkerMetrics();
+        int index = metrics_worker_count_.fetch_add(1, std::memory_order_relaxed);
+        if (index < METRICS_MAX_WORKERS) {
+            metrics_workers_[index].store(metrics_, std::memory_order_release);
+        }
+    }
+    return metrics_;
+}
+
+static inline void metrics_add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline uint64_t metrics_clock() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline int metrics_bucket(uint64_t us) {
+    if (us < METRICS_SUB_BUCKETS) {
+        return (int)us;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    if (exponent > METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+    int sub = (us >> (exponent - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return ((exponent - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) | sub;
+}
+
+// Smallest value that lands in bucket.
+static uint64_t metrics_bucket_floor(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t sub = bucket & (METRICS_SUB_BUCKETS - 1);
+    return (METRICS_SUB_BUCKETS + sub) << (exponent - METRICS_SUB_BITS);
+}
+
+// Counts a response with the given status; start is the metrics_clock() time
+// the request was dispatched, or 0 for answers that involve no handler.
+static void metrics_response(int status, uint64_t start) {
+    WorkerMetrics *m = metrics_local();
+    metrics_add(m->requests);
+    metrics_add(m->responses[status >= 100 && status < 600 ? status / 100 : 0]);
+    if (start) {
+        uint64_t elapsed = metrics_clock() - start;
+        metrics_add(m->latency_sum, elapsed);
+        metrics_add(m->latency[metrics_bucket(elapsed)]);
+    }
+}
+
+static void metrics_collect(MetricsTotals *totals) {
+    *totals = MetricsTotals{};
+    int count = metrics_worker_count_.load(std::memory_order_relaxed);
+    for (int i = 0; i < count && i < METRICS_MAX_WORKERS; i++) {
+        WorkerMetrics *m = metrics_workers_[i].load(std::memory_order_acquire);
+        if (!m) {
+            continue;  // still being registered
+        }
+        auto get = [](const std::atomic<uint64_t> &counter) { return counter.load(std::memory_order_relaxed); };
+        totals->connections_opened += get(m->connections_opened);
+        totals->connections_closed += get(m->connections_closed);
+        totals->connections_peak += get(m->connections_peak);
+        totals->connection_objects += get(m->connection_objects);
+        totals->requests += get(m->requests);
+        for (int c = 0; c < 6; c++) {
+            totals->responses[c] += get(m->responses[c]);
+        }
+        totals->timeouts += get(m->timeouts);
+        totals->bytes_received += get(m->bytes_received);
+        totals->bytes_sent += get(m->bytes_sent);
+        totals->log_dropped += get(m->log_dropped);
+        totals->cache_hits += get(m->cache_hits);
+        totals->cache_misses += get(m->cache_misses);
+        totals->cache_coalesced += get(m->cache_coalesced);
+        totals->latency_sum += get(m->latency_sum);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            totals->latency[b] += get(m->latency[b]);
+        }
+    }
+}
+
+// Latency in us below which the given fraction of timed requests finished.
+static uint64_t metrics_quantile(const MetricsTotals *totals, double quantile) {
+    uint64_t count = 0;
+    for (uint64_t n : totals->latency) {
+        count += n;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += totals->latency[b];
+        if (seen >= rank) {
+            return b + 1 < METRICS_BUCKETS ? metrics_bucket_floor(b + 1) : metrics_bucket_floor(b);
+        }
+    }
+    return 0;
+}
+
+// Appends the totals to out in the Prometheus text exposition format.
+static void metrics_format(const MetricsTotals *totals, std::string *out) {
+    char line[256];
+    auto metric = [&](const char *name, const char *help, const char *type, uint64_t value) {
+        out->append(line, snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type,
+                                   name, (unsigned long long)value));
+    };
+    metric("lunar_connections_accepted_total", "Client connections accepted.", "counter", totals->connections_opened);
+    metric("lunar_connections_open", "Client connections currently open.", "gauge",
+            totals->connections_opened - totals->connections_closed);
+    metric("lunar_connections_peak", "Most client connections open at once, summed over workers.", "gauge",
+           totals->connections_peak);
+    metric("lunar_connection_pool_objects", "Connection objects allocated, in use or pooled.", "gauge",
+           totals->connection_objects);
+    metric("lunar_requests_total", "Requests answered.", "counter", totals->requests);
+
+    out->append("# HELP lunar_responses_total Responses by status class.\n# TYPE lunar_responses_total counter\n");
+    for (int c = 1; c < 6; c++) {
+        out->append(line, snprintf(line, sizeof(line), "lunar_responses_total{code=\"%dxx\"} %llu\n", c,
+                                   (unsigned long long)totals->responses[c]));
+    }
+    metric("lunar_timeouts_total", "Connections dropped for missing a deadline.", "counter", totals->timeouts);
+    metric("lunar_received_bytes_total", "Bytes read from clients.", "counter", totals->bytes_received);
+    metric("lunar_sent_bytes_total", "Bytes written to clients.", "counter", totals->bytes_sent);
+    metric("lunar_access_log_dropped_total", "Access log lines dropped because the buffer was full.", "counter",
+           totals->log_dropped);
+    metric("lunar_response_cache_hits_total", "Requests answered from the response cache.", "counter",
+           totals->cache_hits);
+    metric("lunar_response_cache_misses_total", "Requests to cached routes that ran the handler.", "counter",
+           totals->cache_misses);
+    metric("lunar_response_cache_coalesced_total", "Cache misses that waited for an identical request in flight.",
+           "counter", totals->cache_coalesced);
+
+    // Cumulative buckets at every power of two from 8 us to about 67 s
+    out->append("# HELP lunar_request_duration_seconds Time from dispatching a request to its handler returning.\n"
+                "# TYPE lunar_request_duration_seconds histogram\n");
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (int exponent = METRICS_SUB_BITS; exponent <= 26; exponent++) {
+        uint64_t bound = 1ull << exponent;
+        for (; bucket < METRICS_BUCKETS && metrics_bucket_floor(bucket) < bound; bucket++) {
+            cumulative += totals->latency[bucket];
+        }
+        out->append(line, snprintf(line, sizeof(line), "lunar_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                                   bound / 1e6, (unsigned long long)cumulative));
+    }
+    for (; bucket < METRICS_BUCKETS; bucket++) {
+        cumulative += totals->latency[bucket];
+    }
+    out->append(line, snprintf(line, sizeof(line),
+                               "lunar_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                               "lunar_request_duration_seconds_sum %g\n"
+                               "lunar_request_duration_seconds_count %llu\n",
+                               (unsigned long long)cumulative, totals->latency_sum / 1e6,
+                               (unsigned long long)cumulative));
+}
@@ -0,0 +1,52 @@
+// Slab pools for objects that come and go with connections.
+//
+// Objects are allocated a slab at a time, handed out from a free list and
+// put back instead of freed, so whatever buffers they own keep their
+// capacity for the next user: once a worker has seen its peak number of
+// connections, accepting and serving more allocates nothing. Pools are per
+// thread and only grow; the high-water mark is the most objects ever out
+// at once, which is also what the pool holds.
+#include <cstddef>
+#include <vector>
+
+#define POOL_SLAB_OBJECTS 64
+
+template <typename T>
+struct SlabPool {
+    std::vector<T *> free;   // most recently returned last, so reuse is cache-warm
+    std::vector<T *> slabs;  // arrays of POOL_SLAB_OBJECTS
+    size_t live;             // handed out now
+    size_t high_water;       // most ever handed out at once
+};
+
+// An object from pool, default-constructed when its slab was made and in
+// whatever state its last user put it back.
+template <typename T>
+static T *pool_get(SlabPool<T> *pool) {
+    if (pool->free.empty()) {
+        T *slab = new T[POOL_SLAB_OBJECTS]();
+        pool->slabs.push_back(slab);
+        pool->free.reserve(pool->slabs.size() * POOL_SLAB_OBJECTS);
+        for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+            pool->free.push_back(&slab[i]);
+        }
+    }
+    T *object = pool->free.back();
+    pool->free.pop_back();
+    if (++pool->live > pool->high_water) {
+        pool->high_water = pool->live;
+    }
+    return object;
+}
+
+template <typename T>
+static void pool_put(SlabPool<T> *pool, T *object) {
+    pool->live--;
+    pool->free.push_back(object);
+}
+
+// Objects the pool holds, in use or not.
+template <typename T>
+static size_t pool_capacity(const SlabPool<T> *pool) {
+    return pool->slabs.size() * POOL_SLAB_OBJECTS;
+}
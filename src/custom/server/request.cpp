@@ -0,0 +1,310 @@
+// Request objects for route handlers.
+//
+//   req.method, req.path, req.query, req.target   strings
+//   req.body                                       the (de-chunked) body
+//   req.headers, req.cookies, req.params           tables, names lowercased
+//   req:header(name), req:cookie(name)             single lookups, no table
+//
+// Nothing is converted until it is read: fields are slices of the request as
+// the parser left it in the connection buffer. Tables and the body are built
+// on first access and then cached in the userdata's uservalue.
+//
+// The connection buffer is only stable until the handler first suspends, so
+// a handler that yields gets a private copy of the request at that point.
+// Once the handler returns, anything not read yet is gone.
+
+#include <cctype>
+
+#define SERVER_REQUEST "server.request"
+
+// What a request object points at once it owns its bytes.
+struct RequestCopy {
+    string raw;
+    HttpRequest http;
+    RouteMatch match;
+};
+
+struct RequestObject {
+    const char *base;            // raw request bytes, null once the handler returned
+    const HttpRequest *http;
+    const RouteMatch *match;
+    RequestCopy *copy;           // set once detached from the connection buffer
+    int socket;
+};
+
+static RequestObject *request_new(luna_State *L, const HttpRequest *http, const char *base, const RouteMatch *match,
+                                  int client_socket) {
+    RequestObject *req = (RequestObject *)luna_newuserdatauv(L, sizeof(RequestObject), 1);
+    req->base = base;
+    req->http = http;
+    req->match = match;
+    req->copy = nullptr;
+    req->socket = client_socket;
+    lunaL_setmetatable(L, SERVER_REQUEST);
+    return req;
+}
+
+// Copies what the request points at, so it outlives the connection buffer
+// and parser state it was created over.
+static void request_detach(RequestObject *req) {
+    if (req->copy || !req->base) {
+        return;
+    }
+    RequestCopy *copy = new RequestCopy{string(req->base, req->http->pos), *req->http, *req->match};
+    for (int i = 0; i < copy->match.param_count; i++) {
+        string_view &value = copy->match.params[i].value;
+        value = string_view(copy->raw.data() + (value.data() - req->base), value.size());
+    }
+    req->copy = copy;
+    req->base = copy->raw.data();
+    req->http = &copy->http;
+    req->match = &copy->match;
+}
+
+// Called when the handler returns: the object may outlive it, but not the
+// bytes it points at.
+static void request_expire(RequestObject *req) {
+    req->base = nullptr;
+    delete req->copy;
+    req->copy = nullptr;
+}
+
+static RequestObject *check_request(luna_State *L) {
+    RequestObject *req = (RequestObject *)lunaL_checkudata(L, 1, SERVER_REQUEST);
+    if (!req->base) {
+        lunaL_error(L, "request used after its handler returned");
+    }
+    return req;
+}
+
+static void request_push_slice(luna_State *L, const RequestObject *req, HttpSlice slice) {
+    luna_pushlstring(L, req->base + slice.off, slice.len);
+}
+
+static void request_push_lower(luna_State *L, const char *s, size_t len) {
+    lunaL_Buffer b;
+    char *p = lunaL_buffinitsize(L, &b, len);
+    for (size_t i = 0; i < len; i++) {
+        p[i] = tolower((unsigned char)s[i]);
+    }
+    lunaL_pushresultsize(&b, len);
+}
+
+// Calls f(name, name_len, value, value_len) for each "name=value" pair of a
+// Cookie header; stops early when f returns true.
+template <typename F>
+static bool request_each_cookie(const char *s, size_t len, F f) {
+    const char *end = s + len;
+    while (s < end) {
+        while (s < end && (*s == ' ' || *s == ';')) {
+            s++;
+        }
+        const char *pair = s;
+        while (s < end && *s != ';') {
+            s++;
+        }
+        const char *eq = (const char *)memchr(pair, '=', s - pair);
+        if (!eq) {
+            continue;
+        }
+        const char *value = eq + 1;
+        size_t value_len = s - value;
+        if (value_len >= 2 && value[0] == '"' && value[value_len - 1] == '"') {
+            value++;
+            value_len -= 2;
+        }
+        if (f(pair, eq - pair, value, value_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void request_push_headers(luna_State *L, const RequestObject *req) {
+    const HttpRequest *http = req->http;
+    luna_createtable(L, 0, http->header_count);
+    for (int i = 0; i < http->header_count; i++) {
+        const HttpHeader *h = &http->headers[i];
+        request_push_lower(L, req->base + h->name.off, h->name.len);
+        luna_pushvalue(L, -1);
+        if (luna_rawget(L, -3) == LUNA_TSTRING) {
+            // Repeated headers are combined as a list, as RFC 9110 allows
+            request_push_slice(L, req, h->value);
+            luna_pushstring(L, ", ");
+            luna_insert(L, -2);
+            luna_concat(L, 3);
+        } else {
+            luna_pop(L, 1);
+            request_push_slice(L, req, h->value);
+        }
+        luna_rawset(L, -3);
+    }
+}
+
+static void request_push_cookies(luna_State *L, const RequestObject *req) {
+    luna_newtable(L);
+    const HttpRequest *http = req->http;
+    for (int i = 0; i < http->header_count; i++) {
+        const HttpHeader *h = &http->headers[i];
+        if (h->name.len != 6 || strncasecmp(req->base + h->name.off, "cookie", 6) != 0) {
+            continue;
+        }
+        request_each_cookie(req->base + h->value.off, h->value.len,
+                            [L](const char *name, size_t name_len, const char *value, size_t value_len) {
+                                luna_pushlstring(L, name, name_len);
+                                luna_pushlstring(L, value, value_len);
+                                luna_rawset(L, -3);
+                                return false;
+                            });
+    }
+}
+
+static void request_push_params(luna_State *L, const RequestObject *req) {
+    const RouteMatch *match = req->match;
+    luna_createtable(L, 0, match->param_count);
+    for (int i = 0; i < match->param_count; i++) {
+        const RouteParam &param = match->params[i];
+        luna_pushlstring(L, param.name.data(), param.name.size());
+        luna_pushlstring(L, param.value.data(), param.value.size());
+        luna_rawset(L, -3);
+    }
+}
+
+// req:header(name) -> value or nil
+static int request_header(luna_State *L) {
+    RequestObject *req = check_request(L);
+    const HttpHeader *h = http_find_header(req->http, req->base, lunaL_checkstring(L, 2));
+    if (h) {
+        request_push_slice(L, req, h->value);
+    } else {
+        luna_pushnil(L);
+    }
+    return 1;
+}
+
+// req:cookie(name) -> value or nil
+static int request_cookie(luna_State *L) {
+    RequestObject *req = check_request(L);
+    size_t len;
+    const char *wanted = lunaL_checklstring(L, 2, &len);
+    const HttpRequest *http = req->http;
+    for (int i = 0; i < http->header_count; i++) {
+        const HttpHeader *h = &http->headers[i];
+        if (h->name.len != 6 || strncasecmp(req->base + h->name.off, "cookie", 6) != 0) {
+            continue;
+        }
+        bool found = request_each_cookie(req->base + h->value.off, h->value.len,
+                                         [L, wanted, len](const char *name, size_t name_len, const char *value,
+                                                          size_t value_len) {
+                                             if (name_len != len || memcmp(name, wanted, len) != 0) {
+                                                 return false;
+                                             }
+                                             luna_pushlstring(L, value, value_len);
+                                             return true;
+                                         });
+        if (found) {
+            return 1;
+        }
+    }
+    luna_pushnil(L);
+    return 1;
+}
+
+// Fields that are tables (or may be large) are built once and cached.
+static int request_cached(luna_State *L, RequestObject *req, const char *key, void (*build)(luna_State *, const RequestObject *)) {
+    if (luna_getiuservalue(L, 1, 1) != LUNA_TTABLE) {
+        luna_pop(L, 1);
+        luna_createtable(L, 0, 4);
+        luna_pushvalue(L, -1);
+        luna_setiuservalue(L, 1, 1);
+    }
+    if (luna_getfield(L, -1, key) != LUNA_TNIL) {
+        return 1;
+    }
+    luna_pop(L, 1);
+    build(L, req);
+    luna_pushvalue(L, -1);
+    luna_setfield(L, -3, key);
+    return 1;
+}
+
+static void request_push_body(luna_State *L, const RequestObject *req) {
+    request_push_slice(L, req, req->http->body);
+}
+
+static int request_index(luna_State *L) {
+    RequestObject *req = (RequestObject *)lunaL_checkudata(L, 1, SERVER_REQUEST);
+    const char *key = lunaL_checkstring(L, 2);
+
+    if (strcmp(key, "header") == 0) {
+        luna_pushcfunction(L, request_header);
+        return 1;
+    }
+    if (strcmp(key, "cookie") == 0) {
+        luna_pushcfunction(L, request_cookie);
+        return 1;
+    }
+    if (strcmp(key, "socket") == 0) {
+        luna_pushinteger(L, req->socket);
+        return 1;
+    }
+
+    // Whatever was cached stays readable after the handler returned.
+    if (!req->base) {
+        if (luna_getiuservalue(L, 1, 1) == LUNA_TTABLE && luna_getfield(L, -1, key) != LUNA_TNIL) {
+            return 1;
+        }
+        check_request(L);
+    }
+
+    const HttpRequest *http = req->http;
+    if (strcmp(key, "method") == 0) {
+        request_push_slice(L, req, http->method);
+    } else if (strcmp(key, "path") == 0) {
+        request_push_slice(L, req, http->path);
+    } else if (strcmp(key, "query") == 0) {
+        request_push_slice(L, req, http->query);
+    } else if (strcmp(key, "target") == 0) {
+        request_push_slice(L, req, http->target);
+    } else if (strcmp(key, "body") == 0) {
+        return request_cached(L, req, key, request_push_body);
+    } else if (strcmp(key, "headers") == 0) {
+        return request_cached(L, req, key, request_push_headers);
+    } else if (strcmp(key, "cookies") == 0) {
+        return request_cached(L, req, key, request_push_cookies);
+    } else if (strcmp(key, "params") == 0) {
+        return request_cached(L, req, key, request_push_params);
+    } else {
+        luna_pushnil(L);
+    }
+    return 1;
+}
+
+static int request_gc(luna_State *L) {
+    RequestObject *req = (RequestObject *)lunaL_checkudata(L, 1, SERVER_REQUEST);
+    delete req->copy;
+    req->copy = nullptr;
+    return 0;
+}
+
+static int request_tostring(luna_State *L) {
+    RequestObject *req = (RequestObject *)lunaL_checkudata(L, 1, SERVER_REQUEST);
+    if (!req->base) {
+        luna_pushstring(L, "request (expired)");
+        return 1;
+    }
+    luna_pushfstring(L, "request (%s)", string(http_slice(req->base, req->http->target)).c_str());
+    return 1;
+}
+
+static void request_open(luna_State *L) {
+    if (lunaL_newmetatable(L, SERVER_REQUEST)) {
+        luna_pushcfunction(L, request_index);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, request_gc);
+        luna_setfield(L, -2, "__gc");
+        luna_pushcfunction(L, request_tostring);
+        luna_setfield(L, -2, "__tostring");
+    }
+    luna_pop(L, 1);
+}
@@ -0,0 +1,347 @@
+// Response objects for Lua handlers:
+//
+//   local res = server.response(socket)   -- route handlers are passed one
+//   res:status(201):header("Content-Type", "application/json")
+//   res:send(part1, part2)
+//
+// send() formats the status line and headers (adding Content-Length) and
+// queues them with the body pieces as one write, so building a response costs
+// no concatenation. Header lines are formatted straight into the userdata
+// while they fit.
+//
+// A body of unknown size is streamed instead:
+//
+//   res:write(chunk)   -- sends the head on first use, then each call's pieces
+//   res:finish()       -- ends the body, as does send(...) after write()
+//
+// Streams use chunked encoding, or are sent as they are with the connection
+// closing after them for HTTP/1.0 clients. An explicit Content-Length header
+// turns chunking off. write() parks the handler while more than a little
+// output is waiting for the client, so generating a large body never holds
+// more than that in memory. A stream the handler leaves open is finished
+// when it returns.
+
+#define SERVER_RESPONSE "server.response"
+
+#define RESPONSE_INLINE_HEADERS 256
+
+struct Response {
+    int socket;
+    int status;
+    int header_count;        // headers stored in the uservalue table
+    bool has_length;         // Content-Length was set explicitly
+    bool chunked_ok;         // the client understands chunked encoding
+    bool head;               // answering HEAD: headers as for GET, no body
+    bool streaming;          // the head went out with write()
+    bool chunked;            // ... and the body is chunked
+    bool sent;
+    size_t headers_len;
+    char headers[RESPONSE_INLINE_HEADERS];  // "name: value\r\n" lines
+};
+
+static thread_local string response_head_;
+static thread_local vector<iovec> response_iov_;
+
+static Response *check_response(luna_State *L) {
+    Response *res = (Response *)lunaL_checkudata(L, 1, SERVER_RESPONSE);
+    if (res->sent) {
+        lunaL_error(L, "response already sent");
+    }
+    return res;
+}
+
+// Appends the string at stack index to the uservalue table, creating it on
+// first use.
+static void response_append(luna_State *L, int index, int position) {
+    if (luna_getiuservalue(L, 1, 1) != LUNA_TTABLE) {
+        luna_pop(L, 1);
+        luna_createtable(L, 4, 0);
+        luna_pushvalue(L, -1);
+        luna_setiuservalue(L, 1, 1);
+    }
+    luna_pushvalue(L, index);
+    luna_rawseti(L, -2, position);
+    luna_pop(L, 1);
+}
+
+// res:status(code) -> res
+static int response_set_status(luna_State *L) {
+    Response *res = check_response(L);
+    int status = lunaL_checkinteger(L, 2);
+    lunaL_argcheck(L, status >= 100 && status <= 999, 2, "invalid HTTP status");
+    res->status = status;
+    luna_settop(L, 1);
+    return 1;
+}
+
+// Adds the header whose name and value are at the given stack indices.
+static void response_add_header(luna_State *L, Response *res, int name_index, int value_index) {
+    name_index = luna_absindex(L, name_index);
+    value_index = luna_absindex(L, value_index);
+    size_t name_len, value_len;
+    const char *name = lunaL_checklstring(L, name_index, &name_len);
+    const char *value = lunaL_checklstring(L, value_index, &value_len);
+    if (name_len == 0 || strcspn(name, ":\r\n") != name_len) {
+        lunaL_error(L, "invalid header name '%s'", name);
+    }
+    if (strcspn(value, "\r\n") != value_len) {
+        lunaL_error(L, "value of header '%s' contains a line break", name);
+    }
+
+    if (strcasecmp(name, "Content-Length") == 0) {
+        res->has_length = true;
+    }
+    size_t line_len = name_len + value_len + 4;
+    if (res->header_count == 0 && res->headers_len + line_len <= RESPONSE_INLINE_HEADERS) {
+        char *line = res->headers + res->headers_len;
+        memcpy(line, name, name_len);
+        memcpy(line + name_len, ": ", 2);
+        memcpy(line + name_len + 2, value, value_len);
+        memcpy(line + name_len + 2 + value_len, "\r\n", 2);
+        res->headers_len += line_len;
+    } else {
+        response_append(L, name_index, ++res->header_count * 2 - 1);
+        response_append(L, value_index, res->header_count * 2);
+    }
+}
+
+// res:header(name, value) -> res
+static int response_header(luna_State *L) {
+    Response *res = check_response(L);
+    if (res->streaming) {
+        return lunaL_error(L, "headers already sent");
+    }
+    response_add_header(L, res, 2, 3);
+    luna_settop(L, 1);
+    return 1;
+}
+
+// Queues the string arguments from index first on, returning their total size.
+static size_t response_push_args(luna_State *L, int first) {
+    size_t size = 0;
+    int top = luna_gettop(L);
+    for (int i = first; i <= top; i++) {
+        size_t len;
+        const char *piece = luna_tolstring(L, i, &len);
+        if (len > 0) {
+            response_iov_.push_back(iovec{(void *)piece, len});
+            size += len;
+        }
+    }
+    return size;
+}
+
+// Formats the status line and headers into response_head_, ending with
+// extra (a Content-Length or Transfer-Encoding line, or nothing).
+static void response_format_head(luna_State *L, Response *res, const char *extra, size_t extra_len) {
+    string &head = response_head_;
+    char line[64];
+    head.clear();
+    head.append(line, snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", res->status, http_reason(res->status)));
+    head.append(res->headers, res->headers_len);
+    if (res->header_count > 0) {
+        luna_getiuservalue(L, 1, 1);
+        for (int i = 1; i <= res->header_count * 2; i++) {
+            size_t len;
+            luna_rawgeti(L, -1, i);
+            const char *text = luna_tolstring(L, -1, &len);
+            head.append(text, len);
+            head.append(i % 2 ? ": " : "\r\n");
+            luna_pop(L, 1);
+        }
+        luna_pop(L, 1);
+    }
+    head.append(extra, extra_len);
+    head.append("\r\n");
+}
+
+// Queues the arguments from index 2 on as the next part of a streamed body,
+// starting the stream if needed; last also ends it.
+static void response_queue_stream(luna_State *L, Response *res, bool last) {
+    int top = luna_gettop(L);
+    size_t size = 0;
+    for (int i = 2; i <= top; i++) {
+        size_t len;
+        lunaL_checklstring(L, i, &len);
+        size += len;
+    }
+
+    response_iov_.clear();
+    if (!res->streaming) {
+        res->streaming = true;
+        res->chunked = !res->has_length && res->chunked_ok;
+        if (res->chunked) {
+            static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+            response_format_head(L, res, chunked, sizeof(chunked) - 1);
+        } else if (!res->has_length) {
+            static const char close[] = "Connection: close\r\n";
+            response_format_head(L, res, close, sizeof(close) - 1);
+        } else {
+            response_format_head(L, res, "", 0);
+        }
+        response_iov_.push_back(iovec{(void *)response_head_.data(), response_head_.size()});
+    }
+
+    // An empty chunk would end the body.
+    char size_line[24];
+    bool chunk = res->chunked && size > 0 && !res->head;
+    if (chunk) {
+        response_iov_.push_back(iovec{size_line, (size_t)snprintf(size_line, sizeof(size_line), "%zx\r\n", size)});
+    }
+    if (!res->head) {
+        response_push_args(L, 2);
+    }
+    if (chunk) {
+        response_iov_.push_back(iovec{(void *)"\r\n", 2});
+    }
+    if (last) {
+        res->sent = true;
+        if (res->chunked && !res->head) {
+            response_iov_.push_back(iovec{(void *)"0\r\n\r\n", 5});
+        }
+    }
+    if (!response_iov_.empty()) {
+        conn_writev(res->socket, response_iov_.data(), response_iov_.size());
+    }
+}
+
+// res:write(...) sends every argument as the next part of a streamed body.
+static int response_write(luna_State *L) {
+    Response *res = check_response(L);
+    response_queue_stream(L, res, false);
+    return task_throttle(L, res->socket, SERVER_STREAM_HIGH_WATER, SERVER_STREAM_LOW_WATER);
+}
+
+// Finishes the response of a handler that has returned. A stream it left
+// open is ended; if it failed, the body is left unterminated and the
+// connection closed after it instead, so the client cannot mistake the
+// truncated body for a complete one. A handler that answered nothing, having
+// failed or not, gets a 500 rather than an empty reply.
+static void response_end(Response *res, bool failed) {
+    if (res->sent) {
+        return;
+    }
+    res->sent = true;
+    if (!res->streaming) {
+        // It may have answered on the socket itself, with cwrite()
+        Connection *conn = conn_lookup(res->socket);
+        if (conn ? !conn->response_started : unowned_status_ == 0) {
+            conn_write_error(res->socket, 500);
+        }
+        return;
+    }
+    if (!failed && res->head) {
+        return;  // no body went out, so none needs ending
+    }
+    if (!failed && res->chunked) {
+        conn_write(res->socket, "0\r\n\r\n", 5);
+    } else if (Connection *conn = conn_lookup(res->socket)) {
+        conn->keep_alive = false;
+    }
+}
+
+// res:send(...) sends the response with its arguments as the body, or, once
+// write() started streaming, sends them as the last part of the stream.
+static int response_send(luna_State *L) {
+    Response *res = check_response(L);
+    int top = luna_gettop(L);
+    for (int i = 2; i <= top; i++) {
+        lunaL_checklstring(L, i, nullptr);
+    }
+    if (res->streaming) {
+        response_queue_stream(L, res, true);
+        return task_throttle(L, res->socket);
+    }
+
+    // Slot 0 is the head, filled in once the body size is known. Strings
+    // stay referenced from the stack until queued.
+    response_iov_.assign(1, iovec{});
+    size_t body_size = response_push_args(L, 2);
+
+    // Responses that never have a body get no Content-Length either
+    bool bodiless = res->status < 200 || res->status == 204 || res->status == 304;
+    if (bodiless) {
+        response_iov_.resize(1);
+    }
+    char length[48];
+    int length_len = 0;
+    if (!res->has_length && !bodiless) {
+        length_len = snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body_size);
+    }
+    if (res->head) {
+        response_iov_.resize(1);  // the length of the body, but not the body
+    }
+    response_format_head(L, res, length, length_len);
+    response_iov_[0] = iovec{(void *)response_head_.data(), response_head_.size()};
+
+    res->sent = true;
+    conn_writev(res->socket, response_iov_.data(), response_iov_.size());
+    return task_throttle(L, res->socket);
+}
+
+static int response_tostring(luna_State *L) {
+    Response *res = (Response *)lunaL_checkudata(L, 1, SERVER_RESPONSE);
+    luna_pushfstring(L, "response (%d, socket %d%s)", res->status, res->socket, res->sent ? ", sent" : "");
+    return 1;
+}
+
+static Response *response_new(luna_State *L, int client_socket, int status, bool chunked_ok, bool head) {
+    Response *res = (Response *)luna_newuserdatauv(L, sizeof(Response), 1);
+    res->socket = client_socket;
+    res->status = status;
+    res->header_count = 0;
+    res->has_length = false;
+    res->chunked_ok = chunked_ok;
+    res->head = head;
+    res->streaming = false;
+    res->chunked = false;
+    res->sent = false;
+    res->headers_len = 0;
+    lunaL_setmetatable(L, SERVER_RESPONSE);
+    return res;
+}
+
+// server.response(socket [, status [, headers]]) -> res
+static int server_response(luna_State *L) {
+    int client_socket = lunaL_checkinteger(L, 1);
+    int status = lunaL_optinteger(L, 2, 200);
+    lunaL_argcheck(L, status >= 100 && status <= 999, 2, "invalid HTTP status");
+    bool has_headers = !luna_isnoneornil(L, 3);
+    if (has_headers) {
+        lunaL_checktype(L, 3, LUNA_TTABLE);
+    }
+    luna_settop(L, 3);
+    response_new(L, client_socket, status, true, false);
+    if (has_headers) {
+        Response *res = (Response *)luna_touserdata(L, -1);
+        luna_replace(L, 1);  // methods expect the response at index 1
+        luna_pushnil(L);
+        while (luna_next(L, 3) != 0) {
+            luna_pushvalue(L, -2);  // copy the key, so converting it is harmless
+            response_add_header(L, res, -1, -2);
+            luna_pop(L, 2);
+        }
+        luna_settop(L, 1);
+    }
+    return 1;
+}
+
+static const lunaL_Reg response_methods[] = {
+    {"status", response_set_status},
+    {"header", response_header},
+    {"write", response_write},
+    {"send", response_send},
+    {"finish", response_send},
+    {NULL, NULL}
+};
+
+static void response_open(luna_State *L) {
+    if (lunaL_newmetatable(L, SERVER_RESPONSE)) {
+        luna_newtable(L);
+        lunaL_setfuncs(L, response_methods, 0);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, response_tostring);
+        luna_setfield(L, -2, "__tostring");
+    }
+    luna_pop(L, 1);
+}
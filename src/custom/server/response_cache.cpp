@@ -0,0 +1,248 @@
+// Micro-cache for Lua route responses, opted into per route:
+//
+//   server.route("GET", "/price/:item", handler, {cache = {ttl = 2, vary = {"Accept-Language"}}})
+//
+// Responses are keyed by method, target, the listed request headers and a
+// hash of the body. A hit is queued as one shared buffer from C, without
+// entering the interpreter. While a miss is being answered, identical
+// requests wait for it instead of running the handler too (single flight):
+// they are left unparsed in their connections' input and dispatched again
+// once it is done, which then hits. Only complete responses with a
+// Content-Length and a heuristically cacheable status are kept, and none
+// that set cookies or say no-store or private.
+//
+// Every worker has a cache of its own, bounded by response_cache_size and
+// evicted least recently used first; expired entries go when next looked up
+// or evicted.
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+struct ResponseCachePolicy {
+    uint64_t ttl;            // ms
+    vector<string> vary;     // request headers that are part of the key
+};
+
+struct ResponseCacheEntry {
+    const string *key;                   // the map's
+    shared_ptr<const string> response;   // whole response, head included; null while in flight
+    int status;
+    uint64_t ttl;                        // ms
+    uint64_t expires;                    // timer_clock() ms, once stored
+    string filling;                      // while in flight: what the handler has written so far
+    bool spoiled;                        // ... including output that was not captured
+    vector<Connection *> waiters;        // ... and who wants the same
+    list<ResponseCacheEntry *>::iterator lru;
+};
+
+struct ResponseCache {
+    unordered_map<string, ResponseCacheEntry> entries;
+    list<ResponseCacheEntry *> lru;      // stored entries, most recently used first
+    size_t bytes;
+    size_t max_bytes;
+};
+
+static thread_local ResponseCache response_cache_{{}, {}, 0, 16 * 1024 * 1024};
+
+static void response_cache_evict(ResponseCacheEntry *entry) {
+    ResponseCache &cache = response_cache_;
+    cache.bytes -= entry->key->size() + entry->response->size();
+    cache.lru.erase(entry->lru);
+    cache.entries.erase(*entry->key);
+}
+
+// Builds the key of a request for policy into key.
+static void response_cache_key(const ResponseCachePolicy *policy, const HttpRequest *request, const char *base,
+                               string *key) {
+    key->assign(http_slice(base, request->method));
+    key->push_back(' ');
+    key->append(http_slice(base, request->target));
+    for (const string &name : policy->vary) {
+        const HttpHeader *header = http_find_header(request, base, name.c_str());
+        key->push_back('\n');
+        if (header) {
+            key->append(http_slice(base, header->value));
+        }
+    }
+    if (request->body.len > 0) {
+        char digest[48];
+        size_t hash = std::hash<string_view>()(string_view(base + request->body.off, request->body.len));
+        key->append(digest, snprintf(digest, sizeof(digest), "\n%zu:%zx", request->body.len, hash));
+    }
+}
+
+// Answers the request on client_socket from the cache, or has it wait for an
+// identical one in flight; returns false if the handler should run, in which
+// case its response is captured for the cache.
+static bool response_cache_lookup(const ResponseCachePolicy *policy, const HttpRequest *request, const char *base,
+                                  int client_socket) {
+    ResponseCache &cache = response_cache_;
+    Connection *conn = conn_lookup(client_socket);
+    if (!conn || cache.max_bytes == 0) {
+        return false;  // blocking mode is not cached
+    }
+    static thread_local string key;
+    response_cache_key(policy, request, base, &key);
+
+    auto it = cache.entries.find(key);
+    if (it != cache.entries.end()) {
+        ResponseCacheEntry *entry = &it->second;
+        if (!entry->response) {
+            metrics_add(metrics_local()->cache_coalesced);
+            entry->waiters.push_back(conn);
+            conn->cache_entry = entry;
+            conn->cache_waiting = true;
+            return true;
+        }
+        if (timer_clock() < entry->expires) {
+            metrics_add(metrics_local()->cache_hits);
+            cache.lru.splice(cache.lru.begin(), cache.lru, entry->lru);
+            conn->response_started = true;
+            conn->status = entry->status;
+            conn_write_shared(client_socket, entry->response);
+            return true;
+        }
+        response_cache_evict(entry);
+    }
+
+    metrics_add(metrics_local()->cache_misses);
+    it = cache.entries.emplace(key, ResponseCacheEntry{}).first;
+    ResponseCacheEntry *entry = &it->second;
+    entry->key = &it->first;
+    entry->ttl = policy->ttl;
+    conn->cache_entry = entry;
+    conn->cache_waiting = false;
+    return false;
+}
+
+// Records output of a handler filling an entry; null data means output that
+// cannot be captured. A response growing past what the cache may hold is
+// given up on at once, so streaming a large body does not buffer it here.
+static void response_cache_capture(Connection *conn, const char *data, size_t len) {
+    ResponseCacheEntry *entry = conn->cache_entry;
+    if (conn->cache_waiting || entry->spoiled) {
+        return;
+    }
+    if (!data || entry->key->size() + entry->filling.size() + len > response_cache_.max_bytes) {
+        entry->spoiled = true;
+        entry->filling.clear();
+        entry->filling.shrink_to_fit();
+        return;
+    }
+    entry->filling.append(data, len);
+}
+
+// Whether a captured response is complete and may be shared: a cacheable
+// status, a Content-Length that matches, and nothing in the head that is
+// meant for one client only.
+static bool response_cache_storable(const string &response, int status) {
+    if (status != 200 && status != 203 && status != 204 && status != 301 && status != 404 && status != 410) {
+        return false;
+    }
+    size_t head_end = response.find("\r\n\r\n");
+    if (head_end == string::npos) {
+        return false;
+    }
+    const char *data = response.data();
+    const char *end = data + head_end + 2;
+    head_end += 4;
+    const char *cache_control = find_header(data, end, "Cache-Control", 13);
+    const char *connection = find_header(data, end, "Connection", 10);
+    if (find_header(data, end, "Set-Cookie", 10) || find_header(data, end, "Transfer-Encoding", 17) ||
+        (cache_control && (header_has_token(cache_control, end, "no-store") ||
+                           header_has_token(cache_control, end, "private"))) ||
+        (connection && header_has_token(connection, end, "close"))) {
+        return false;
+    }
+    const char *length = find_header(data, end, "Content-Length", 14);
+    if (!length) {
+        return status == 204 && response.size() == head_end;
+    }
+    return strtoull(length, nullptr, 10) == response.size() - head_end;
+}
+
+// Ends the flight of the entry conn was filling: has every waiter dispatch
+// its request again, which now hits or (if nothing was stored) runs the
+// handler itself.
+static void response_cache_land(Connection *conn, bool store) {
+    ResponseCache &cache = response_cache_;
+    ResponseCacheEntry *entry = conn->cache_entry;
+    conn->cache_entry = nullptr;
+    for (Connection *waiter : entry->waiters) {
+        waiter->cache_entry = nullptr;
+        waiter->cache_waiting = false;
+        conn_schedule_flush(waiter);
+    }
+    entry->waiters.clear();
+
+    size_t size = entry->key->size() + entry->filling.size();
+    if (!store || entry->spoiled || size > cache.max_bytes ||
+        !response_cache_storable(entry->filling, conn->status)) {
+        cache.entries.erase(*entry->key);
+        return;
+    }
+    entry->status = conn->status;
+    entry->expires = timer_clock() + entry->ttl;
+    entry->response = make_shared<const string>(move(entry->filling));
+    cache.lru.push_front(entry);
+    entry->lru = cache.lru.begin();
+    cache.bytes += size;
+    while (cache.bytes > cache.max_bytes) {
+        response_cache_evict(cache.lru.back());
+    }
+}
+
+// Called by conn_request_done() for a request that looked up the cache.
+static void response_cache_done(Connection *conn) {
+    if (!conn->cache_waiting) {
+        response_cache_land(conn, true);
+    }
+}
+
+// Called by conn_close() for a connection that was filling or waiting on an
+// entry.
+static void response_cache_abandon(Connection *conn) {
+    if (!conn->cache_waiting) {
+        response_cache_land(conn, false);
+        return;
+    }
+    vector<Connection *> &waiters = conn->cache_entry->waiters;
+    waiters.erase(find(waiters.begin(), waiters.end(), conn));
+    conn->cache_entry = nullptr;
+    conn->cache_waiting = false;
+}
+
+// Reads the cache option of a route handler at index: seconds, or a table
+// {ttl = seconds, vary = {header names}}. Null if the route is not cached.
+static shared_ptr<ResponseCachePolicy> response_cache_policy(luna_State *L, int index) {
+    if (luna_isnoneornil(L, index)) {
+        return nullptr;
+    }
+    lunaL_checktype(L, index, LUNA_TTABLE);
+    if (luna_getfield(L, index, "cache") == LUNA_TNIL) {
+        luna_pop(L, 1);
+        return nullptr;
+    }
+    auto policy = make_shared<ResponseCachePolicy>();
+    luna_Number ttl;
+    if (luna_istable(L, -1)) {
+        luna_getfield(L, -1, "ttl");
+        ttl = lunaL_checknumber(L, -1);
+        luna_pop(L, 1);
+        if (luna_getfield(L, -1, "vary") != LUNA_TNIL) {
+            lunaL_checktype(L, -1, LUNA_TTABLE);
+            for (luna_Integer i = 1; luna_rawgeti(L, -1, i) != LUNA_TNIL; i++) {
+                policy->vary.push_back(lunaL_checkstring(L, -1));
+                luna_pop(L, 1);
+            }
+            luna_pop(L, 1);  // the nil ending the list
+        }
+        luna_pop(L, 1);
+    } else {
+        ttl = lunaL_checknumber(L, -1);
+    }
+    luna_pop(L, 1);
+    lunaL_argcheck(L, ttl > 0 && ttl <= TIMER_MAX_DELAY / 1000, index, "invalid cache ttl");
+    policy->ttl = (uint64_t)(ttl * 1000);
+    return policy;
+}
@@ -0,0 +1,386 @@
+// Compressed radix tree mapping request paths to routes.
+//
+// Patterns are literal paths with two kinds of placeholders, each starting a
+// path segment:
+//   /users/:id         ':name' matches one non-empty segment
+//   /static/*path      '*name' matches the rest of the path, '/' included
+// Literal edges win over parameters, which win over wildcards; the tree
+// backtracks when a more specific branch dead-ends. Every node holds one
+// route per method, plus one for "any method".
+//
+// Routes without placeholders are also indexed by their full path in an
+// open-addressing table, so most requests cost one hash instead of a walk
+// down the tree. Captures are recorded as views into the request path, and
+// neither lookup allocates. Like the parser, this only depends on the
+// standard library so the benchmarks can include it directly.
+#include <strings.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define ROUTER_MAX_PARAMS 16
+
+enum RouterMethod {
+    ROUTER_GET,
+    ROUTER_HEAD,
+    ROUTER_POST,
+    ROUTER_PUT,
+    ROUTER_DELETE,
+    ROUTER_PATCH,
+    ROUTER_OPTIONS,
+    ROUTER_CONNECT,
+    ROUTER_TRACE,
+    ROUTER_ANY,              // "*": routes registered for every method
+    ROUTER_METHODS
+};
+
+static const char *const router_method_names[ROUTER_METHODS] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE", "*"};
+
+// Kept small: lookups of large route sets are bound by cache misses.
+struct RouterNode {
+    std::string prefix;                  // literal bytes this edge consumes, or
+                                         // the name of a ':' or '*' node
+    std::string indices;                 // first byte of each literal child
+    std::vector<RouterNode *> children;  // literal children, parallel to indices
+    RouterNode *param;                   // ':name' child
+    RouterNode *wildcard;                // '*name' child, always a leaf
+    int *routes;                         // route id per method, -1 where none;
+                                         // null if no route ends here
+    unsigned methods;                    // bit per RouterMethod in routes
+};
+
+struct RouteParam {
+    std::string_view name;
+    std::string_view value;
+};
+
+struct RouteMatch {
+    int route;               // route id, -1 if nothing matched
+    bool path_matched;       // some route has this path, maybe for other methods
+    unsigned allowed;        // ... and the RouterMethods it has, as bits
+    int param_count;
+    RouteParam params[ROUTER_MAX_PARAMS];
+};
+
+struct RouterLiteral {
+    std::string path;
+    const RouterNode *node;              // null for an empty slot
+};
+
+struct Router {
+    RouterNode *root;
+    bool dynamic;                        // some route has a ':' or '*' segment
+    std::vector<RouterLiteral> literals; // power-of-two sized, at most half full
+    size_t literal_count;
+};
+
+// Returns the RouterMethod for a request method, -1 if it is not one of them.
+static int router_method(std::string_view method) {
+    for (int m = 0; m < ROUTER_ANY; m++) {
+        if (method == router_method_names[m]) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+// Like router_method(), but also accepts "*" and is case-insensitive, for
+// registration.
+static int router_method_parse(const char *method) {
+    for (int m = 0; m < ROUTER_METHODS; m++) {
+        if (strcasecmp(method, router_method_names[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+static RouterNode *router_node_new(std::string_view prefix) {
+    return new RouterNode{std::string(prefix), {}, {}, nullptr, nullptr, nullptr, 0};
+}
+
+// The route for method at node, falling back to one for any method. HEAD
+// without a route of its own is answered as GET, less the body.
+static inline int router_node_route(const RouterNode *node, int method) {
+    if (!node->routes) {
+        return -1;
+    }
+    if (node->routes[method] >= 0) {
+        return node->routes[method];
+    }
+    if (method == ROUTER_HEAD && node->routes[ROUTER_GET] >= 0) {
+        return node->routes[ROUTER_GET];
+    }
+    return node->routes[ROUTER_ANY];
+}
+
+// Returns the node reached by consuming literal from node, splitting an edge
+// where literal diverges from it.
+static RouterNode *router_insert_literal(RouterNode *node, std::string_view literal) {
+    while (!literal.empty()) {
+        size_t i = node->indices.find(literal[0]);
+        if (i == std::string::npos) {
+            RouterNode *child = router_node_new(literal);
+            node->indices.push_back(literal[0]);
+            node->children.push_back(child);
+            return child;
+        }
+
+        RouterNode *child = node->children[i];
+        size_t common = 0;
+        while (common < child->prefix.size() && common < literal.size() && child->prefix[common] == literal[common]) {
+            common++;
+        }
+        if (common < child->prefix.size()) {
+            RouterNode *split = router_node_new(std::string_view(child->prefix).substr(0, common));
+            child->prefix.erase(0, common);
+            split->indices.push_back(child->prefix[0]);
+            split->children.push_back(child);
+            node->children[i] = split;
+            child = split;
+        }
+        node = child;
+        literal.remove_prefix(common);
+    }
+    return node;
+}
+
+static inline uint64_t router_hash(std::string_view path) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (unsigned char c : path) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static const RouterLiteral *router_literal_find(const Router *router, std::string_view path) {
+    if (router->literals.empty()) {
+        return nullptr;
+    }
+    size_t mask = router->literals.size() - 1;
+    for (size_t i = router_hash(path) & mask;; i = (i + 1) & mask) {
+        const RouterLiteral *slot = &router->literals[i];
+        if (!slot->node || slot->path == path) {
+            return slot->node ? slot : nullptr;
+        }
+    }
+}
+
+static void router_literal_put(std::vector<RouterLiteral> &table, std::string path, const RouterNode *node) {
+    size_t mask = table.size() - 1;
+    size_t i = router_hash(path) & mask;
+    while (table[i].node) {
+        i = (i + 1) & mask;
+    }
+    table[i] = RouterLiteral{std::move(path), node};
+}
+
+static void router_literal_add(Router *router, std::string_view path, const RouterNode *node) {
+    if (router_literal_find(router, path)) {
+        return;  // another method on the same path
+    }
+    if ((router->literal_count + 1) * 2 > router->literals.size()) {
+        std::vector<RouterLiteral> grown(router->literals.empty() ? 64 : router->literals.size() * 2);
+        for (RouterLiteral &slot : router->literals) {
+            if (slot.node) {
+                router_literal_put(grown, std::move(slot.path), slot.node);
+            }
+        }
+        router->literals.swap(grown);
+    }
+    router_literal_put(router->literals, std::string(path), node);
+    router->literal_count++;
+}
+
+// Adds route for method under pattern, replacing any previous one. Returns
+// null on success or a description of what is wrong with the pattern.
+static const char *router_insert(Router *router, int method, const char *pattern, int route) {
+    if (pattern[0] != '/') {
+        return "route must start with '/'";
+    }
+    if (!router->root) {
+        router->root = router_node_new("");
+    }
+
+    RouterNode *node = router->root;
+    std::string_view all(pattern);
+    size_t pos = 0;
+    int params = 0;
+    while (pos < all.size()) {
+        // Literal bytes up to the next segment that starts with ':' or '*'
+        size_t end = pos;
+        while (end < all.size() && !((all[end] == ':' || all[end] == '*') && all[end - 1] == '/')) {
+            end++;
+        }
+        if (end > pos) {
+            node = router_insert_literal(node, all.substr(pos, end - pos));
+            pos = end;
+            continue;
+        }
+
+        bool wildcard = all[pos] == '*';
+        size_t name_end = all.find('/', pos);
+        if (name_end == std::string_view::npos) {
+            name_end = all.size();
+        }
+        std::string_view name = all.substr(pos + 1, name_end - pos - 1);
+        if (name.empty()) {
+            return "route parameter needs a name";
+        }
+        if (wildcard && name_end != all.size()) {
+            return "'*' must be the last segment of a route";
+        }
+        if (++params > ROUTER_MAX_PARAMS) {
+            return "too many route parameters";
+        }
+
+        RouterNode *&child = wildcard ? node->wildcard : node->param;
+        if (!child) {
+            child = router_node_new(name);
+        } else if (child->prefix != name) {
+            return "route parameter conflicts with an existing name at the same position";
+        }
+        node = child;
+        pos = name_end;
+    }
+
+    if (!node->routes) {
+        node->routes = new int[ROUTER_METHODS];
+        for (int m = 0; m < ROUTER_METHODS; m++) {
+            node->routes[m] = -1;
+        }
+    }
+    node->routes[method] = route;
+    node->methods |= 1u << method;
+    if (params == 0) {
+        router_literal_add(router, pattern, node);
+    } else {
+        router->dynamic = true;
+    }
+    return nullptr;
+}
+
+static bool router_match_wildcard(const RouterNode *node, std::string_view path, int method, RouteMatch *match) {
+    const RouterNode *leaf = node->wildcard;
+    if (!leaf || match->param_count >= ROUTER_MAX_PARAMS) {
+        return false;
+    }
+    int route = router_node_route(leaf, method);
+    if (route < 0) {
+        match->path_matched = true;
+        match->allowed |= leaf->methods;
+        return false;
+    }
+    match->params[match->param_count++] = RouteParam{leaf->prefix, path};
+    match->route = route;
+    return true;
+}
+
+static bool router_match_node(const RouterNode *node, std::string_view path, int method, RouteMatch *match) {
+    while (!path.empty()) {
+        const RouterNode *child = nullptr;
+        const char *indices = node->indices.data();
+        for (size_t i = 0, count = node->indices.size(); i < count; i++) {
+            if (indices[i] == path[0]) {
+                child = node->children[i];
+                break;
+            }
+        }
+        if (child) {
+            size_t n = child->prefix.size();
+            if (path.size() < n || memcmp(path.data(), child->prefix.data(), n) != 0) {
+                child = nullptr;
+            }
+        }
+
+        // Nothing to fall back on: keep descending without recursing.
+        if (!node->param && !node->wildcard) {
+            if (!child) {
+                return false;
+            }
+            path.remove_prefix(child->prefix.size());
+            node = child;
+            continue;
+        }
+
+        if (child && router_match_node(child, path.substr(child->prefix.size()), method, match)) {
+            return true;
+        }
+        if (node->param) {
+            size_t end = path.find('/');
+            if (end == std::string_view::npos) {
+                end = path.size();
+            }
+            if (end > 0 && match->param_count < ROUTER_MAX_PARAMS) {
+                RouteParam *param = &match->params[match->param_count++];
+                param->name = node->param->prefix;
+                param->value = path.substr(0, end);
+                if (router_match_node(node->param, path.substr(end), method, match)) {
+                    return true;
+                }
+                match->param_count--;
+            }
+        }
+        return router_match_wildcard(node, path, method, match);
+    }
+
+    int route = router_node_route(node, method);
+    if (route >= 0) {
+        match->route = route;
+        return true;
+    }
+    if (node->routes) {
+        match->path_matched = true;
+        match->allowed |= node->methods;
+    }
+    // An empty rest may still be captured by a wildcard below.
+    return router_match_wildcard(node, path, method, match);
+}
+
+// Writes the methods in a RouteMatch's allowed bits as the value of an Allow
+// header, "GET, POST", into out; returns its length.
+static size_t router_format_allowed(unsigned allowed, char *out, size_t size) {
+    if (allowed & (1u << ROUTER_GET)) {
+        allowed |= 1u << ROUTER_HEAD;
+    }
+    size_t len = 0;
+    for (int m = 0; m < ROUTER_ANY; m++) {
+        if (allowed & (1u << m)) {
+            int n = snprintf(out + len, size - len, len ? ", %s" : "%s", router_method_names[m]);
+            if (n < 0 || (size_t)n >= size - len) {
+                break;
+            }
+            len += n;
+        }
+    }
+    return len;
+}
+
+// Finds the route for method and path. method is a RouterMethod, or -1 for
+// methods only routes registered for any method should see; those routes
+// are also the fallback for every other method.
+static bool router_match(const Router *router, int method, std::string_view path, RouteMatch *match) {
+    match->route = -1;
+    match->path_matched = false;
+    match->allowed = 0;
+    match->param_count = 0;
+    if (method < 0) {
+        method = ROUTER_ANY;
+    }
+
+    const RouterLiteral *literal = router_literal_find(router, path);
+    if (literal) {
+        int route = router_node_route(literal->node, method);
+        if (route >= 0) {
+            match->route = route;
+            return true;
+        }
+        match->path_matched = true;  // a dynamic route may still take the method
+        match->allowed |= literal->node->methods;
+    }
+    return router->dynamic && router_match_node(router->root, path, method, match);
+}
@@ -0,0 +1,577 @@
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+static const char *const http_days_[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *const http_months_[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                           "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// Formats t as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), whatever the
+// locale. out must hold 32 bytes.
+static void http_format_date(time_t t, char *out) {
+    tm utc;
+    gmtime_r(&t, &utc);
+    snprintf(out, 32, "%s, %02d %s %04d %02d:%02d:%02d GMT", http_days_[utc.tm_wday], utc.tm_mday,
+             http_months_[utc.tm_mon], utc.tm_year + 1900, utc.tm_hour, utc.tm_min, utc.tm_sec);
+}
+
+// Parses an HTTP date in the preferred format; the obsolete ones are
+// treated as absent, as clients no longer send them.
+static bool http_parse_date(string_view text, time_t *out) {
+    if (text.size() != 29 || text[3] != ',' || text.substr(25) != " GMT") {
+        return false;
+    }
+    char month[4];
+    tm utc{};
+    if (sscanf(text.data() + 5, "%2d %3s %4d %2d:%2d:%2d", &utc.tm_mday, month, &utc.tm_year, &utc.tm_hour,
+               &utc.tm_min, &utc.tm_sec) != 6) {
+        return false;
+    }
+    utc.tm_mon = -1;
+    for (int i = 0; i < 12; i++) {
+        if (memcmp(month, http_months_[i], 3) == 0) {
+            utc.tm_mon = i;
+        }
+    }
+    if (utc.tm_mon < 0) {
+        return false;
+    }
+    utc.tm_year -= 1900;
+    *out = timegm(&utc);
+    return true;
+}
+
+// An open file as it was when last validated. Responses being sent hold a
+// reference, so invalidating a file never closes an fd mid-transfer. The
+// validators are formatted once per snapshot.
+struct FileSnapshot {
+    int fd;
+    size_t size;
+    timespec mtime;
+    ino_t inode;
+    char etag[64];           // quoted, changes with the inode, size or mtime
+    char last_modified[32];
+
+    FileSnapshot(int file_fd, size_t file_size, timespec file_mtime, ino_t file_inode)
+        : fd(file_fd), size(file_size), mtime(file_mtime), inode(file_inode) {
+        snprintf(etag, sizeof(etag), "\"%lx-%zx-%lx.%lx\"", (unsigned long)inode, size, (unsigned long)mtime.tv_sec,
+                 (unsigned long)mtime.tv_nsec);
+        http_format_date(mtime.tv_sec, last_modified);
+    }
+    FileSnapshot(const FileSnapshot &) = delete;
+    FileSnapshot &operator=(const FileSnapshot &) = delete;
+
+    ~FileSnapshot() {
+        close(fd);
+    }
+};
+
+// Content codings a static file may be sent in, in order of preference.
+enum StaticEncoding {
+    STATIC_ZSTD,
+    STATIC_GZIP,
+    STATIC_ENCODINGS
+};
+
+static const char *const static_encoding_names_[] = {"zstd", "gzip"};
+static const char *const static_encoding_suffixes_[] = {".zst", ".gz"};
+
+struct StaticFile {
+    string path;
+    shared_ptr<FileSnapshot> snapshot;   // null until opened or after invalidation
+    shared_ptr<const string> cached;     // contents while in the LRU cache
+    int watch;                           // inotify watch descriptor, -1 if none
+    time_t checked;                      // last stat() when not watched, or failed open()
+    StaticFile *lru_prev;
+    StaticFile *lru_next;
+    StaticFile *siblings[STATIC_ENCODINGS];  // precompressed path.zst / path.gz, once looked for
+};
+
+struct StaticFileCache {
+    size_t max_bytes;                    // 0 disables the content cache
+    size_t max_file_size;
+    size_t bytes;
+    StaticFile *lru_head;                // most recently used
+    StaticFile *lru_tail;
+    int inotify_fd;
+    unordered_map<int, StaticFile *> watches;
+    unordered_map<string, StaticFile *> files;  // by path, shared by every route
+};
+
+static thread_local StaticFileCache static_files_{0, 64 * 1024, 0, nullptr, nullptr, -1, {}, {}};
+
+static StaticFile *static_file_get(const char *path) {
+    StaticFile *&file = static_files_.files[path];
+    if (!file) {
+        file = new StaticFile{path, nullptr, nullptr, -1, 0, nullptr, nullptr, {}};
+    }
+    return file;
+}
+
+static void static_lru_unlink(StaticFile *file) {
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        static_files_.lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        static_files_.lru_tail = file->lru_prev;
+    }
+    file->lru_prev = file->lru_next = nullptr;
+}
+
+static void static_lru_push_front(StaticFile *file) {
+    file->lru_next = static_files_.lru_head;
+    if (static_files_.lru_head) {
+        static_files_.lru_head->lru_prev = file;
+    }
+    static_files_.lru_head = file;
+    if (!static_files_.lru_tail) {
+        static_files_.lru_tail = file;
+    }
+}
+
+static void static_file_uncache(StaticFile *file) {
+    if (file->cached) {
+        static_files_.bytes -= file->cached->size();
+        static_lru_unlink(file);
+        file->cached.reset();
+    }
+}
+
+static void static_file_invalidate(StaticFile *file) {
+    static_file_uncache(file);
+    file->snapshot.reset();
+    file->checked = 0;
+    if (file->watch >= 0) {
+        static_files_.watches.erase(file->watch);
+        inotify_rm_watch(static_files_.inotify_fd, file->watch);
+        file->watch = -1;
+    }
+}
+
+// Returns the current snapshot of file, reopening it if it changed on disk.
+// Watched files are trusted until inotify says otherwise; others are
+// re-stat()ed at most once per second, as are missing ones.
+static const shared_ptr<FileSnapshot> &static_file_open(StaticFile *file, time_t now) {
+    if (file->snapshot && file->watch < 0 && now != file->checked) {
+        struct stat st;
+        FileSnapshot *s = file->snapshot.get();
+        if (stat(file->path.c_str(), &st) < 0 || st.st_ino != s->inode || (size_t)st.st_size != s->size ||
+            st.st_mtim.tv_sec != s->mtime.tv_sec || st.st_mtim.tv_nsec != s->mtime.tv_nsec) {
+            static_file_invalidate(file);
+        } else {
+            file->checked = now;
+        }
+    }
+    if (file->snapshot || file->checked == now) {
+        return file->snapshot;
+    }
+
+    file->checked = now;
+    int fd = open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return file->snapshot;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return file->snapshot;
+    }
+
+    file->snapshot = make_shared<FileSnapshot>(fd, (size_t)st.st_size, st.st_mtim, st.st_ino);
+    if (static_files_.inotify_fd >= 0) {
+        file->watch = inotify_add_watch(static_files_.inotify_fd, file->path.c_str(),
+                                        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+        if (file->watch >= 0) {
+            static_files_.watches[file->watch] = file;
+        }
+    }
+    return file->snapshot;
+}
+
+// Reads size bytes of fd from the start.
+static bool static_read_all(int fd, char *out, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, out + done, size - done, done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Returns the cached contents of an already opened file, loading it into the
+// LRU cache if it is small enough, or null if it should be streamed instead.
+static shared_ptr<const string> static_file_cached(StaticFile *file) {
+    FileSnapshot *snapshot = file->snapshot.get();
+    if (static_files_.max_bytes == 0 || snapshot->size > static_files_.max_file_size ||
+        snapshot->size > static_files_.max_bytes) {
+        return nullptr;
+    }
+    if (file->cached) {
+        if (static_files_.lru_head != file) {
+            static_lru_unlink(file);
+            static_lru_push_front(file);
+        }
+        return file->cached;
+    }
+
+    auto contents = make_shared<string>(snapshot->size, '\0');
+    if (!static_read_all(snapshot->fd, &(*contents)[0], snapshot->size)) {
+        return nullptr;
+    }
+
+    static_files_.bytes += contents->size();
+    while (static_files_.bytes > static_files_.max_bytes && static_files_.lru_tail) {
+        static_file_uncache(static_files_.lru_tail);
+    }
+    file->cached = contents;
+    static_lru_push_front(file);
+    return file->cached;
+}
+
+static int static_files_watch_start() {
+    if (static_files_.inotify_fd < 0) {
+        static_files_.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    return static_files_.inotify_fd;
+}
+
+static void static_files_on_inotify() {
+    alignas(inotify_event) char events[4096];
+    while (true) {
+        ssize_t n = read(static_files_.inotify_fd, events, sizeof(events));
+        if (n <= 0) {
+            return;
+        }
+        for (char *p = events; p < events + n;) {
+            inotify_event *event = (inotify_event *)p;
+            auto it = static_files_.watches.find(event->wd);
+            if (it != static_files_.watches.end()) {
+                static_file_invalidate(it->second);
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+// gzip-compressed files, shared by every worker so each version of a file is
+// compressed once. Entries are keyed by path and ETag, so a changed file
+// misses and its stale versions age out of the LRU.
+#define STATIC_COMPRESS_MIN 256  // smaller files are sent as they are
+
+struct CompressedCache {
+    mutex lock;
+    size_t max_bytes;                    // 0 disables compressing on the fly
+    size_t max_file_size;
+    size_t bytes;
+    // Most recently used first; a null body marks a file that did not shrink.
+    list<pair<string, shared_ptr<const string>>> lru;
+    unordered_map<string, list<pair<string, shared_ptr<const string>>>::iterator> entries;
+};
+
+static CompressedCache compressed_cache_{{}, 0, 1024 * 1024, 0, {}, {}};
+
+static shared_ptr<const string> static_gzip(const char *data, size_t len) {
+    z_stream z{};
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nullptr;
+    }
+    auto out = make_shared<string>(deflateBound(&z, len), '\0');
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    z.next_out = (Bytef *)&(*out)[0];
+    z.avail_out = out->size();
+    int result = deflate(&z, Z_FINISH);
+    out->resize(z.total_out);
+    deflateEnd(&z);
+    // Not worth a Content-Encoding unless it saves a tenth.
+    if (result != Z_STREAM_END || out->size() > len - len / 10) {
+        return nullptr;
+    }
+    return out;
+}
+
+// Returns the gzip-compressed contents of an opened file, compressing and
+// caching them on first use, or null if the file is not worth compressing.
+static shared_ptr<const string> static_file_compressed(StaticFile *file) {
+    CompressedCache &cache = compressed_cache_;
+    FileSnapshot *snapshot = file->snapshot.get();
+    static thread_local string key;
+    key.assign(file->path).append(snapshot->etag);
+    {
+        lock_guard<mutex> guard(cache.lock);
+        if (cache.max_bytes == 0 || snapshot->size < STATIC_COMPRESS_MIN || snapshot->size > cache.max_file_size) {
+            return nullptr;
+        }
+        auto it = cache.entries.find(key);
+        if (it != cache.entries.end()) {
+            cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+            return it->second->second;
+        }
+    }
+
+    // Compressed outside the lock; a worker racing on the same file wastes
+    // some work but both get the same bytes.
+    shared_ptr<const string> compressed;
+    shared_ptr<const string> contents = static_file_cached(file);
+    if (contents) {
+        compressed = static_gzip(contents->data(), contents->size());
+    } else {
+        string buffer(snapshot->size, '\0');
+        if (static_read_all(snapshot->fd, &buffer[0], buffer.size())) {
+            compressed = static_gzip(buffer.data(), buffer.size());
+        }
+    }
+
+    lock_guard<mutex> guard(cache.lock);
+    if (cache.entries.count(key)) {
+        return compressed;
+    }
+    size_t cost = key.size() + (compressed ? compressed->size() : 0);
+    if (cost > cache.max_bytes) {
+        return compressed;
+    }
+    cache.lru.emplace_front(key, compressed);
+    cache.entries[key] = cache.lru.begin();
+    cache.bytes += cost;
+    while (cache.bytes > cache.max_bytes) {
+        auto &last = cache.lru.back();
+        cache.bytes -= last.first.size() + (last.second ? last.second->size() : 0);
+        cache.entries.erase(last.first);
+        cache.lru.pop_back();
+    }
+    return compressed;
+}
+
+// Which of the encodings the client's Accept-Encoding allows, as a bit mask.
+static unsigned static_accepted_encodings(string_view value) {
+    unsigned accepted = 0;
+    while (!value.empty()) {
+        size_t end = value.find(',');
+        string_view item = value.substr(0, end);
+        value = end == string_view::npos ? string_view() : value.substr(end + 1);
+
+        size_t params = item.find(';');
+        string_view name = item.substr(0, params);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) {
+            name.remove_prefix(1);
+        }
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) {
+            name.remove_suffix(1);
+        }
+        // q=0 (in any spelling, like q=0.00) refuses the coding.
+        if (params != string_view::npos) {
+            size_t q = item.find("q=", params);
+            if (q != string_view::npos && strtod(string(item.substr(q + 2)).c_str(), nullptr) <= 0) {
+                continue;
+            }
+        }
+        for (int i = 0; i < STATIC_ENCODINGS; i++) {
+            size_t len = strlen(static_encoding_names_[i]);
+            if ((name.size() == len && strncasecmp(name.data(), static_encoding_names_[i], len) == 0) ||
+                name == "*" || (i == STATIC_GZIP && name.size() == 6 && strncasecmp(name.data(), "x-gzip", 6) == 0)) {
+                accepted |= 1u << i;
+            }
+        }
+    }
+    return accepted;
+}
+
+// What a static response sends: the file itself, a precompressed sibling or
+// compressed bytes from the cache.
+struct StaticBody {
+    StaticFile *source;                  // the file sent, null for compressed bytes
+    shared_ptr<FileSnapshot> snapshot;
+    shared_ptr<const string> data;       // the compressed bytes
+    const char *encoding;                // Content-Encoding, null for none
+    char etag[80];                       // differs for every encoding
+
+    size_t size() const {
+        return data ? data->size() : snapshot->size;
+    }
+};
+
+// Picks how to send an opened file. A sibling path.zst or path.gz the client
+// accepts is sent when it is at least as new as the file; otherwise gzip
+// clients get the file compressed on the fly. Range requests always get the
+// file itself, so byte offsets mean the same thing to every client.
+static void static_file_negotiate(StaticFile *file, const HttpRequest *request, const char *base, time_t now,
+                                  StaticBody *body) {
+    const FileSnapshot *snapshot = file->snapshot.get();
+    body->source = file;
+    body->snapshot = file->snapshot;
+    body->data = nullptr;
+    body->encoding = nullptr;
+    snprintf(body->etag, sizeof(body->etag), "%s", snapshot->etag);
+
+    const HttpHeader *accept = http_find_header(request, base, "Accept-Encoding");
+    if (!accept || http_find_header(request, base, "Range")) {
+        return;
+    }
+    unsigned accepted = static_accepted_encodings(http_slice(base, accept->value));
+    for (int i = 0; i < STATIC_ENCODINGS; i++) {
+        if (!(accepted & (1u << i))) {
+            continue;
+        }
+        StaticFile *&sibling = file->siblings[i];
+        if (!sibling) {
+            sibling = static_file_get((file->path + static_encoding_suffixes_[i]).c_str());
+        }
+        const shared_ptr<FileSnapshot> &encoded = static_file_open(sibling, now);
+        if (encoded && (encoded->mtime.tv_sec > snapshot->mtime.tv_sec ||
+                        (encoded->mtime.tv_sec == snapshot->mtime.tv_sec && encoded->mtime.tv_nsec >= snapshot->mtime.tv_nsec))) {
+            body->source = sibling;
+            body->snapshot = encoded;
+            body->encoding = static_encoding_names_[i];
+            snprintf(body->etag, sizeof(body->etag), "%s", encoded->etag);
+            return;
+        }
+    }
+    if (accepted & (1u << STATIC_GZIP)) {
+        shared_ptr<const string> compressed = static_file_compressed(file);
+        if (compressed) {
+            body->source = nullptr;
+            body->data = move(compressed);
+            body->encoding = static_encoding_names_[STATIC_GZIP];
+            // "etag" becomes "etag-gzip"
+            snprintf(body->etag, sizeof(body->etag), "%.*s-gzip\"", (int)strlen(snapshot->etag) - 1, snapshot->etag);
+        }
+    }
+}
+
+// Whether an If-None-Match or If-Range list names etag. Weak comparison
+// ignores a W/ prefix; strong comparison never matches a weak tag.
+static bool static_etag_matches(string_view list, const char *etag, bool weak) {
+    size_t etag_len = strlen(etag);
+    while (!list.empty()) {
+        size_t end = list.find(',');
+        string_view tag = list.substr(0, end);
+        list = end == string_view::npos ? string_view() : list.substr(end + 1);
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+            tag.remove_prefix(1);
+        }
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+            tag.remove_suffix(1);
+        }
+        if (tag == "*") {
+            return true;
+        }
+        if (tag.substr(0, 2) == "W/") {
+            if (!weak) {
+                continue;
+            }
+            tag.remove_prefix(2);
+        }
+        if (tag == string_view(etag, etag_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+// range against size. Returns 206 with the range, 416 if it lies past the
+// end, or 200 for anything else (several ranges included), which is
+// answered with the whole file.
+static int static_parse_range(string_view value, size_t size, size_t *offset, size_t *len) {
+    if (value.substr(0, 6) != "bytes=" || value.find(',') != string_view::npos) {
+        return 200;
+    }
+    value.remove_prefix(6);
+    size_t dash = value.find('-');
+    if (dash == string_view::npos) {
+        return 200;
+    }
+    auto parse = [](string_view digits, size_t *out) {
+        if (digits.empty() || digits.size() > 18) {
+            return false;
+        }
+        size_t n = 0;
+        for (char c : digits) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            n = n * 10 + (c - '0');
+        }
+        *out = n;
+        return true;
+    };
+    size_t first, last;
+    if (dash == 0) {
+        if (!parse(value.substr(1), &last)) {
+            return 200;
+        }
+        if (last == 0 || size == 0) {
+            return 416;
+        }
+        first = last < size ? size - last : 0;
+        last = size - 1;
+    } else {
+        if (!parse(value.substr(0, dash), &first)) {
+            return 200;
+        }
+        if (dash + 1 == value.size()) {
+            last = size - 1;
+        } else if (!parse(value.substr(dash + 1), &last) || last < first) {
+            return 200;
+        }
+        if (first >= size) {
+            return 416;
+        }
+        if (last >= size) {
+            last = size - 1;
+        }
+    }
+    *offset = first;
+    *len = last - first + 1;
+    return 206;
+}
+
+// Evaluates the request's conditional and Range headers against body: 304
+// when the client's copy is current, 206 for a satisfiable range (set in
+// offset and len), 416 for one past the end, otherwise 200.
+static int static_file_status(const StaticBody *body, const HttpRequest *request, const char *base, size_t *offset,
+                              size_t *len) {
+    const FileSnapshot *snapshot = body->snapshot.get();
+    // If-None-Match wins over If-Modified-Since when both are sent.
+    if (const HttpHeader *h = http_find_header(request, base, "If-None-Match")) {
+        if (static_etag_matches(http_slice(base, h->value), body->etag, true)) {
+            return 304;
+        }
+    } else if (const HttpHeader *modified_since = http_find_header(request, base, "If-Modified-Since")) {
+        time_t since;
+        if (http_parse_date(http_slice(base, modified_since->value), &since) && snapshot->mtime.tv_sec <= since) {
+            return 304;
+        }
+    }
+
+    const HttpHeader *range = http_find_header(request, base, "Range");
+    if (!range) {
+        return 200;
+    }
+    // A Range conditional on a stale validator gets the whole new file.
+    if (const HttpHeader *h = http_find_header(request, base, "If-Range")) {
+        string_view validator = http_slice(base, h->value);
+        time_t date;
+        bool current = validator.substr(0, 1) == "\"" || validator.substr(0, 2) == "W/"
+                           ? static_etag_matches(validator, body->etag, false)
+                           : http_parse_date(validator, &date) && date == snapshot->mtime.tv_sec;
+        if (!current) {
+            return 200;
+        }
+    }
+    return static_parse_range(http_slice(base, range->value), body->size(), offset, len);
+}
+
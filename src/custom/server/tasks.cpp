@@ -0,0 +1,451 @@
+#include <netdb.h>
+#include <unordered_map>
+
+// Finished coroutines are reset and reused instead of left to the GC.
+#define TASK_POOL_SIZE 64
+
+// How a handler is called.
+enum HandlerStyle {
+    HANDLER_BODY,            // handler(data, size, socket [, params]), from handle_post
+    HANDLER_REQUEST,         // handler(req, res), from route
+    HANDLER_WEBSOCKET,       // handler(req, ws), from websocket, once upgraded
+    HANDLER_CALLBACK         // handler(), from after/every
+};
+
+static Response *response_new(luna_State *L, int client_socket, int status, bool chunked_ok, bool head);
+static void response_end(Response *res, bool failed);
+static void websocket_push(luna_State *L, Connection *conn);
+
+static thread_local HandlerTask *current_task_ = nullptr;
+static thread_local vector<HandlerTask *> task_pool_;
+// Set when a handler raises; blocking mode resets and reads it per request,
+// for crun.
+static thread_local bool task_failed_ = false;
+
+// The handler task L is running as, if it may yield to the event loop.
+// Anything else (the main script, blocking mode, coroutines the handler
+// created itself) blocks instead.
+static HandlerTask *task_running(luna_State *L) {
+    return loop_ && current_task_ && current_task_->co == L ? current_task_ : nullptr;
+}
+
+static void task_release(HandlerTask *task) {
+    if (task_pool_.size() < TASK_POOL_SIZE) {
+        luna_closethread(task->co, task->L);
+        task_pool_.push_back(task);
+        return;
+    }
+    lunaL_unref(task->L, LUNA_REGISTRYINDEX, task->ref);
+    delete task;
+}
+
+// Resumes task until it finishes or parks itself on something the loop will
+// wake it for. 'resumed' is false for the first run, which happens inside
+// conn_process(); that caller finishes the request itself.
+static void task_run(HandlerTask *task, int nargs, bool resumed) {
+    bool failed = false;
+    while (true) {
+        HandlerTask *previous = current_task_;
+        current_task_ = task;
+        int nres;
+        int status = luna_resume(task->co, task->L, nargs, &nres);
+        current_task_ = previous;
+
+        if (status == LUNA_YIELD) {
+            luna_pop(task->co, nres);
+            bool parked = task->wait_fd >= 0 || task->wait_drain || task->wait_aio;
+            if (!parked && loop_) {
+                loop_->ready.push_back(task);  // a plain coroutine.yield()
+                parked = true;
+            }
+            if (parked) {
+                // The connection buffer moves on without us.
+                if (task->request) {
+                    request_detach(task->request);
+                }
+                return;
+            }
+            nargs = 0;
+            continue;
+        }
+        if (status != LUNA_OK) {
+            fprintf(stderr, "Lua error: %s\n", luna_tostring(task->co, -1));
+            failed = true;
+            task_failed_ = true;
+        }
+        break;
+    }
+
+    // The request and response objects are still anchored below the handler
+    // on the stack.
+    if (task->request) {
+        request_expire(task->request);
+    }
+    if (task->response) {
+        response_end(task->response, failed);
+    }
+
+    Connection *conn = task->conn;
+    bool answers_request = task->answers_request;
+    task_release(task);
+    if (!conn) {
+        return;
+    }
+    conn->task = nullptr;
+    if (conn->closing) {
+        conn_close(conn);
+    } else if (resumed) {
+        if (answers_request) {
+            conn_request_done(conn);
+        }
+        conn_finish(conn);
+    }
+}
+
+static void task_resume(HandlerTask *task) {
+    task_run(task, 0, true);
+}
+
+// A fresh task for client_socket (-1 for none), its coroutine's stack empty.
+static HandlerTask *task_new(luna_State *L, int client_socket) {
+    HandlerTask *task;
+    if (!task_pool_.empty()) {
+        task = task_pool_.back();
+        task_pool_.pop_back();
+    } else {
+        task = new HandlerTask();
+        task->L = L;
+        task->co = luna_newthread(L);
+        task->ref = lunaL_ref(L, LUNA_REGISTRYINDEX);
+    }
+    task->conn = conn_lookup(client_socket);
+    task->wait_fd = -1;
+    task->wait_drain = false;
+    task->wait_aio = false;
+    task->answers_request = false;
+    task->request = nullptr;
+    task->response = nullptr;
+    return task;
+}
+
+// Runs the function on top of the task's stack, below its nargs arguments.
+static void task_launch(HandlerTask *task, int nargs) {
+    if (task->conn) {
+        task->conn->task = task;
+    }
+    task_run(task, nargs, false);
+}
+
+// Runs the Lua function stored at function_ref in a coroutine of its own,
+// called as style says.
+static void task_start(luna_State *L, int function_ref, HandlerStyle style, int client_socket,
+                       const HttpRequest *request, const char *base, const RouteMatch *match) {
+    HandlerTask *task = task_new(L, client_socket);
+    task->answers_request = style != HANDLER_CALLBACK;
+
+    luna_State *co = task->co;
+    int nargs;
+    if (style == HANDLER_CALLBACK) {
+        luna_rawgeti(co, LUNA_REGISTRYINDEX, function_ref);
+        nargs = 0;
+    } else if (style == HANDLER_REQUEST) {
+        // Kept below the function so it stays reachable after the handler returns
+        task->request = request_new(co, request, base, match, client_socket);
+        task->response = response_new(co, client_socket, 200, request->minor_version >= 1,
+                                      http_method_is(request, base, "HEAD"));
+        luna_rawgeti(co, LUNA_REGISTRYINDEX, function_ref);
+        luna_pushvalue(co, -3);
+        luna_pushvalue(co, -3);
+        nargs = 2;
+    } else if (style == HANDLER_WEBSOCKET) {
+        task->request = request_new(co, request, base, match, client_socket);
+        luna_rawgeti(co, LUNA_REGISTRYINDEX, function_ref);
+        luna_pushvalue(co, -2);
+        websocket_push(co, task->conn);
+        nargs = 2;
+    } else {
+        luna_rawgeti(co, LUNA_REGISTRYINDEX, function_ref);
+        luna_pushlstring(co, base + request->body.off, request->body.len);
+        luna_pushinteger(co, request->body.len);
+        luna_pushinteger(co, client_socket);
+        nargs = 3;
+        if (match->param_count > 0) {
+            luna_createtable(co, 0, match->param_count);
+            for (int i = 0; i < match->param_count; i++) {
+                const RouteParam &param = match->params[i];
+                luna_pushlstring(co, param.name.data(), param.name.size());
+                luna_pushlstring(co, param.value.data(), param.value.size());
+                luna_rawset(co, -3);
+            }
+            nargs++;
+        }
+    }
+    task_launch(task, nargs);
+}
+
+// Parks the running handler until fd is ready, then continues in k.
+static int task_wait_fd(luna_State *L, HandlerTask *task, int fd, uint32_t events, luna_KContext ctx, luna_KFunction k) {
+    if (loop_->ring) {
+        uring_wait_fd(task, fd, events);
+        task->wait_fd = fd;
+        return luna_yieldk(L, 0, ctx, k);
+    }
+    if ((size_t)fd >= loop_->waiters.size()) {
+        loop_->waiters.resize(fd * 2 + 1, nullptr);
+    }
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(loop_->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return lunaL_error(L, "cannot wait on socket %d: %s", fd, strerror(errno));
+    }
+    loop_->waiters[fd] = task;
+    task->wait_fd = fd;
+    return luna_yieldk(L, 0, ctx, k);
+}
+
+static void wait_blocking(int fd, short events) {
+    pollfd pfd{fd, events, 0};
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+    }
+}
+
+static int server_connect_k(luna_State *L, int status, luna_KContext ctx) {
+    (void)status;
+    int fd = (int)ctx;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+        close(fd);
+        luna_pushnil(L);
+        luna_pushstring(L, strerror(error));
+        return 2;
+    }
+    luna_pushinteger(L, fd);
+    return 1;
+}
+
+// connect(host, port) -> socket | nil, error
+static int server_connect(luna_State *L) {
+    const char *host = lunaL_checkstring(L, 1);
+    int port = lunaL_checkinteger(L, 2);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    int error = getaddrinfo(host, service, &hints, &result);
+    if (error != 0) {
+        luna_pushnil(L);
+        luna_pushstring(L, gai_strerror(error));
+        return 2;
+    }
+
+    int fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int connected = fd < 0 ? -1 : connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (connected == 0) {
+        luna_pushinteger(L, fd);
+        return 1;
+    }
+    if (fd < 0 || errno != EINPROGRESS) {
+        int saved = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        luna_pushnil(L);
+        luna_pushstring(L, strerror(saved));
+        return 2;
+    }
+
+    HandlerTask *task = task_running(L);
+    if (task) {
+        return task_wait_fd(L, task, fd, EPOLLOUT, fd, server_connect_k);
+    }
+    wait_blocking(fd, POLLOUT);
+    return server_connect_k(L, LUNA_OK, fd);
+}
+
+// The context carries how many bytes were already sent.
+static int server_send_k(luna_State *L, int status, luna_KContext sent) {
+    (void)status;
+    int fd = lunaL_checkinteger(L, 1);
+    size_t len;
+    const char *data = lunaL_checklstring(L, 2, &len);
+    while ((size_t)sent < len) {
+        ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n >= 0) {
+            sent += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (would_block(errno)) {
+            HandlerTask *task = task_running(L);
+            if (task) {
+                return task_wait_fd(L, task, fd, EPOLLOUT, sent, server_send_k);
+            }
+            wait_blocking(fd, POLLOUT);
+            continue;
+        }
+        luna_pushnil(L);
+        luna_pushstring(L, strerror(errno));
+        return 2;
+    }
+    luna_pushinteger(L, sent);
+    return 1;
+}
+
+// send(socket, data) -> bytes sent | nil, error
+static int server_send(luna_State *L) {
+    return server_send_k(L, LUNA_OK, 0);
+}
+
+static int server_recv_k(luna_State *L, int status, luna_KContext ctx) {
+    (void)status; (void)ctx;
+    int fd = lunaL_checkinteger(L, 1);
+    size_t max = lunaL_optinteger(L, 2, SERVER_READ_CHUNK);
+    luna_settop(L, 2);
+
+    lunaL_Buffer b;
+    char *p = lunaL_buffinitsize(L, &b, max);
+    while (true) {
+        ssize_t n = recv(fd, p, max, MSG_DONTWAIT);
+        if (n > 0) {
+            lunaL_pushresultsize(&b, n);
+            return 1;
+        }
+        if (n == 0) {
+            luna_pushnil(L);
+            return 1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (would_block(errno)) {
+            HandlerTask *task = task_running(L);
+            if (task) {
+                return task_wait_fd(L, task, fd, EPOLLIN, 0, server_recv_k);
+            }
+            wait_blocking(fd, POLLIN);
+            continue;
+        }
+        luna_pushnil(L);
+        luna_pushstring(L, strerror(errno));
+        return 2;
+    }
+}
+
+// recv(socket [, max]) -> data | nil at end of stream | nil, error
+static int server_recv(luna_State *L) {
+    return server_recv_k(L, LUNA_OK, 0);
+}
+
+static int server_close(luna_State *L) {
+    close(lunaL_checkinteger(L, 1));
+    return 0;
+}
+
+static int task_throttle_k(luna_State *L, int status, luna_KContext ctx) {
+    (void)L; (void)status; (void)ctx;
+    return 0;
+}
+
+// Ends a Lua function that queued response bytes on client_socket. A handler
+// producing output faster than the client reads it is parked until the
+// socket drains below low_water instead of buffering without bound.
+static int task_throttle(luna_State *L, int client_socket, size_t high_water = SERVER_HIGH_WATER,
+                         size_t low_water = SERVER_LOW_WATER) {
+    HandlerTask *task = task_running(L);
+    Connection *conn = conn_lookup(client_socket);
+    if (task && conn && conn == task->conn && conn->out_bytes > high_water && conn_flush(conn) &&
+        conn->out_bytes > high_water) {
+        task->wait_drain = true;
+        task->drain_below = low_water;
+        conn_update_deadline(conn);  // the client has idle_timeout to keep reading
+        return luna_yieldk(L, 0, 0, task_throttle_k);
+    }
+    return 0;
+}
+
+// Callbacks scheduled from Lua with after/every. They run as handler tasks of
+// their own, so they may use the yielding socket helpers too.
+struct LuaTimer {
+    Timer timer;
+    luna_State *L;           // main thread
+    int ref;                 // the callback
+    uint64_t interval;       // ms between runs, 0 for a one-shot timer
+    luna_Integer id;
+};
+
+static thread_local unordered_map<luna_Integer, LuaTimer *> lua_timers_;
+static thread_local luna_Integer lua_timer_last_id_ = 0;
+
+static void lua_timer_free(LuaTimer *timer) {
+    lua_timers_.erase(timer->id);
+    lunaL_unref(timer->L, LUNA_REGISTRYINDEX, timer->ref);
+    delete timer;
+}
+
+static void lua_timer_fire(Timer *t) {
+    LuaTimer *timer = (LuaTimer *)t->data;
+    if (timer->interval > 0) {
+        // Rescheduled first, so the callback may cancel it.
+        timer_schedule(&timer->timer, timer->interval);
+        task_start(timer->L, timer->ref, HANDLER_CALLBACK, -1, nullptr, nullptr, nullptr);
+        return;
+    }
+    lua_timers_.erase(timer->id);  // cancel() from the callback finds nothing
+    task_start(timer->L, timer->ref, HANDLER_CALLBACK, -1, nullptr, nullptr, nullptr);
+    lunaL_unref(timer->L, LUNA_REGISTRYINDEX, timer->ref);
+    delete timer;
+}
+
+static int lua_timer_add(luna_State *L, bool repeat) {
+    luna_Number ms = lunaL_checknumber(L, 1);
+    lunaL_checktype(L, 2, LUNA_TFUNCTION);
+    lunaL_argcheck(L, ms >= (repeat ? 1 : 0) && ms <= TIMER_MAX_DELAY, 1, "invalid delay");
+
+    LuaTimer *timer = new LuaTimer();
+    luna_pushvalue(L, 2);
+    timer->ref = lunaL_ref(L, LUNA_REGISTRYINDEX);
+    luna_rawgeti(L, LUNA_REGISTRYINDEX, LUNA_RIDX_MAINTHREAD);
+    timer->L = luna_tothread(L, -1);
+    luna_pop(L, 1);
+    timer->interval = repeat ? (uint64_t)ms : 0;
+    timer->id = ++lua_timer_last_id_;
+    timer->timer.fire = lua_timer_fire;
+    timer->timer.data = timer;
+    lua_timers_[timer->id] = timer;
+    timer_schedule(&timer->timer, (uint64_t)ms);
+
+    luna_pushinteger(L, timer->id);
+    return 1;
+}
+
+// after(ms, fn) -> id: calls fn once, ms milliseconds from now
+static int server_after(luna_State *L) {
+    return lua_timer_add(L, false);
+}
+
+// every(ms, fn) -> id: calls fn every ms milliseconds until cancelled
+static int server_every(luna_State *L) {
+    return lua_timer_add(L, true);
+}
+
+// cancel(id) -> true if the timer was still scheduled
+static int server_cancel(luna_State *L) {
+    auto it = lua_timers_.find(lunaL_checkinteger(L, 1));
+    if (it == lua_timers_.end()) {
+        luna_pushboolean(L, false);
+        return 1;
+    }
+    timer_cancel(&it->second->timer);
+    lua_timer_free(it->second);
+    luna_pushboolean(L, true);
+    return 1;
+}
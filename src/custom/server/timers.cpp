@@ -0,0 +1,193 @@
+// Hierarchical timer wheel with millisecond ticks.
+//
+// Level 0 has one slot per millisecond for the next 256 ms; each of the four
+// levels above covers 64 times the span of the one below, up to ~49 days.
+// Timers are intrusive list nodes, so scheduling and cancelling are O(1) and
+// never allocate. When level 0 wraps, the next slot of level 1 is spread
+// back down, and so on up, so each timer is touched at most once per level.
+#include <cstdint>
+#include <ctime>
+
+#define TIMER_LEVEL0_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL0_SIZE (1 << TIMER_LEVEL0_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4       // above level 0
+#define TIMER_MAX_DELAY ((1ull << (TIMER_LEVEL0_BITS + TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+struct Timer {
+    Timer *prev;             // null while not scheduled
+    Timer *next;
+    uint64_t expires;        // wheel time in ms
+    void (*fire)(Timer *);
+    void *data;              // for the callback
+};
+
+struct TimerWheel {
+    uint64_t now;            // next tick to run; everything before it has fired
+    size_t count;            // scheduled timers
+    Timer level0[TIMER_LEVEL0_SIZE];
+    Timer levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+};
+
+static thread_local TimerWheel *timers_ = nullptr;
+
+static uint64_t timer_clock() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_list_init(Timer *head) {
+    head->prev = head->next = head;
+}
+
+static TimerWheel *timer_wheel() {
+    if (!timers_) {
+        timers_ = new TimerWheel();
+        timers_->now = timer_clock();
+        for (Timer &head : timers_->level0) {
+            timer_list_init(&head);
+        }
+        for (auto &level : timers_->levels) {
+            for (Timer &head : level) {
+                timer_list_init(&head);
+            }
+        }
+    }
+    return timers_;
+}
+
+static inline bool timer_pending(const Timer *timer) {
+    return timer->prev != nullptr;
+}
+
+static void timer_link(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires < wheel->now) {
+        timer->expires = wheel->now;
+    }
+    uint64_t delay = timer->expires - wheel->now;
+    if (delay > TIMER_MAX_DELAY) {
+        delay = TIMER_MAX_DELAY;
+        timer->expires = wheel->now + delay;
+    }
+
+    Timer *head;
+    if (delay < TIMER_LEVEL0_SIZE) {
+        head = &wheel->level0[timer->expires & (TIMER_LEVEL0_SIZE - 1)];
+    } else {
+        int level = 0;
+        while (delay >= 1ull << (TIMER_LEVEL0_BITS + (level + 1) * TIMER_LEVEL_BITS)) {
+            level++;
+        }
+        int shift = TIMER_LEVEL0_BITS + level * TIMER_LEVEL_BITS;
+        head = &wheel->levels[level][(timer->expires >> shift) & (TIMER_LEVEL_SIZE - 1)];
+    }
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void timer_unlink(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+}
+
+static void timer_cancel(Timer *timer) {
+    if (timer_pending(timer)) {
+        timer_unlink(timer);
+        timers_->count--;
+    }
+}
+
+// (Re)schedules timer to fire delay ms from now.
+static void timer_schedule(Timer *timer, uint64_t delay) {
+    TimerWheel *wheel = timer_wheel();
+    timer_cancel(timer);
+    uint64_t now = timer_clock();
+    if (wheel->count == 0) {
+        wheel->now = now;  // nothing to catch up on
+    }
+    timer->expires = now + delay;
+    timer_link(wheel, timer);
+    wheel->count++;
+}
+
+// Moves every timer of one upper-level slot down to where it now belongs.
+static void timer_cascade(TimerWheel *wheel, Timer *head) {
+    Timer list;
+    if (head->next == head) {
+        return;
+    }
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = list.prev->next = &list;
+    timer_list_init(head);
+    while (list.next != &list) {
+        Timer *timer = list.next;
+        timer_unlink(timer);
+        timer_link(wheel, timer);
+    }
+}
+
+// Fires every timer due up to the current time. Callbacks may schedule or
+// cancel any timer, including the one being fired.
+static void timers_run() {
+    TimerWheel *wheel = timer_wheel();
+    uint64_t now = timer_clock();
+    if (wheel->count == 0) {
+        wheel->now = now + 1;
+        return;
+    }
+    while (wheel->now <= now && wheel->count > 0) {
+        uint64_t tick = wheel->now;
+        int index = tick & (TIMER_LEVEL0_SIZE - 1);
+        if (index == 0) {
+            for (int level = 0; level < TIMER_LEVELS; level++) {
+                int shift = TIMER_LEVEL0_BITS + level * TIMER_LEVEL_BITS;
+                int slot = (tick >> shift) & (TIMER_LEVEL_SIZE - 1);
+                timer_cascade(wheel, &wheel->levels[level][slot]);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+        // Timers scheduled for 'now' from a callback land in the next tick.
+        wheel->now = tick + 1;
+        Timer *head = &wheel->level0[index];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_unlink(timer);
+            wheel->count--;
+            timer->fire(timer);
+        }
+    }
+    if (wheel->count == 0) {
+        wheel->now = now + 1;
+    }
+}
+
+// Milliseconds until the next timer may be due, -1 if none is scheduled.
+// Past level 0 this is when the next cascade happens, which is early but
+// never late.
+static int timers_next_delay() {
+    if (!timers_ || timers_->count == 0) {
+        return -1;
+    }
+    uint64_t now = timer_clock();
+    if (timers_->now <= now) {
+        return 0;
+    }
+    // A tick at index 0 cascades, which may bring timers due at that tick.
+    uint64_t tick = timers_->now;
+    while (true) {
+        int index = tick & (TIMER_LEVEL0_SIZE - 1);
+        if (index == 0 || timers_->level0[index].next != &timers_->level0[index]) {
+            break;
+        }
+        tick++;
+    }
+    return (int)(tick - now);
+}
@@ -0,0 +1,590 @@
+// WebSocket connections (RFC 6455):
+//
+//   server.websocket("/chat/:room", function(req, ws)
+//       ws.on_message = function(ws, data, binary) ws:send(data, binary) end
+//       ws.on_close = function(ws, code, reason) end
+//   end)
+//
+// The handshake is answered before the handler runs, so it may send at once.
+// Frames are parsed and unmasked in C and Lua only sees whole messages. The
+// callbacks of one connection run one at a time, in order, as handler tasks:
+// while one is parked, later frames wait in the input buffer. send() only
+// queues a frame; everything sent to a connection during one pass of the
+// loop leaves in a single write, and a client that lets more than
+// WEBSOCKET_MAX_PENDING bytes pile up is dropped. An idle WebSocket has no
+// deadline and costs only its buffers. No extensions are negotiated, so
+// messages are never compressed.
+
+#define SERVER_WEBSOCKET "server.websocket"
+
+#define WEBSOCKET_MAX_MESSAGE (16 * 1024 * 1024)  // unless max_body_size says otherwise
+#define WEBSOCKET_MAX_PENDING (4 * 1024 * 1024)   // queued output before a client is dropped
+
+enum WebSocketOpcode {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa
+};
+
+struct WebSocket {
+    luna_State *L;           // main thread
+    int ref;                 // registry anchor for the Lua object
+    uint64_t serial;         // tells this connection apart from later ones on the fd
+    int message_opcode;      // of the fragmented message being received, 0 if none
+    string message;          // ... and its fragments so far
+    bool close_sent;
+    int close_code;          // for on_close: 1006 until a close frame goes either way
+    string close_reason;
+};
+
+// What Lua holds; it outlives the connection.
+struct WebSocketObject {
+    int fd;
+    uint64_t serial;
+};
+
+static thread_local uint64_t websocket_serial_ = 0;
+
+static void websocket_push(luna_State *L, Connection *conn) {
+    luna_rawgeti(L, LUNA_REGISTRYINDEX, conn->ws->ref);
+}
+
+// The connection obj stands for, or null once it has closed.
+static Connection *websocket_connection(const WebSocketObject *obj) {
+    Connection *conn = conn_lookup(obj->fd);
+    if (!conn || !conn->ws || conn->ws->serial != obj->serial || conn->closing) {
+        return nullptr;
+    }
+    return conn;
+}
+
+static void websocket_sha1(const unsigned char *data, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+    size_t padded = (len + 8) / 64 * 64 + 64;
+    for (size_t offset = 0; offset < padded; offset += 64) {
+        unsigned char block[64];
+        for (int i = 0; i < 64; i++) {
+            size_t pos = offset + i;
+            block[i] = pos < len ? data[pos] : pos == len ? 0x80 : 0;
+        }
+        if (offset + 64 == padded) {
+            for (int i = 0; i < 8; i++) {
+                block[56 + i] = (unsigned char)((uint64_t)len * 8 >> (56 - 8 * i));
+            }
+        }
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 | block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) {
+        out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key: base64(SHA-1(key + GUID)).
+static void websocket_accept_key(string_view key, char out[29]) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string input(key);
+    input.append("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+    unsigned char digest[21];
+    websocket_sha1((const unsigned char *)input.data(), input.size(), digest);
+    digest[20] = 0;
+    for (int i = 0, o = 0; i < 21; i += 3, o += 4) {
+        uint32_t v = digest[i] << 16 | digest[i + 1] << 8 | (i + 2 < 21 ? digest[i + 2] : 0);
+        out[o] = alphabet[v >> 18 & 63];
+        out[o + 1] = alphabet[v >> 12 & 63];
+        out[o + 2] = alphabet[v >> 6 & 63];
+        out[o + 3] = alphabet[v & 63];
+    }
+    out[27] = '=';  // 20 bytes leave one byte of padding
+    out[28] = '\0';
+}
+
+// Whether the comma-separated header value lists token, ignoring case.
+static bool websocket_has_token(string_view value, const char *token) {
+    size_t len = strlen(token);
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+            item.remove_suffix(1);
+        }
+        if (item.size() == len && strncasecmp(item.data(), token, len) == 0) {
+            return true;
+        }
+        if (comma == string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+static string_view websocket_header(const HttpRequest *request, const char *base, const char *name) {
+    const HttpHeader *header = http_find_header(request, base, name);
+    return header ? http_slice(base, header->value) : string_view();
+}
+
+static bool websocket_utf8_valid(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        // Runs of ASCII eight bytes at a time
+        if (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if ((word & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        int extra;
+        uint32_t cp, min;
+        if ((c & 0xe0) == 0xc0) {
+            extra = 1;
+            cp = c & 0x1f;
+            min = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            extra = 2;
+            cp = c & 0x0f;
+            min = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            extra = 3;
+            cp = c & 0x07;
+            min = 0x10000;
+        } else {
+            return false;
+        }
+        if (len - i <= (size_t)extra) {
+            return false;
+        }
+        for (int k = 1; k <= extra; k++) {
+            if ((s[i + k] & 0xc0) != 0x80) {
+                return false;
+            }
+            cp = cp << 6 | (s[i + k] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+// Close codes an endpoint may put on the wire.
+static bool websocket_code_valid(int code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+// XORs data with the 4-byte masking key, a word at a time.
+static void websocket_unmask(char *data, size_t len, const unsigned char key[4]) {
+    uint32_t key32;
+    memcpy(&key32, key, 4);
+    uint64_t key64 = (uint64_t)key32 << 32 | key32;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= key64;
+        memcpy(data + i, &word, 8);
+    }
+    for (; i < len; i++) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+// Queues one unmasked, unfragmented frame.
+static void websocket_send_frame(Connection *conn, int opcode, const char *data, size_t len) {
+    if (conn->out_buf.size() > SERVER_LOW_WATER && conn->out_buf.size() > 2 * conn->out_bytes) {
+        conn_compact_output(conn);
+    }
+    char head[10];
+    size_t head_len;
+    head[0] = (char)(0x80 | opcode);
+    if (len < 126) {
+        head[1] = (char)len;
+        head_len = 2;
+    } else if (len <= 0xffff) {
+        head[1] = 126;
+        head[2] = (char)(len >> 8);
+        head[3] = (char)len;
+        head_len = 4;
+    } else {
+        head[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            head[2 + i] = (char)((uint64_t)len >> (56 - 8 * i));
+        }
+        head_len = 10;
+    }
+    conn_write(conn->fd, head, head_len);
+    conn_write(conn->fd, data, len);
+}
+
+// Starts the closing handshake, or answers the client's; the connection
+// closes once the frame is out.
+static void websocket_send_close(Connection *conn, int code, const char *reason, size_t reason_len) {
+    WebSocket *ws = conn->ws;
+    if (ws->close_sent) {
+        return;
+    }
+    char payload[125] = {};
+    size_t len = 0;
+    if (code) {
+        payload[0] = (char)(code >> 8);
+        payload[1] = (char)code;
+        reason_len = reason_len < sizeof(payload) - 2 ? reason_len : sizeof(payload) - 2;
+        memcpy(payload + 2, reason, reason_len);
+        len = 2 + reason_len;
+    }
+    websocket_send_frame(conn, WS_CLOSE, payload, len);
+    ws->close_sent = true;
+    if (ws->close_code == 1006) {
+        ws->close_code = code ? code : 1005;
+        ws->close_reason.assign(reason, code ? reason_len : 0);
+    }
+    conn->close_after_write = true;
+}
+
+// Calls the callback the Lua object holds under name as a handler task of
+// conn (null once it has closed), with the object and what push leaves on
+// the coroutine's stack as arguments. push returns how many values it pushed.
+template <typename Push>
+static void websocket_dispatch(Connection *conn, WebSocket *ws, const char *name, Push push) {
+    luna_State *L = ws->L;
+    luna_rawgeti(L, LUNA_REGISTRYINDEX, ws->ref);
+    luna_getfield(L, -1, name);
+    if (!luna_isfunction(L, -1)) {
+        luna_pop(L, 2);
+        return;
+    }
+    luna_insert(L, -2);
+    HandlerTask *task = task_new(L, conn ? conn->fd : -1);
+    luna_xmove(L, task->co, 2);
+    task_launch(task, 1 + push(task->co));
+}
+
+static void websocket_message(Connection *conn, int opcode, const char *data, size_t len) {
+    if (opcode == WS_TEXT && !websocket_utf8_valid((const unsigned char *)data, len)) {
+        websocket_send_close(conn, 1007, "invalid UTF-8", 13);
+        return;
+    }
+    websocket_dispatch(conn, conn->ws, "on_message", [&](luna_State *co) {
+        luna_pushlstring(co, data, len);
+        luna_pushboolean(co, opcode == WS_BINARY);
+        return 2;
+    });
+}
+
+// Handles every complete frame in the input buffer, stopping while a
+// callback is parked, and drops the bytes handled.
+static void websocket_process(Connection *conn) {
+    WebSocket *ws = conn->ws;
+    size_t max = loop_->options.max_body_size ? loop_->options.max_body_size : WEBSOCKET_MAX_MESSAGE;
+    size_t consumed = 0;
+    while (!conn->close_after_write && !conn->task && conn->out_bytes < SERVER_MAX_PENDING_OUTPUT) {
+        unsigned char *p = (unsigned char *)&conn->in[0] + consumed;
+        size_t available = conn->in.size() - consumed;
+        if (available < 2) {
+            break;
+        }
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0f;
+        uint64_t len = p[1] & 0x7f;
+        size_t head = 2;
+        if (len == 126) {
+            head = 4;
+            if (available < head) {
+                break;
+            }
+            len = (uint64_t)p[2] << 8 | p[3];
+        } else if (len == 127) {
+            head = 10;
+            if (available < head) {
+                break;
+            }
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = len << 8 | p[2 + i];
+            }
+        }
+
+        // Clients must mask; no extension was agreed that would use RSV bits
+        bool control = opcode & 0x8;
+        if ((p[0] & 0x70) || !(p[1] & 0x80) || (control && (!fin || len > 125)) ||
+            (opcode > WS_BINARY && !control) || opcode > WS_PONG ||
+            (opcode == WS_CONTINUATION) != (ws->message_opcode != 0 && !control)) {
+            websocket_send_close(conn, 1002, "protocol error", 14);
+            break;
+        }
+        if (len > max || (!control && ws->message.size() + len > max)) {
+            websocket_send_close(conn, 1009, "message too big", 15);
+            break;
+        }
+        if (available < head + 4 || available - head - 4 < len) {
+            break;
+        }
+        char *payload = (char *)p + head + 4;
+        websocket_unmask(payload, len, p + head);
+        consumed += head + 4 + len;
+
+        switch (opcode) {
+            case WS_TEXT:
+            case WS_BINARY:
+                if (fin) {
+                    websocket_message(conn, opcode, payload, len);
+                } else {
+                    ws->message_opcode = opcode;
+                    ws->message.assign(payload, len);
+                }
+                break;
+            case WS_CONTINUATION:
+                ws->message.append(payload, len);
+                if (fin) {
+                    int message_opcode = ws->message_opcode;
+                    ws->message_opcode = 0;
+                    websocket_message(conn, message_opcode, ws->message.data(), ws->message.size());
+                    ws->message.clear();
+                }
+                break;
+            case WS_PING:
+                websocket_send_frame(conn, WS_PONG, payload, len);
+                break;
+            case WS_PONG:
+                break;
+            case WS_CLOSE: {
+                int code = len >= 2 ? ((unsigned char)payload[0] << 8 | (unsigned char)payload[1]) : 0;
+                if (len == 1 || (len >= 2 && !websocket_code_valid(code)) ||
+                    !websocket_utf8_valid((const unsigned char *)payload + 2, len >= 2 ? len - 2 : 0)) {
+                    websocket_send_close(conn, 1002, "protocol error", 14);
+                    break;
+                }
+                ws->close_code = code ? code : 1005;
+                ws->close_reason.assign(len > 2 ? payload + 2 : "", len > 2 ? len - 2 : 0);
+                websocket_send_close(conn, code, payload + 2, len > 2 ? len - 2 : 0);
+                break;
+            }
+        }
+    }
+    conn->in.erase(0, consumed);
+    if (conn->close_after_write) {
+        conn->in.clear();  // nothing after a close frame is read
+    }
+}
+
+// Called by conn_close() once the connection is gone.
+static void websocket_closed(Connection *conn) {
+    WebSocket *ws = conn->ws;
+    conn->ws = nullptr;
+    websocket_dispatch(nullptr, ws, "on_close", [&](luna_State *co) {
+        luna_pushinteger(co, ws->close_code);
+        luna_pushlstring(co, ws->close_reason.data(), ws->close_reason.size());
+        return 2;
+    });
+    lunaL_unref(ws->L, LUNA_REGISTRYINDEX, ws->ref);
+    delete ws;
+}
+
+// Checks the upgrade request and answers it: with 101 Switching Protocols,
+// leaving the connection a WebSocket with its Lua object created, or with an
+// error response. Returns whether the handler should run.
+static bool websocket_accept(luna_State *L, const HttpRequest *request, const char *base, int client_socket) {
+    Connection *conn = conn_lookup(client_socket);
+    if (!conn) {
+        conn_write_error(client_socket, 501);  // blocking mode closes after each response
+        return false;
+    }
+    string_view key = websocket_header(request, base, "Sec-WebSocket-Key");
+    if (!websocket_has_token(websocket_header(request, base, "Upgrade"), "websocket") ||
+        !websocket_has_token(websocket_header(request, base, "Connection"), "upgrade") ||
+        websocket_header(request, base, "Sec-WebSocket-Version") != "13" || request->minor_version < 1) {
+        const char *upgrade_required = "HTTP/1.1 426 Upgrade Required\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                       "Sec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n";
+        conn_write(client_socket, upgrade_required, strlen(upgrade_required));
+        return false;
+    }
+    if (key.size() != 24 || key.substr(22) != "==") {
+        conn_write_error(client_socket, 400);
+        return false;
+    }
+
+    char accept[29];
+    websocket_accept_key(key, accept);
+    char response[160];
+    int size = snprintf(response, sizeof(response),
+                        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n\r\n",
+                        accept);
+    conn_write(client_socket, response, size);
+    conn->keep_alive = true;
+
+    WebSocket *ws = new WebSocket();
+    ws->L = L;
+    ws->serial = ++websocket_serial_;
+    ws->message_opcode = 0;
+    ws->close_sent = false;
+    ws->close_code = 1006;
+    WebSocketObject *obj = (WebSocketObject *)luna_newuserdatauv(L, sizeof(WebSocketObject), 1);
+    obj->fd = client_socket;
+    obj->serial = ws->serial;
+    lunaL_setmetatable(L, SERVER_WEBSOCKET);
+    luna_newtable(L);  // callbacks and whatever else Lua stores on it
+    luna_setiuservalue(L, -2, 1);
+    ws->ref = lunaL_ref(L, LUNA_REGISTRYINDEX);
+    conn->ws = ws;
+    return true;
+}
+
+// ws:send(data [, binary]) -> true | nil, error: queues a text (or binary)
+// message
+static int websocket_send(luna_State *L) {
+    WebSocketObject *obj = (WebSocketObject *)lunaL_checkudata(L, 1, SERVER_WEBSOCKET);
+    size_t len;
+    const char *data = lunaL_checklstring(L, 2, &len);
+    bool binary = luna_toboolean(L, 3);
+    Connection *conn = websocket_connection(obj);
+    if (!conn || conn->ws->close_sent) {
+        luna_pushnil(L);
+        luna_pushstring(L, "closed");
+        return 2;
+    }
+    if (conn->out_bytes > 0 && conn->out_bytes + len > WEBSOCKET_MAX_PENDING) {
+        // Dropped rather than buffered without bound; the flush finds the
+        // socket dead and closes it.
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->ws->close_sent = true;
+        conn_schedule_flush(conn);
+        luna_pushnil(L);
+        luna_pushstring(L, "client not reading");
+        return 2;
+    }
+    websocket_send_frame(conn, binary ? WS_BINARY : WS_TEXT, data, len);
+    conn_schedule_flush(conn);
+    luna_pushboolean(L, true);
+    return 1;
+}
+
+// ws:ping([data])
+static int websocket_ping(luna_State *L) {
+    WebSocketObject *obj = (WebSocketObject *)lunaL_checkudata(L, 1, SERVER_WEBSOCKET);
+    size_t len;
+    const char *data = lunaL_optlstring(L, 2, "", &len);
+    lunaL_argcheck(L, len <= 125, 2, "ping data longer than 125 bytes");
+    Connection *conn = websocket_connection(obj);
+    if (conn && !conn->ws->close_sent) {
+        websocket_send_frame(conn, WS_PING, data, len);
+        conn_schedule_flush(conn);
+    }
+    return 0;
+}
+
+// ws:close([code [, reason]]): starts the closing handshake; on_close runs
+// once the connection is gone
+static int websocket_close(luna_State *L) {
+    WebSocketObject *obj = (WebSocketObject *)lunaL_checkudata(L, 1, SERVER_WEBSOCKET);
+    int code = lunaL_optinteger(L, 2, 1000);
+    size_t len;
+    const char *reason = lunaL_optlstring(L, 3, "", &len);
+    lunaL_argcheck(L, websocket_code_valid(code), 2, "invalid close code");
+    lunaL_argcheck(L, len <= 123, 3, "reason longer than 123 bytes");
+    Connection *conn = websocket_connection(obj);
+    if (conn) {
+        websocket_send_close(conn, code, reason, len);
+        conn_schedule_flush(conn);
+    }
+    return 0;
+}
+
+// Methods first, then whatever was stored on the object.
+static int websocket_index(luna_State *L) {
+    luna_pushvalue(L, 2);
+    if (luna_rawget(L, luna_upvalueindex(1)) != LUNA_TNIL) {
+        return 1;
+    }
+    luna_getiuservalue(L, 1, 1);
+    luna_pushvalue(L, 2);
+    luna_rawget(L, -2);
+    return 1;
+}
+
+static int websocket_newindex(luna_State *L) {
+    luna_getiuservalue(L, 1, 1);
+    luna_pushvalue(L, 2);
+    luna_pushvalue(L, 3);
+    luna_rawset(L, -3);
+    return 0;
+}
+
+static int websocket_tostring(luna_State *L) {
+    WebSocketObject *obj = (WebSocketObject *)lunaL_checkudata(L, 1, SERVER_WEBSOCKET);
+    if (!websocket_connection(obj)) {
+        luna_pushstring(L, "websocket (closed)");
+        return 1;
+    }
+    luna_pushfstring(L, "websocket (socket %d)", obj->fd);
+    return 1;
+}
+
+static const lunaL_Reg websocket_methods[] = {
+    {"send", websocket_send},
+    {"ping", websocket_ping},
+    {"close", websocket_close},
+    {nullptr, nullptr}
+};
+
+static void websocket_open(luna_State *L) {
+    if (lunaL_newmetatable(L, SERVER_WEBSOCKET)) {
+        luna_newtable(L);
+        lunaL_setfuncs(L, websocket_methods, 0);
+        luna_pushcclosure(L, websocket_index, 1);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, websocket_newindex);
+        luna_setfield(L, -2, "__newindex");
+        luna_pushcfunction(L, websocket_tostring);
+        luna_setfield(L, -2, "__tostring");
+    }
+    luna_pop(L, 1);
+}
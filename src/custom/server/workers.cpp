@@ -0,0 +1,81 @@
+#include <thread>
+#include <utility>
+
+// -1 until run() starts serving with workers; then 0 for the thread that
+// called run() and 1..N-1 for the threads it spawned.
+static thread_local int worker_id_ = -1;
+
+struct WorkerScript {
+    vector<pair<luna_Integer, string>> args;  // copy of the global 'arg' table
+    string path;
+};
+
+// Each worker gets a fresh interpreter that runs the same script, so route
+// registrations are replicated and nothing is shared between threads. When
+// the script reaches run(), the worker opens its own SO_REUSEPORT listener.
+static void worker_main(int id, WorkerScript script) {
+    worker_id_ = id;
+
+    luna_State *L = lunaL_newstate();
+    lunaL_openlibs(L);
+
+    luna_createtable(L, 0, 0);
+    int nargs = 0;
+    for (auto &arg : script.args) {
+        luna_pushlstring(L, arg.second.data(), arg.second.size());
+        luna_rawseti(L, -2, arg.first);
+        if (arg.first > nargs) {
+            nargs = arg.first;
+        }
+    }
+    luna_setglobal(L, "arg");
+
+    if (lunaL_loadfile(L, script.path.c_str()) == LUNA_OK) {
+        luna_getglobal(L, "arg");
+        for (int i = 1; i <= nargs; i++) {
+            luna_rawgeti(L, -i, i);
+        }
+        luna_remove(L, -nargs - 1);
+        if (luna_pcall(L, nargs, 0, 0) == LUNA_OK) {
+            luna_close(L);
+            return;
+        }
+    }
+    fprintf(stderr, "Worker %d: %s\n", id, luna_tostring(L, -1));
+    luna_close(L);
+}
+
+// Starts workers 1..count-1 running the script that called run(); the caller
+// becomes worker 0. count == 0 means one worker per online CPU.
+static int spawn_workers(luna_State *L, int count) {
+    if (count == 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    WorkerScript script;
+    if (luna_getglobal(L, "arg") != LUNA_TTABLE) {
+        return lunaL_error(L, "workers need the server to be started from a script file");
+    }
+    luna_pushnil(L);
+    while (luna_next(L, -2) != 0) {
+        if (luna_isinteger(L, -2) && luna_type(L, -1) == LUNA_TSTRING) {
+            size_t len;
+            const char *value = luna_tolstring(L, -1, &len);
+            script.args.emplace_back(luna_tointeger(L, -2), string(value, len));
+            if (luna_tointeger(L, -2) == 0) {
+                script.path.assign(value, len);
+            }
+        }
+        luna_pop(L, 1);
+    }
+    luna_pop(L, 1);
+    if (script.path.empty()) {
+        return lunaL_error(L, "workers need the server to be started from a script file");
+    }
+
+    worker_id_ = 0;
+    for (int id = 1; id < count; id++) {
+        thread(worker_main, id, script).detach();
+    }
+    return count;
+}
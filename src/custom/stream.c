@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Record reader over a file: stream.open(path [, options]) reads it in large
+// blocks with read(), straight into a buffer of its own, and hands out the
+// records between delimiters. There is no FILE underneath, so no per-line
+// locking, and the delimiter is found with memchr() (memmem() for longer
+// ones), which glibc vectorises.
+//
+//   local s = stream.open("access.log")
+//   for line in s:lines() do ... end
+//   s:close()
+//
+//   for record in stream.lines("data.bin", {delimiter = "\0"}) do ... end
+//
+// Options: delimiter (default "\n", any length), keep (leave the delimiter
+// on each record, default false) and block_size (bytes per read(), default
+// 1 MiB). As with io.lines, the last record is returned whether or not a
+// delimiter ends it, and an empty file has none.
+
+#define STREAM "stream"
+#define STREAM_BLOCK (1024 * 1024)
+#define STREAM_MAX_DELIMITER 64
+
+typedef struct Stream {
+    int fd;                  // -1 once closed
+    char *buffer;
+    size_t capacity;         // grows to hold the longest record
+    size_t start;            // first unread byte
+    size_t end;              // end of the bytes read
+    size_t scanned;          // [start, scanned) holds no whole delimiter
+    size_t block;            // bytes to ask read() for at a time
+    int eof;
+    int keep;
+    size_t delimiter_len;
+    char delimiter[STREAM_MAX_DELIMITER];
+} Stream;
+
+static Stream *check_stream(luna_State *L) {
+    Stream *s = (Stream *)lunaL_checkudata(L, 1, STREAM);
+    lunaL_argcheck(L, s->fd >= 0, 1, "stream is closed");
+    return s;
+}
+
+// Reads another block, making room first by dropping what has been
+// returned or, if the record so far fills the buffer, by growing it.
+static void stream_fill(luna_State *L, Stream *s) {
+    if (s->start > 0 && s->end + s->block > s->capacity) {
+        memmove(s->buffer, s->buffer + s->start, s->end - s->start);
+        s->end -= s->start;
+        s->scanned -= s->start;
+        s->start = 0;
+    }
+    if (s->end + s->block > s->capacity) {
+        size_t capacity = s->capacity * 2 > s->end + s->block ? s->capacity * 2 : s->end + s->block;
+        char *buffer = (char *)realloc(s->buffer, capacity);
+        if (!buffer) {
+            lunaL_error(L, "not enough memory for a record of %I bytes", (luna_Integer)(s->end - s->start));
+        }
+        s->buffer = buffer;
+        s->capacity = capacity;
+    }
+    while (1) {
+        ssize_t n = read(s->fd, s->buffer + s->end, s->capacity - s->end);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            lunaL_error(L, "error reading stream: %s", strerror(errno));
+        }
+        if (n == 0) {
+            s->eof = 1;
+        }
+        s->end += n;
+        return;
+    }
+}
+
+// s:read() is the next record, or nil after the last. It is also what
+// lines() iterates with.
+static int stream_read(luna_State *L) {
+    Stream *s = check_stream(L);
+    while (1) {
+        const char *from = s->buffer + s->scanned;
+        size_t len = s->end - s->scanned;
+        const char *found = s->delimiter_len == 1 ? (const char *)memchr(from, s->delimiter[0], len)
+                                                  : (const char *)memmem(from, len, s->delimiter, s->delimiter_len);
+        if (found) {
+            size_t record_end = found - s->buffer;
+            size_t next = record_end + s->delimiter_len;
+            luna_pushlstring(L, s->buffer + s->start, (s->keep ? next : record_end) - s->start);
+            s->start = s->scanned = next;
+            return 1;
+        }
+        if (s->eof) {
+            if (s->start == s->end) {
+                return 0;
+            }
+            luna_pushlstring(L, s->buffer + s->start, s->end - s->start);
+            s->start = s->scanned = s->end;
+            return 1;
+        }
+        // A delimiter may straddle the end of what has been read
+        s->scanned = s->end - s->start >= s->delimiter_len ? s->end - (s->delimiter_len - 1) : s->start;
+        stream_fill(L, s);
+    }
+}
+
+static int stream_lines(luna_State *L) {
+    check_stream(L);
+    luna_pushcfunction(L, stream_read);
+    luna_pushvalue(L, 1);
+    return 2;
+}
+
+static int stream_close(luna_State *L) {
+    Stream *s = (Stream *)lunaL_checkudata(L, 1, STREAM);
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    free(s->buffer);
+    s->buffer = NULL;
+    return 0;
+}
+
+static int stream_tostring(luna_State *L) {
+    Stream *s = (Stream *)lunaL_checkudata(L, 1, STREAM);
+    luna_pushstring(L, s->fd >= 0 ? "stream" : "stream (closed)");
+    return 1;
+}
+
+static const lunaL_Reg stream_methods[] = {
+    {"read", stream_read},
+    {"lines", stream_lines},
+    {"close", stream_close},
+    {NULL, NULL}
+};
+
+// Pushes a stream over path, or nil, a message and an errno.
+static int stream_push(luna_State *L, const char *path, int options) {
+    size_t delimiter_len = 1;
+    const char *delimiter = "\n";
+    luna_Integer block = STREAM_BLOCK;
+    int keep = 0;
+    if (!luna_isnoneornil(L, options)) {
+        lunaL_checktype(L, options, LUNA_TTABLE);
+        luna_getfield(L, options, "delimiter");
+        delimiter = lunaL_optlstring(L, -1, delimiter, &delimiter_len);
+        lunaL_argcheck(L, delimiter_len > 0 && delimiter_len <= STREAM_MAX_DELIMITER, options, "invalid delimiter");
+        luna_getfield(L, options, "block_size");
+        block = lunaL_optinteger(L, -1, block);
+        lunaL_argcheck(L, block >= 4096 && block <= 1024 * 1024 * 1024, options, "invalid block_size");
+        luna_getfield(L, options, "keep");
+        keep = luna_toboolean(L, -1);
+        luna_pop(L, 3);
+    }
+
+    Stream *s = (Stream *)luna_newuserdatauv(L, sizeof(Stream), 0);
+    s->fd = -1;
+    s->buffer = NULL;
+    if (lunaL_newmetatable(L, STREAM)) {
+        luna_newtable(L);
+        lunaL_setfuncs(L, stream_methods, 0);
+        luna_setfield(L, -2, "__index");
+        luna_pushcfunction(L, stream_close);
+        luna_setfield(L, -2, "__gc");
+        luna_pushcfunction(L, stream_close);
+        luna_setfield(L, -2, "__close");
+        luna_pushcfunction(L, stream_tostring);
+        luna_setfield(L, -2, "__tostring");
+    }
+    luna_setmetatable(L, -2);
+
+    s->block = (size_t)block;
+    s->capacity = s->block * 2;
+    s->buffer = (char *)malloc(s->capacity);
+    if (!s->buffer) {
+        return lunaL_error(L, "not enough memory for a stream");
+    }
+    s->start = s->end = s->scanned = 0;
+    s->eof = 0;
+    s->keep = keep;
+    s->delimiter_len = delimiter_len;
+    memcpy(s->delimiter, delimiter, delimiter_len);
+
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0) {
+        return lunaL_fileresult(L, 0, path);
+    }
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 1;
+}
+
+// stream.open(path [, options])
+static int stream_open(luna_State *L) {
+    return stream_push(L, lunaL_checkstring(L, 1), 2);
+}
+
+// stream.lines(path [, options]) iterates over the records of path and
+// closes it when the loop ends, however it ends.
+static int stream_open_lines(luna_State *L) {
+    const char *path = lunaL_checkstring(L, 1);
+    if (stream_push(L, path, 2) != 1) {
+        return lunaL_error(L, "%s", luna_tostring(L, -2));
+    }
+    luna_pushcfunction(L, stream_read);
+    luna_insert(L, -2);
+    luna_pushnil(L);
+    luna_pushvalue(L, -2);  // to-be-closed
+    return 4;
+}
+
+static const lunaL_Reg stream_funcs[] = {
+    {"open", stream_open},
+    {"lines", stream_open_lines},
+    {NULL, NULL}
+};
+
+// Sets the global stream table.
+static void stream_open_lib(luna_State *L) {
+    lunaL_newlib(L, stream_funcs);
+    luna_setglobal(L, "stream");
+}
@@ -508,6 +508,7 @@ LUAMOD_API int luaopen_base (luna_State *L) {
   /* open lib into global table */
   luna_pushglobaltable(L);
   lunaL_setfuncs(L, base_funcs, 0);
+  open_custom_libs(L);
   /* set global _G */
   luna_pushvalue(L, -1);
   luna_setfield(L, -2, LUNA_GNAME);